@@ -0,0 +1,157 @@
+#define _POSIX_C_SOURCE 199309L // For clock_gettime.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <omp.h>
+#include "data.h"
+#include "functions.h"
+#include "collisions.h"
+#include "forces_simd.h"
+
+// Size of the packed bed, and number of times the forces are computed for each law.
+#define X_PARTICLES 120
+#define Y_PARTICLES 60
+#define REPETITIONS 50
+#define RADIUS 50.0
+#define SQUARE_LENGTH 120.0
+
+/**
+ * Returns the current time, in seconds.
+ */
+double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + (time.tv_nsec * 1e-9);
+}
+
+/**
+ * Runs compute_forces_simd REPETITIONS times with the given law and kernel level,
+ * and prints the average cost per contact.
+ * One untimed run first, so the history pages are already mapped.
+ */
+void bench_law(const char *name, const ContactLaw law, const SimdLevel level, const ContactLawParams *params,
+               const size_t num_particles, const size_t contacts_size, const Particle *particles,
+               const Material *materials, const MaterialId *material_ids, const Contact *contacts,
+               const Vector *velocities, accum *normal_forces, accum *tangent_forces, Vector *forces) {
+  compute_forces_simd(level, law, params, 0.000025, num_particles, contacts_size, particles, materials, material_ids,
+                      contacts, velocities, normal_forces, tangent_forces, forces);
+
+  const double start = now();
+  for (int i = 0; i < REPETITIONS; ++i) {
+    compute_forces_simd(level, law, params, 0.000025, num_particles, contacts_size, particles, materials, material_ids,
+                        contacts, velocities, normal_forces, tangent_forces, forces);
+  }
+  const double elapsed = now() - start;
+  printf("%-24s %8.2f ns/contact\n", name, (elapsed * 1e9) / ((double) REPETITIONS * contacts_size));
+}
+
+/**
+ * Runs the linear law REPETITIONS times with the given force accumulation, and prints the average cost per contact.
+ * The deterministic accumulation includes the grouping of the contacts, which it does every step.
+ */
+void bench_accumulation(const char *name, const ForceAccumulation accumulation, const ContactLawParams *params,
+                        const size_t num_particles, const size_t contacts_size, const Particle *particles,
+                        const Material *materials, const MaterialId *material_ids, const Contact *contacts,
+                        const Vector *velocities, accum *normal_forces, accum *tangent_forces, Vector *forces,
+                        size_t *contact_offsets, size_t *contact_order) {
+  double elapsed = 0;
+  for (int i = 0; i <= REPETITIONS; ++i) {
+    const double start = now();
+    if (accumulation == FORCE_ACCUMULATION_ATOMIC) {
+      compute_forces_atomic(CONTACT_LAW_LINEAR, params, 0.000025, num_particles, contacts_size, particles, materials,
+                            material_ids, contacts, velocities, normal_forces, tangent_forces, forces);
+    } else if (accumulation == FORCE_ACCUMULATION_DETERMINISTIC) {
+      group_contacts(num_particles, contacts_size, contacts, contact_offsets, contact_order);
+      compute_forces_grouped(CONTACT_LAW_LINEAR, params, 0.000025, num_particles, particles, materials, material_ids,
+                             contacts, contact_offsets, contact_order, velocities, normal_forces, tangent_forces,
+                             forces);
+    } else {
+      compute_forces(CONTACT_LAW_LINEAR, params, 0.000025, num_particles, contacts_size, particles, materials,
+                     material_ids, contacts, velocities, normal_forces, tangent_forces, forces);
+    }
+    // The first run is untimed, so the history pages are already mapped.
+    if (i > 0) {
+      elapsed += now() - start;
+    }
+  }
+  printf("%-24s %8.2f ns/contact (%d threads)\n", name, (elapsed * 1e9) / ((double) REPETITIONS * contacts_size),
+         omp_get_max_threads());
+}
+
+/**
+ * Benchmark entry point.
+ * Packs a bed of slightly overlapping particles, finds its contacts with the grid,
+ * and times the contact loop of each law on the same contacts,
+ * and the linear law with each force accumulation.
+ */
+int main(void) {
+  const size_t num_particles = X_PARTICLES * Y_PARTICLES;
+  const int x_squares = (2 * RADIUS * X_PARTICLES / SQUARE_LENGTH) + 2;
+  const int y_squares = (2 * RADIUS * Y_PARTICLES / SQUARE_LENGTH) + 2;
+
+  Particle *particles = (Particle*) calloc(num_particles, sizeof(Particle));
+  MaterialId *material_ids = (MaterialId*) calloc(num_particles, sizeof(MaterialId));
+  Vector *velocities = (Vector*) calloc(num_particles, sizeof(Vector));
+  Vector *forces = (Vector*) calloc(num_particles, sizeof(Vector));
+  Contact *contacts = (Contact*) calloc(num_particles * 8, sizeof(Contact));
+  accum *normal_forces = (accum*) calloc(num_particles * num_particles, sizeof(accum));
+  accum *tangent_forces = (accum*) calloc(num_particles * num_particles, sizeof(accum));
+  Particle **grid = (Particle**) calloc(x_squares * y_squares, sizeof(Particle*));
+  Particle **grid_lasts = (Particle**) calloc(x_squares * y_squares, sizeof(Particle*));
+  size_t *contact_offsets = (size_t*) calloc(num_particles + 1, sizeof(size_t));
+  size_t *contact_order = (size_t*) calloc(num_particles * 8, sizeof(size_t));
+
+  // Every particle is of material 0.
+  const Material materials[1] = { { 0.18, 2474358.297, 190335.254, 1 / 0.18 } };
+
+  // Spacing a bit shorter than the diameter, so every neighbor is in contact.
+  const double spacing = 1.98 * RADIUS;
+  for (size_t i = 0; i < num_particles; ++i) {
+    particles[i].x_coordinate = ((i % X_PARTICLES) * spacing) - (X_PARTICLES * RADIUS);
+    particles[i].y_coordinate = RADIUS + ((i / X_PARTICLES) * spacing);
+    particles[i].radius = RADIUS;
+    particles[i].idx = i;
+    velocities[i].x_component = ((double) (i % 7) - 3) * 0.01;
+    velocities[i].y_component = ((double) (i % 5) - 2) * 0.01;
+  }
+
+  fill_grid(num_particles, x_squares, y_squares, SQUARE_LENGTH, particles, grid, grid_lasts);
+  const size_t contacts_size = compute_contacts((Particle const *const *) grid, x_squares, y_squares,
+                                                SQUARE_LENGTH, contacts);
+  printf("%zu particles, %zu contacts, %d repetitions\n", num_particles, contacts_size, REPETITIONS);
+
+  ContactLawParams params;
+  init_contact_law_params(30, 0.1, 70000000000.0, 0.25, &params);
+
+  bench_law("linear", CONTACT_LAW_LINEAR, SIMD_NONE, &params, num_particles, contacts_size, particles,
+            materials, material_ids, contacts, velocities, normal_forces, tangent_forces, forces);
+  bench_law("linear (vectorized)", CONTACT_LAW_LINEAR, detect_simd_level(), &params, num_particles, contacts_size,
+            particles, materials, material_ids, contacts, velocities, normal_forces, tangent_forces, forces);
+  bench_law("linear_damped", CONTACT_LAW_LINEAR_DAMPED, SIMD_NONE, &params, num_particles, contacts_size,
+            particles, materials, material_ids, contacts, velocities, normal_forces, tangent_forces, forces);
+  bench_law("hertz_mindlin", CONTACT_LAW_HERTZ_MINDLIN, SIMD_NONE, &params, num_particles, contacts_size,
+            particles, materials, material_ids, contacts, velocities, normal_forces, tangent_forces, forces);
+
+  bench_accumulation("linear (serial)", FORCE_ACCUMULATION_SERIAL, &params, num_particles, contacts_size, particles,
+                     materials, material_ids, contacts, velocities, normal_forces, tangent_forces, forces,
+                     contact_offsets, contact_order);
+  bench_accumulation("linear (atomic)", FORCE_ACCUMULATION_ATOMIC, &params, num_particles, contacts_size, particles,
+                     materials, material_ids, contacts, velocities, normal_forces, tangent_forces, forces,
+                     contact_offsets, contact_order);
+  bench_accumulation("linear (deterministic)", FORCE_ACCUMULATION_DETERMINISTIC, &params, num_particles, contacts_size,
+                     particles, materials, material_ids, contacts, velocities, normal_forces, tangent_forces, forces,
+                     contact_offsets, contact_order);
+
+  free(particles);
+  free(material_ids);
+  free(velocities);
+  free(forces);
+  free(contacts);
+  free(normal_forces);
+  free(tangent_forces);
+  free(grid);
+  free(grid_lasts);
+  free(contact_offsets);
+  free(contact_order);
+  return EXIT_SUCCESS;
+}
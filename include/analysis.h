@@ -0,0 +1,61 @@
+#pragma once
+
+#include "data.h"
+
+// Bins of the normal force distribution, each one a quarter of the mean normal force wide.
+// The last bin also counts every force above its lower limit.
+#define FORCE_HISTOGRAM_BINS 16
+#define FORCE_HISTOGRAM_BIN_WIDTH 0.25
+
+/**
+ * Derived quantities of one simulation step.
+ * Each pair of particles in contact is counted once, even if contacts has both directions.
+ */
+typedef struct {
+  size_t contacts; // Pairs of particles in contact.
+  double coordination_number; // Mean contacts per particle.
+  double mean_normal_force;
+  double max_normal_force;
+  double strong_fraction; // Fraction of the contacts with a normal force above the mean, the force chains.
+  size_t force_histogram[FORCE_HISTOGRAM_BINS]; // Contacts by normal force relative to the mean.
+  double fabric_xx; // Fabric tensor: mean of the outer product of the contact normals.
+  double fabric_xy;
+  double fabric_yy;
+  double kinetic_energy;
+  double front_y; // Lowest point of the falling particle (index 0).
+  double front_velocity; // Vertical velocity of the falling particle.
+} StepStatistics;
+
+/**
+ * Measures of how far the particles are from mechanical equilibrium, to end the run early.
+ */
+typedef struct {
+  double kinetic_energy;
+  double max_speed;
+  double unbalanced_force_ratio; // Sum of the net forces (contacts and gravity) over the sum of the weights.
+} EquilibriumMeasures;
+
+/**
+ * Computes the statistics of the contact network from the contacts of the step,
+ * their normal forces (rows of history_stride) and the velocities of the particles, in parallel.
+ * The removed particles (radius 0) are not counted.
+ */
+void compute_statistics(const size_t particles_size, const size_t history_stride, const size_t contacts_size,
+                        const Particle *particles, const Material *materials, const MaterialId *material_ids,
+                        const Contact *contacts, const accum *normal_forces,
+                        const Vector *velocities, StepStatistics *statistics);
+
+/**
+ * Returns the largest speed of the particles, in parallel.
+ * The removed particles (radius 0) are not counted.
+ */
+double max_speed(const size_t particles_size, const Particle *particles, const Vector *velocities);
+
+/**
+ * Computes the kinetic energy, the largest speed and the unbalanced force ratio of the particles, in parallel,
+ * from the contact forces of the step (without gravity, which is added here).
+ * The removed particles (radius 0) are not counted.
+ */
+void compute_equilibrium(const size_t particles_size, const Particle *particles, const Material *materials,
+                         const MaterialId *material_ids, const Vector *velocities, const Vector *forces,
+                         EquilibriumMeasures *measures);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+
+// Alignment of every allocation of the arena, one cache line, enough for any vector load.
+#define ARENA_ALIGNMENT 64
+
+/**
+ * Kind of pages backing the arena.
+ */
+typedef enum {
+  ARENA_PAGES_DEFAULT = 0, // Regular pages.
+  ARENA_PAGES_TRANSPARENT = 1, // Regular mapping, advised to use transparent huge pages.
+  ARENA_PAGES_HUGETLB = 2 // Explicit huge pages (MAP_HUGETLB), falls back to transparent ones.
+} ArenaPages;
+
+/**
+ * A single memory region, from which all the simulation structures are carved.
+ * The memory is zeroed and its pages are not touched until first written,
+ * so each page ends up on the NUMA node of the thread that first writes it.
+ */
+typedef struct {
+  char *base;
+  size_t size; // Mapped bytes.
+  size_t used;
+  ArenaPages pages; // Kind of pages actually obtained.
+} Arena;
+
+/**
+ * Returns the bytes that an allocation of count elements of the given size takes in the arena.
+ */
+size_t arena_aligned_size(const size_t count, const size_t size);
+
+/**
+ * Maps a region of at least 'size' bytes. Returns 0 on success.
+ */
+int arena_create(Arena *arena, const size_t size, const ArenaPages pages);
+
+/**
+ * Carves an aligned, zeroed, array of count elements of the given size.
+ * Returns NULL if the arena is exhausted.
+ */
+void *arena_alloc(Arena *arena, const size_t count, const size_t size);
+
+/**
+ * Touches every page of an array of count rows of the given size, in parallel,
+ * splitting the rows between the threads like the static schedule of the simulation loops.
+ * This way, each page is placed on the NUMA node of the thread that later processes those rows.
+ */
+void arena_first_touch(void *data, const size_t count, const size_t size);
+
+/**
+ * Unmaps the region.
+ */
+void arena_destroy(Arena *arena);
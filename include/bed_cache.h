@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "data.h"
+
+// First bytes of a settled bed file, and version of its layout.
+#define BED_CACHE_MAGIC "2DPBED"
+#define BED_CACHE_VERSION 2
+
+// Parameters of the 64 bits FNV-1a hash.
+#define FNV1A_OFFSET_BASIS UINT64_C(14695981039346656037)
+#define FNV1A_PRIME UINT64_C(1099511628211)
+
+/**
+ * Header at the start of a settled bed file. It is followed by the x and y of each particle,
+ * its velocity, and the non zero entries of the particle and wall contact histories.
+ */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t real_size; // sizeof(real) of the build that wrote it.
+  uint64_t key; // Hash of the settings that shape the bed.
+  uint64_t num_particles;
+  uint64_t num_walls;
+  uint64_t settle_steps; // Steps it took to settle.
+  uint64_t num_history; // Entries of the particle contact history.
+  uint64_t num_wall_history; // Entries of the wall contact history.
+  uint64_t checksum; // FNV-1a hash of everything after the header.
+} BedCacheHeader;
+
+/**
+ * One non zero entry of a contact history: the forces at (row * stride) + column.
+ */
+typedef struct {
+  uint64_t row;
+  uint64_t column;
+  accum normal;
+  accum tangent;
+} BedCacheEntry;
+
+/**
+ * Returns the FNV-1a hash of size bytes of data, continuing from hash.
+ * Start with FNV1A_OFFSET_BASIS.
+ */
+uint64_t fnv1a(uint64_t hash, const void *data, const size_t size);
+
+/**
+ * Writes the positions, the velocities and the contact histories (rows of history_stride)
+ * of the particles to the path, through a temporary file renamed at the end,
+ * so concurrent runs never read a partial file. Returns 0 on success.
+ */
+int bed_cache_save(const char *path, const uint64_t key, const uint64_t settle_steps,
+                   const size_t num_particles, const size_t history_stride, const Particle *particles,
+                   const Vector *velocities, const accum *normal_forces, const accum *tangent_forces,
+                   const size_t num_walls, const accum *wall_normal_forces, const accum *wall_tangent_forces);
+
+/**
+ * Reads a file written by bed_cache_save into the given arrays, which must be zeroed,
+ * if its key, number of particles and walls, and precision match. Returns 0 on success.
+ * The whole file is checked first (its size, the bounds of the history entries and the checksum),
+ * so a truncated or corrupted file leaves the arrays untouched.
+ * The radius, id and material of the particles are not stored, and are left as they are.
+ */
+int bed_cache_load(const char *path, const uint64_t key, uint64_t *settle_steps,
+                   const size_t num_particles, const size_t history_stride, Particle *particles,
+                   Vector *velocities, accum *normal_forces, accum *tangent_forces,
+                   const size_t num_walls, accum *wall_normal_forces, accum *wall_tangent_forces);
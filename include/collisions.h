@@ -1,6 +1,19 @@
 #pragma once
 #include "data.h"
 
+/**
+ * Helper function. Return the column number given an x coordinate. If the x coordinate lies outside the x dimension covered by the grid,
+ * then return a negative number: -2 for the left boundary and -1 for the right boundary.
+ * With periodic boundaries along X, the coordinate is wrapped first, so it is always inside.
+ */
+int find_col(const double x_coordinate, const int x_squares, const double square_length);
+
+/**
+ * Helper function. Return the row number given an y coordinate. If the y coordinate lies below 0,
+ * then return a negative number: -2 for the left boundary and -1 for the right boundary.
+ */
+int find_row(const double y, const int y_squares, const double square_length);
+
 /**
  * From the Grid, find all the pairs of particles that are colliding with each other, create a struct Contact for
  * each one and save it into 'contacts'. Returns the number of collisions.
@@ -24,5 +37,60 @@ size_t compute_contacts(Particle const *const *const grid, const int x_squares,
 /**
  * Fills the grid with particles. This updates the value of a pointer in grid when a particle is inside a square, and updates the pointer of the last
  * particle in the last position of the singly linked list of the square. Running time is O(N), and memory space is O(N) but really 2*N because of 'grid_lasts' pointers array.
+ * Removed particles (radius 0) are left out.
  */
 void fill_grid(const size_t num_particles, const int x_squares, const int y_squares, const double square_length, Particle const *const particles, Particle* *const grid, Particle** grid_lasts);
+
+/**
+ * Registers each wall in every square of the grid that it could touch, in compressed rows:
+ * the walls of square i are wall_cells[wall_cells_start[i]] to wall_cells[wall_cells_start[i + 1] - 1].
+ * 'wall_cells_start' must hold x_squares * y_squares + 1 elements. 'margin' is the largest particle radius.
+ * If wall_cells is NULL, only wall_cells_start is filled. Returns the total number of registrations.
+ */
+size_t bin_walls(const size_t num_walls, const Wall *walls, const int x_squares, const int y_squares,
+                 const double square_length, const double margin, size_t *wall_cells_start, size_t *wall_cells);
+
+/**
+ * From the Grid and the walls registered in each square, find all the particles touching a wall,
+ * create a struct WallContact for each one and save it into 'wall_contacts'. Returns the number of contacts.
+ */
+size_t compute_wall_contacts(Particle const *const *const grid, const int x_squares, const int y_squares,
+                             const Wall *walls, const size_t *wall_cells_start, const size_t *wall_cells,
+                             WallContact* wall_contacts);
+
+/**
+ * Algorithm used to find the candidate pairs of particles in contact.
+ */
+typedef enum {
+  BROAD_PHASE_GRID = 0, // Neighboring squares of the grid, compute_contacts.
+  BROAD_PHASE_SWEEP = 1, // Sort and sweep along X, compute_contacts_sweep.
+  BROAD_PHASE_AUTO = 2 // Times both on the initial state and keeps the fastest.
+} BroadPhase;
+
+/**
+ * One particle in the sort and sweep order: the left end of its extent along X, and its index.
+ */
+typedef struct {
+  real min_x;
+  size_t idx;
+} SweepEntry;
+
+/**
+ * Particles sorted by the left end of their extent along X, kept between steps:
+ * the particles barely move each step, so the order is almost sorted already.
+ * 'entries' must hold as many elements as the particle arrays. 'size' is 0 until the first sort.
+ */
+typedef struct {
+  size_t size;
+  SweepEntry *entries;
+} SweepList;
+
+/**
+ * Same contacts as compute_contacts (each one listed in both directions), found by sorting the particles
+ * by the left end of their extent along X, and comparing each one only with the following ones
+ * that start before it ends. Unlike the grid, its cost does not depend on how evenly the particles fill the squares.
+ * Like fill_grid, the removed particles and the ones outside the grid are left out.
+ * The contacts are found in a different order than compute_contacts. Not valid with periodic boundaries.
+ */
+size_t compute_contacts_sweep(const size_t particles_size, const Particle *particles, const int x_squares,
+                              const int y_squares, const double square_length, SweepList *list, Contact *contacts);
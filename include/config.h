@@ -1,5 +1,29 @@
 #pragma once
 
+#include "data.h"
+#include "contact_laws.h"
+#include "frame_stream.h"
+extern "C" {
+  #include "arena.h"
+  #include "render.h"
+  #include "population.h"
+  #include "collisions.h"
+  #include "bed_cache.h"
+  #include "functions.h"
+  #include "fields.h"
+}
+
+/**
+ * Extra material of the bed, given to its rows first_row to last_row (0 is the bottom row).
+ */
+typedef struct {
+  double rho;
+  double kn;
+  double ks;
+  int first_row;
+  int last_row;
+} MaterialLayer;
+
 /**
  * Represents the parsed config file.
  */
@@ -8,9 +32,9 @@ typedef struct {
   double dt;
   int x_particles;
   int y_particles;
-  int x_squares;
-  int y_squares;
-  double square_in_grid_length;
+  int x_squares; // 0 to derive it from the scene.
+  int y_squares; // 0 to derive it from the scene.
+  double square_in_grid_length; // 0 to derive it from the radius.
   double radius;
   double kn;
   double ks;
@@ -18,10 +42,78 @@ typedef struct {
   double thickness;
   double v0;
   double r0;
+  // Optional settings.
+  Wall *walls; // Wall segments, including the segments of every polyline.
+  int num_walls;
+  ContactLaw contact_law; // linear, linear_damped or hertz_mindlin.
+  double friction_angle; // In degrees.
+  double damping_ratio; // Fraction of the critical damping, for linear_damped.
+  double young_modulus; // In Pa, for hertz_mindlin.
+  double poisson_ratio; // For hertz_mindlin.
+  ArenaPages huge_pages; // Pages backing the simulation data structures.
+  int output_every; // Steps between the particles CSV files.
+  int csv_precision; // Significant digits of the particles CSV files, 0 for the shortest exact ones.
+  int stats_every; // Steps between the rows of the statistics time series, 0 to disable it.
+  int render_every; // Steps between the PNG frames, 0 to disable them.
+  int render_width; // In pixels.
+  int render_height; // In pixels, follows the grid aspect ratio when not given.
+  RenderColor render_color; // velocity, force or id.
+  int capacity; // Particles the arrays can hold, at least the initial ones.
+  ParticleSource *sources; // Inflow of particles.
+  int num_sources;
+  Region keep_region; // The particles that leave it are removed.
+  int has_keep_region;
+  int compact_every; // Steps between the compactions of the particle arrays.
+  size_t *tracked; // Particles kept by the flight recorder.
+  int num_tracked;
+  int recorder_steps; // Steps kept by the flight recorder.
+  double recorder_max_speed; // Speed considered a blow up, 0 to only catch non finite values.
+  int periodic_x; // 1 if the grid wraps around along X.
+  BroadPhase broad_phase; // grid, sweep or auto.
+  MaterialLayer *material_layers; // Materials 1 and up. Material 0 is rho, kn and ks.
+  int num_material_layers;
+  char *status_socket; // Unix domain socket of the status server, NULL to not listen on one.
+  int status_port; // Localhost TCP port of the status server, 0 to not listen on one.
+  char *settle_cache; // Folder of the settled beds, NULL to not settle the bed before the run.
+  double settle_speed; // The bed is at rest when all its particles are slower than this...
+  double settle_window; // ...for this many seconds.
+  double settle_max_time; // Longest settling phase, in seconds.
+  DampingMode settle_damping; // none, local or viscous, while the bed settles.
+  double settle_damping_strength; // 0 to 1 for local damping, in 1/s for viscous damping.
+  double settle_damping_time; // Seconds of settling with damping, 0 for all of it.
+  char *stream; // Target of the frame stream (stdout, fifo:<path> or unix:<path>), NULL to write CSV files.
+  StreamPolicy stream_policy; // block or drop, when the consumer is slower than the simulation.
+  int stream_buffers; // Frames that can wait to be written.
+  ForceAccumulation force_accumulation; // serial, atomic or deterministic.
+  int fields_every; // Steps between the continuum field files, 0 to disable them.
+  int fields_cell_squares; // Squares of the grid per side of a field cell.
+  int converge_every; // Steps between the equilibrium checks, 0 to always run the whole simulation_time.
+  double converge_kinetic_ratio; // Kinetic energy over its peak, 0 to not check it.
+  double converge_max_speed; // Largest particle speed, 0 to not check it.
+  double converge_force_ratio; // Unbalanced force ratio, 0 to not check it.
+  size_t max_memory; // Bytes of simulation data structures a plan accepts, 0 for no limit.
+  size_t max_disk; // Bytes of output files a plan accepts, 0 for no limit.
+  int plan_steps; // Steps timed by a plan.
+  int trace_first_step; // First step of the timeline of the phases.
+  int trace_last_step; // Last step of the timeline, 0 to not trace.
+  int trace_events; // Events each thread can record in the timeline.
 } Config;
 
 /**
  * Parses the provided config file,
  * and stores the results in the provided structure.
+ * Optional settings not present in the file keep their default values.
  */
 void parse_config(const char *filename, Config *config);
+
+/**
+ * Returns the FNV-1a hash of the settings that determine the settled bed: the lattice, the grid,
+ * the materials, the contact law, the walls, the settling criteria and damping, the broad phase it settles with,
+ * the force accumulation and the precision of the build, but not v0, the simulation time or the output settings.
+ */
+uint64_t settled_bed_key(const Config *config);
+
+/**
+ * Frees the memory allocated by parse_config.
+ */
+void free_config(Config *config);
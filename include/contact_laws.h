@@ -0,0 +1,158 @@
+#pragma once
+
+#include <math.h>
+#include "data.h"
+
+// tan((30 * PI) / 180).
+#define TAN_30_PI_180 0.5773502691896257
+
+// Velocities are in meters per second, but coordinates are in millimeters.
+#define METERS_TO_COORDINATES REAL_C(1000.0)
+
+/**
+ * Contact laws available for the particle-particle and particle-wall contacts.
+ * The contact loops are compiled once per law (see contact_loop.inc),
+ * so the law is only selected once per step, never per contact.
+ */
+typedef enum {
+  CONTACT_LAW_LINEAR = 0, // Incremental linear springs with a Coulomb limit.
+  CONTACT_LAW_LINEAR_DAMPED = 1, // Linear springs plus viscous dashpots.
+  CONTACT_LAW_HERTZ_MINDLIN = 2 // Hertz normal force, Mindlin tangential stiffness.
+} ContactLaw;
+
+/**
+ * Parameters shared by all the contacts, for the selected law.
+ */
+typedef struct {
+  accum friction; // Tangent of the friction angle.
+  accum damping_ratio; // Fraction of the critical damping, used by the damped law.
+  accum effective_young_modulus; // E / (2 (1 - v^2)), in Pa, used by the Hertz-Mindlin law.
+  accum effective_shear_modulus; // G / (2 (2 - v)), in Pa, used by the Hertz-Mindlin law.
+} ContactLawParams;
+
+/**
+ * Kinematics of a contact, for P2 with respect to P1.
+ */
+typedef struct {
+  accum dt;
+  accum normal_velocity; // Positive when the particles approach each other.
+  accum tangent_velocity;
+  accum overlap; // In coordinates units.
+  accum effective_radius; // In coordinates units.
+  accum effective_mass;
+  accum kn; // Normal rigidity of the pair.
+  accum ks; // Tangential rigidity of the pair.
+} ContactInput;
+
+/**
+ * Rigidity of a contact between two materials: the harmonic mean of their rigidities,
+ * the same whichever particle is P2, so the forces on the two particles are equal and opposite.
+ * Exactly the rigidity when both are the same, and 0 when either is.
+ */
+static inline accum pair_rigidity(const accum k1, const accum k2) {
+  if (k1 == k2) {
+    return k1;
+  }
+  return (k1 > 0 && k2 > 0) ? (2 * k1 * k2) / (k1 + k2) : 0;
+}
+
+/**
+ * Fills the contact law parameters from the material constants.
+ * The friction angle is in degrees.
+ */
+static inline void init_contact_law_params(const double friction_angle, const double damping_ratio,
+                                           const double young_modulus, const double poisson_ratio,
+                                           ContactLawParams *params) {
+  const double shear_modulus = young_modulus / (2 * (1 + poisson_ratio));
+  params->friction = tan(friction_angle * 3.141592653589793 / 180);
+  params->damping_ratio = damping_ratio;
+  params->effective_young_modulus = young_modulus / (2 * (1 - (poisson_ratio * poisson_ratio)));
+  params->effective_shear_modulus = shear_modulus / (2 * (2 - poisson_ratio));
+}
+
+/**
+ * Linear law: the normal and tangent forces are incremented by the relative velocity times the rigidity,
+ * the particles do not attract each other, and the tangent force is capped by the friction.
+ * Updates the history and returns the forces to apply.
+ */
+static inline void linear_contact_law(const ContactLawParams *params, const ContactInput *input,
+                                      accum *previous_normal, accum *previous_tangent,
+                                      accum *normal_force, accum *tangent_force) {
+  // Accumulated in the wider type, since the increments can be tiny compared with the force.
+  accum Fn = *previous_normal + (input->normal_velocity * input->kn * input->dt);
+  accum Fs = *previous_tangent + (input->tangent_velocity * input->ks * input->dt);
+
+  if (Fn < 0) {
+    Fn = 0;
+    Fs = 0;
+  }
+
+  const accum Fs_max = Fn * params->friction;
+  if (fabs(Fs) > Fs_max) {
+    Fs = (fabs(Fs_max) * fabs(Fs)) / Fs;
+  }
+
+  *previous_normal = Fn;
+  *previous_tangent = Fs;
+  *normal_force = Fn;
+  *tangent_force = Fs;
+}
+
+/**
+ * Linear law plus normal and tangent dashpots, with a fraction of the critical damping of each spring.
+ * The history only keeps the elastic part.
+ */
+static inline void linear_damped_contact_law(const ContactLawParams *params, const ContactInput *input,
+                                             accum *previous_normal, accum *previous_tangent,
+                                             accum *normal_force, accum *tangent_force) {
+  accum Fn_elastic;
+  accum Fs_elastic;
+  linear_contact_law(params, input, previous_normal, previous_tangent, &Fn_elastic, &Fs_elastic);
+
+  const accum normal_damping = 2 * params->damping_ratio * sqrt(input->effective_mass * input->kn);
+  const accum tangent_damping = 2 * params->damping_ratio * sqrt(input->effective_mass * input->ks);
+  accum Fn = Fn_elastic + (normal_damping * input->normal_velocity);
+  accum Fs = Fs_elastic + (tangent_damping * input->tangent_velocity);
+
+  if (Fn < 0) {
+    Fn = 0;
+  }
+
+  const accum Fs_max = Fn * params->friction;
+  Fs = Fs > Fs_max ? Fs_max : (Fs < -Fs_max ? -Fs_max : Fs);
+
+  *normal_force = Fn;
+  *tangent_force = Fs;
+}
+
+/**
+ * Hertz-Mindlin law: the normal force depends on the overlap to the power of 3/2,
+ * and the tangent stiffness grows with the contact radius.
+ * The normal history keeps the last normal force, like the linear law.
+ */
+static inline void hertz_mindlin_contact_law(const ContactLawParams *params, const ContactInput *input,
+                                             accum *previous_normal, accum *previous_tangent,
+                                             accum *normal_force, accum *tangent_force) {
+  if (input->overlap <= 0) {
+    *previous_normal = 0;
+    *previous_tangent = 0;
+    *normal_force = 0;
+    *tangent_force = 0;
+    return;
+  }
+
+  // The moduli are in Pa, so work in meters.
+  const accum overlap = input->overlap / METERS_TO_COORDINATES;
+  const accum contact_radius = sqrt((input->effective_radius / METERS_TO_COORDINATES) * overlap);
+  const accum Fn = (4.0 / 3.0) * params->effective_young_modulus * contact_radius * overlap;
+  const accum kt = 8 * params->effective_shear_modulus * contact_radius;
+  accum Fs = *previous_tangent + (input->tangent_velocity * kt * input->dt);
+
+  const accum Fs_max = Fn * params->friction;
+  Fs = Fs > Fs_max ? Fs_max : (Fs < -Fs_max ? -Fs_max : Fs);
+
+  *previous_normal = Fn;
+  *previous_tangent = Fs;
+  *normal_force = Fn;
+  *tangent_force = Fs;
+}
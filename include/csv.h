@@ -1,6 +1,32 @@
 #pragma once
 
 #include "data.h"
+#include "analysis.h"
+#include "flight_recorder.h"
+#include "fields.h"
+
+// Bytes reserved for each particle row of a frame: four numbers of at most 24 characters, and their separators.
+#define CSV_ROW_CAPACITY 128
+
+// Largest csv_precision: 17 significant digits read back any double, and fit in the 24 characters of a number.
+#define CSV_MAX_PRECISION 17
+
+// Particles formatted by each parallel chunk of a frame.
+#define CSV_CHUNK_PARTICLES 4096
+
+// Characters of a number written with the default stream precision, plus its separator, at most.
+#define CSV_COLUMN_BOUND 16
+
+// Characters of the header of the statistics and field files, at most.
+#define CSV_HEADER_BOUND 1024
+
+/**
+ * Sets the buffer where the frames are formatted, which needs CSV_ROW_CAPACITY bytes
+ * per particle plus one row for the header, and the significant digits of the numbers.
+ * With precision 0, each number is written with the shortest representation that reads back the same value.
+ * Frames too large for the buffer are formatted in a temporary one.
+ */
+void init_csv_writer(char *buffer, const size_t capacity, const int precision);
 
 /**
  * Ensures the output folder exists
@@ -13,10 +39,68 @@ int ensure_output_folder(const char *output_folder);
  * with the current status of the simulation.
  * The file will be written on the specified folder,
  * and suffixed with the step number.
+ * The rows are formatted in parallel chunks, and the file is written with a single write call.
+ * If ids is not NULL, each row ends with the persistent id of the particle, and the removed particles
+ * (radius 0) are left out; without ids there are none, and the row is the particle index.
  */
-void write_simulation_step(const size_t num_particles, const Particle *particles,
+void write_simulation_step(const size_t num_particles, const Particle *particles, const size_t *ids,
                            const char *folder, const unsigned long step);
 
+/**
+ * Returns the size of the file write_simulation_step would write for these particles, formatting it without writing it.
+ */
+size_t simulation_step_size(const size_t num_particles, const Particle *particles, const size_t *ids);
+
 void write_grid(const int x_squares, const int y_squares, const double square_length, const char* folder);
 
+/**
+ * Writes a CSV file with the wall segments, one per row.
+ */
+void write_walls(const int num_walls, const Wall *walls, const char* folder);
+
+/**
+ * Creates the statistics time series file of the folder, with only its header.
+ */
+void write_statistics_header(const char* folder);
+
+/**
+ * Appends one row, with the statistics of the given step, to the statistics time series file.
+ */
+void write_statistics(const StepStatistics *statistics, const double time, const unsigned long step,
+                      const char* folder);
+
+/**
+ * Returns an upper bound of the size of the statistics time series file, with the given number of rows.
+ */
+size_t statistics_size_bound(const size_t rows);
+
+/**
+ * Writes the continuum fields of the cells as a CSV file, one row per cell with mass, with its center as the coordinates,
+ * so it can be read by ParaView like the particles. The file is suffixed with the step number.
+ */
+void write_fields(const FieldGrid *field_grid, const FieldCell *cells, const char* folder, const unsigned long step);
+
+/**
+ * Returns an upper bound of the size of one continuum fields file: every cell holding mass.
+ */
+size_t fields_size_bound(const FieldGrid *field_grid);
+
+/**
+ * Writes why and when the run ended (END, EQUILIBRIUM or BLOWUP), the simulated time it skipped,
+ * and the equilibrium measures of its last check, to a one row CSV file.
+ */
+void write_termination(const char *reason, const unsigned long step, const double time, const double skipped_time,
+                       const EquilibriumMeasures *measures, const double kinetic_ratio, const char* folder);
+
+/**
+ * Writes the steps kept by the flight recorder, from the oldest to the newest, in two CSV files:
+ * one row per tracked particle and step, and one row per recorded contact.
+ * The files are named after the reason of the dump, and suffixed with the step number.
+ */
+void write_flight_recorder(const FlightRecorder *recorder, const char *reason, const char* folder,
+                           const unsigned long step);
+
+/**
+ * Same as write_simulation_step, but with the particles in the order of the grid's squares.
+ */
 void write_particles_from_grid(const int x_squares, const int y_squares, const char* folder, Particle** grid, const int step);
@@ -1,33 +1,66 @@
 #pragma once
 
+#include <stdint.h>
+
+/**
+ * Scalar type used for the particle state and the kernels.
+ * Selected at build time: `make PRECISION=float` defines USE_FLOAT.
+ * The default build uses double precision.
+ */
+#ifdef USE_FLOAT
+typedef float real;
+#define REAL_C(value) value ## f
+#else
+typedef double real;
+#define REAL_C(value) value
+#endif
+
+/**
+ * Scalar type used for the values that are accumulated across steps,
+ * like the contact forces history.
+ * Always double, so single precision builds do not lose the small increments.
+ */
+typedef double accum;
+
 /**
  * Represents a circular shaped particle in a two-dimensional space.
  */
 typedef struct Particle Particle;
 struct Particle{
-  double x_coordinate;
-  double y_coordinate;
-  double radius;
+  real x_coordinate;
+  real y_coordinate;
+  real radius;
   Particle* next;
   int idx;
 };
 
 /**
- * Physical properties of a particle,
+ * Physical properties of a material, shared by all its particles,
  * used in the forces and acceleration computations.
+ * The inverse of the mass is cached, so the integration multiplies instead of dividing.
  */
 typedef struct {
-  double mass;
-  double kn; // Normal rigidity.
-  double ks; // Tangential rigidity.
-} ParticleProperties;
+  real mass;
+  real kn; // Normal rigidity.
+  real ks; // Tangential rigidity.
+  real inverse_mass;
+} Material;
+
+/**
+ * Index of the material of a particle in the material table.
+ * One byte per particle, instead of a full Material.
+ */
+typedef uint8_t MaterialId;
+
+// Materials a table can hold.
+#define MAX_MATERIALS 256
 
 /**
  * Represents a vector in a two-dimensional space.
  */
 typedef struct {
-  double x_component;
-  double y_component;
+  real x_component;
+  real y_component;
 } Vector;
 
 /**
@@ -36,5 +69,25 @@ typedef struct {
 typedef struct {
   size_t p1_idx;
   size_t p2_idx;
-  double overlap;
+  real overlap;
 } Contact;
+
+/**
+ * Represents a straight wall segment, from (x1, y1) to (x2, y2).
+ * Polylines are stored as consecutive segments.
+ */
+typedef struct {
+  real x1;
+  real y1;
+  real x2;
+  real y2;
+} Wall;
+
+/**
+ * Represents a contact between a particle and a wall.
+ */
+typedef struct {
+  size_t particle_idx;
+  size_t wall_idx;
+  real overlap;
+} WallContact;
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include "data.h"
+
+// Slabs of the fields with the deterministic force accumulation, so the fields do not depend on the threads either.
+#define FIELD_DETERMINISTIC_SLABS 16
+
+/**
+ * Coarse mesh of the continuum fields: square cells of cell_squares by cell_squares squares of the grid,
+ * over the same region as the grid. The fields are accumulated in num_slabs slabs of cells, each over a fixed range
+ * of the particles and contacts, and added in order into the cells of slab 0.
+ */
+typedef struct {
+  int x_cells;
+  int y_cells;
+  double cell_length; // In coordinates.
+  double x_min; // Left side of the grid.
+  double thickness; // Of the particles, to turn areas into volumes.
+  int periodic; // 1 if the cells wrap around along X, like the grid.
+  int num_slabs; // The sums, to the last bits, depend on it, but not on the number of threads.
+} FieldGrid;
+
+/**
+ * Sums of the particles and contacts of one cell, each weighted by the tent kernel of the cell:
+ * 1 at the center of the cell, down to 0 at the centers of the neighboring ones.
+ */
+typedef struct {
+  double mass;
+  double solid_area; // Of the particle discs, in squared coordinates.
+  double momentum_x;
+  double momentum_y;
+  double stress_xx; // Sum of force (N) times branch vector (m), from the contacts.
+  double stress_xy;
+  double stress_yx;
+  double stress_yy;
+} FieldCell;
+
+/**
+ * Continuum values of one cell, in SI units (kg, m, s, Pa). The stress is positive in compression.
+ */
+typedef struct {
+  double x; // Center of the cell, in coordinates.
+  double y;
+  double density;
+  double porosity;
+  double velocity_x;
+  double velocity_y;
+  double stress_xx;
+  double stress_xy;
+  double stress_yy;
+  double strain_rate_xx;
+  double strain_rate_xy;
+  double strain_rate_yy;
+} FieldValues;
+
+/**
+ * Sets the cells covering a grid of x_squares by y_squares squares of square_length,
+ * with cell_squares squares per cell side, accumulated in num_slabs slabs.
+ */
+void init_field_grid(const int x_squares, const int y_squares, const double square_length, const int cell_squares,
+                     const double thickness, const int periodic, const int num_slabs, FieldGrid *field_grid);
+
+/**
+ * Returns the number of cells of one slab.
+ */
+size_t field_grid_cells(const FieldGrid *field_grid);
+
+/**
+ * Accumulates the mass, disc area and momentum of the particles, and the force times branch vector of the contacts
+ * (both directions of each pair, each counted half), into the cells, in one parallel pass over each.
+ * The force of each contact is rebuilt from its normal and tangent history, at (p1_idx * history_stride) + p2_idx,
+ * and is spread around the midpoint of the two centers. The removed particles (radius 0) are not counted.
+ * cells has num_slabs slabs; the result is left in the first one.
+ * Slab s takes the s-th of num_slabs equal ranges of the particles and of the contacts, whichever thread runs it,
+ * and the slabs are added in order, so there are no atomics and the sums only depend on num_slabs.
+ */
+void accumulate_fields(const FieldGrid *field_grid, const size_t particles_size, const Particle *particles,
+                       const Material *materials, const MaterialId *material_ids, const Vector *velocities,
+                       const size_t history_stride, const size_t contacts_size, const Contact *contacts,
+                       const accum *normal_forces, const accum *tangent_forces, FieldCell *cells);
+
+/**
+ * Turns the sums of the cell (x, y) into continuum values. The strain rate is the symmetric part
+ * of the velocity gradient, with central differences between the neighboring cells that hold mass,
+ * or one sided ones next to empty cells and the sides.
+ */
+void field_values(const FieldGrid *field_grid, const FieldCell *cells, const int x, const int y,
+                  FieldValues *values);
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "data.h"
+#include "population.h"
+
+// Contacts of a tracked particle kept each step. Any further contacts are only counted.
+#define RECORDER_MAX_CONTACTS 8
+
+/**
+ * Contact of a tracked particle: the force on it from the other particle.
+ */
+typedef struct {
+  size_t other_idx;
+  real overlap;
+  accum normal_force;
+  accum tangent_force;
+} RecordedContact;
+
+/**
+ * Full state of one tracked particle at the end of one step.
+ * The acceleration and displacement are derived from the forces and the velocity,
+ * so they are also available without the DEBUG_STEP arrays.
+ */
+typedef struct {
+  unsigned long step;
+  size_t particle_idx;
+  Particle particle;
+  Material material;
+  accum normal_force; // Sum over its contacts.
+  accum tangent_force;
+  Vector force;
+  Vector acceleration;
+  Vector velocity;
+  Vector displacement;
+  size_t num_contacts;
+  RecordedContact contacts[RECORDER_MAX_CONTACTS];
+} RecordedState;
+
+/**
+ * Ring buffer with the last steps of the tracked particles.
+ * states has capacity rows of num_tracked states; step s is stored in row s % capacity.
+ * slots maps each particle index to its position in tracked, or -1 if it is not tracked.
+ */
+typedef struct {
+  size_t num_tracked;
+  size_t *tracked; // REMOVED_PARTICLE once the particle is removed.
+  int *slots;
+  size_t capacity; // Steps kept.
+  size_t recorded; // Steps recorded so far.
+  RecordedState *states;
+} FlightRecorder;
+
+/**
+ * Sets up the recorder over the given buffers: slots with one entry per particle,
+ * and states with capacity * num_tracked entries.
+ */
+void recorder_init(FlightRecorder *recorder, const size_t particles_size, const size_t num_tracked,
+                   size_t *tracked, const size_t capacity, int *slots, RecordedState *states);
+
+/**
+ * Records the state of the tracked particles at the end of the given step,
+ * overwriting the oldest step once the buffer is full.
+ * The contact history has rows of history_stride entries.
+ */
+void recorder_record(FlightRecorder *recorder, const unsigned long step, const real dt,
+                     const size_t history_stride, const Particle *particles,
+                     const Material *materials, const MaterialId *material_ids, const Vector *forces, const Vector *velocities,
+                     const size_t contacts_size, const Contact *contacts,
+                     const accum *normal_forces, const accum *tangent_forces);
+
+/**
+ * Updates the tracked particles after compact_particles, with its remap of the old particles_size indices.
+ * The removed ones keep their column in the buffer, recorded with REMOVED_PARTICLE as index.
+ */
+void recorder_remap(FlightRecorder *recorder, const size_t particles_size, const size_t *remap);
+
+/**
+ * Returns the index of the first particle whose position or velocity is not finite,
+ * or whose speed is above max_speed (if positive). Returns -1 if there is none.
+ */
+long find_blow_up(const size_t particles_size, const Particle *particles, const Vector *velocities,
+                  const double max_speed);
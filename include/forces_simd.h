@@ -0,0 +1,55 @@
+#pragma once
+
+#include "data.h"
+#include "contact_laws.h"
+
+// Number of contacts gathered per batch before running the vectorized kernel.
+#define CONTACT_BATCH_SIZE 256
+
+/**
+ * Instruction set used by the vectorized contact force kernel.
+ */
+typedef enum {
+  SIMD_NONE = 0, // Scalar kernel, one contact at a time.
+  SIMD_AVX2 = 1, // 4 contacts at once.
+  SIMD_AVX512 = 2 // 8 contacts at once.
+} SimdLevel;
+
+/**
+ * Contacts gathered in structure of arrays layout.
+ * The gather step fills the inputs, the kernel fills the outputs,
+ * and the scatter step writes them back to the history and the forces.
+ * Everything is kept in the accumulator type, like the contact history.
+ */
+typedef struct {
+  // Inputs.
+  accum x_diff[CONTACT_BATCH_SIZE]; // P1 - P2.
+  accum y_diff[CONTACT_BATCH_SIZE];
+  accum velocity_x_diff[CONTACT_BATCH_SIZE]; // V2 - V1.
+  accum velocity_y_diff[CONTACT_BATCH_SIZE];
+  accum kn[CONTACT_BATCH_SIZE];
+  accum ks[CONTACT_BATCH_SIZE];
+  // Inputs and outputs: the previous forces are replaced by the new ones.
+  accum normal[CONTACT_BATCH_SIZE];
+  accum tangent[CONTACT_BATCH_SIZE];
+  // Outputs.
+  accum force_x[CONTACT_BATCH_SIZE];
+  accum force_y[CONTACT_BATCH_SIZE];
+} ContactBatch;
+
+/**
+ * Returns the widest instruction set supported by the running CPU.
+ */
+SimdLevel detect_simd_level(void);
+
+/**
+ * Same as compute_forces, but processes the contacts in batches with the vectorized kernel
+ * of the given level. Only the linear law is vectorized: with SIMD_NONE or other laws, it calls compute_forces.
+ * The contacts are scattered in the same order as compute_forces, so the forces are summed in the same order.
+ */
+void compute_forces_simd(const SimdLevel level, const ContactLaw law, const ContactLawParams *params,
+                         const real dt, const size_t particles_size,
+                         const size_t contacts_size, const Particle *particles,
+                         const Material *materials, const MaterialId *material_ids, const Contact *contacts,
+                         const Vector *velocities, accum *normal_forces,
+                         accum *tangent_forces, Vector *forces);
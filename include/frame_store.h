@@ -0,0 +1,122 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// First bytes of a frame store file, and version of its layout.
+#define FRAME_STORE_MAGIC "2DPSTORE"
+#define FRAME_STORE_VERSION 1
+
+// Alignment of every section of the file.
+#define FRAME_STORE_ALIGNMENT 64
+
+// Id of the rows without a particle id (the frames written from the grid, in grid order).
+#define FRAME_NO_ID UINT64_MAX
+
+// Frame flags: the ids come from an id column, and the ids of the frame are in increasing order.
+#define FRAME_IDS_FROM_FILE 1
+#define FRAME_IDS_SORTED 2
+
+/**
+ * Kind of particles CSV file a frame comes from.
+ */
+typedef enum {
+  FRAME_KIND_OUT = 0, // 2DPartInt-Out.csv.<step>
+  FRAME_KIND_FROM_GRID = 1 // 2DPartInt-Out-FROM-GRID.csv.<step>
+} FrameKind;
+
+/**
+ * Header at the start of the file. Every offset is in bytes, from the start of the file.
+ */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t num_frames;
+  uint64_t num_rows; // Particle rows of all the frames.
+  uint64_t num_squares; // Squares of the 2DPartInt-Out-GRID.csv file, 0 if it was not there.
+  uint64_t frames_offset;
+  uint64_t x_offset;
+  uint64_t y_offset;
+  uint64_t radius_offset;
+  uint64_t id_offset;
+  uint64_t squares_offset;
+  uint64_t size; // Of the whole file.
+} FrameStoreHeader;
+
+/**
+ * Entry of the frame index. The frames are sorted by kind, then by step.
+ * The rows first_row to first_row + num_rows - 1 of each column belong to the frame.
+ * The bounding box covers the particle centers, so the spatial queries skip whole frames.
+ */
+typedef struct {
+  uint64_t step;
+  uint64_t first_row;
+  uint64_t num_rows;
+  uint32_t kind;
+  uint32_t flags;
+  double min_x;
+  double min_y;
+  double max_x;
+  double max_y;
+} FrameEntry;
+
+/**
+ * One square of the grid: its bottom left corner and its side.
+ */
+typedef struct {
+  double x;
+  double y;
+  double length;
+} StoredSquare;
+
+/**
+ * A frame store mapped in memory: the header, the frame index, and one array per column.
+ * The frames without an id column get the row number as id, which is the particle index,
+ * except for the FROM-GRID frames, in grid order, whose rows get FRAME_NO_ID.
+ */
+typedef struct {
+  void *data;
+  size_t size;
+  const FrameStoreHeader *header;
+  const FrameEntry *frames;
+  const double *x;
+  const double *y;
+  const double *radius;
+  const uint64_t *ids;
+  const StoredSquare *squares;
+} FrameStore;
+
+/**
+ * Fills the sizes and offsets of the header for the given number of frames, rows and squares,
+ * with each section aligned to FRAME_STORE_ALIGNMENT. Returns the size of the file.
+ */
+size_t frame_store_layout(const size_t num_frames, const size_t num_rows, const size_t num_squares,
+                          FrameStoreHeader *header);
+
+/**
+ * Points the arrays of the store to the sections of a file mapped at data.
+ */
+void frame_store_attach(void *data, const size_t size, FrameStore *store);
+
+/**
+ * Maps the file read only, and checks its header, its sections and the rows of its frames. Returns 0 on success.
+ */
+int frame_store_open(const char *path, FrameStore *store);
+
+/**
+ * Unmaps the file.
+ */
+void frame_store_close(FrameStore *store);
+
+/**
+ * Returns the index of the first frame of the given kind whose step is at least 'step',
+ * or the index after the last frame of that kind if there is none. Binary search.
+ */
+size_t frame_store_find_step(const FrameStore *store, const FrameKind kind, const uint64_t step);
+
+/**
+ * Returns the row of the particle with the given id in the frame, or SIZE_MAX if it is not there.
+ * Binary search when the ids of the frame are sorted, which the simulation keeps since compactions preserve the order.
+ */
+size_t frame_store_find_particle(const FrameStore *store, const FrameEntry *frame, const uint64_t id);
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+extern "C" {
+  #include "data.h"
+}
+
+// First bytes of every streamed frame, and version of the framing.
+#define STREAM_FRAME_MAGIC "2DPF"
+#define STREAM_FRAME_VERSION 1
+
+// Frame flags: the frame has an id column.
+#define STREAM_FRAME_IDS 1
+
+/**
+ * Header of a streamed frame, in the byte order of the machine. It is followed by num_particles x coordinates,
+ * y coordinates and radii, each of real_size bytes, and by num_particles ids of 8 bytes if the flags say so.
+ * frame_size covers the header and the columns, so a reader can skip frames.
+ */
+typedef struct {
+  char magic[4];
+  uint16_t version;
+  uint16_t real_size;
+  uint32_t flags;
+  uint32_t reserved;
+  uint64_t frame_size;
+  uint64_t step;
+  double time;
+  uint64_t num_particles;
+  uint64_t dropped; // Frames dropped since the previous frame sent.
+} StreamFrameHeader;
+
+/**
+ * What the simulation does when every frame buffer is waiting to be written.
+ */
+typedef enum {
+  STREAM_POLICY_BLOCK = 0, // Waits for the consumer: backpressure.
+  STREAM_POLICY_DROP = 1 // Drops the frame, and counts it in the next frame sent.
+} StreamPolicy;
+
+/**
+ * Returns the bytes of one frame buffer of the given capacity, in particles.
+ */
+size_t stream_buffer_size(const size_t capacity);
+
+/**
+ * Opens the stream target: "stdout", "fifo:<path>" (created if missing, waits for a reader),
+ * or "unix:<path>" (connects to a listening Unix domain socket). With stdout, the text the program prints
+ * is sent to stderr from then on. Returns the file descriptor, or -1 on error.
+ */
+int open_stream_target(const char *target);
+
+/**
+ * Starts the writer thread on the file descriptor, with num_buffers frame buffers of stream_buffer_size(capacity)
+ * bytes each, carved from 'buffers'.
+ */
+void start_frame_stream(const int file, const StreamPolicy policy, const size_t num_buffers, const size_t capacity,
+                        char *buffers);
+
+/**
+ * Copies the particles into a free frame buffer and queues it for the writer thread.
+ * If ids is not NULL, the frame has an id column, and the removed particles (radius 0) are left out.
+ * Returns false if the frame was dropped,
+ * or if the stream was closed after a write error.
+ */
+bool stream_frame(const size_t num_particles, const Particle *particles, const size_t *ids,
+                  const unsigned long step, const double time);
+
+/**
+ * Frames waiting to be written, and frames dropped since the start.
+ */
+size_t frame_stream_queue_depth();
+uint64_t frame_stream_dropped();
+
+/**
+ * Writes the frames still queued, stops the writer thread and closes the file descriptor.
+ */
+void stop_frame_stream();
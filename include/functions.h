@@ -1,57 +1,179 @@
 #pragma once
 
 #include "data.h"
+#include "contact_laws.h"
+
+// Gravity acceleration, in meters per second squared.
+#define GRAVITY REAL_C(9.81)
+
+/**
+ * Length of the domain along X when it is periodic, or 0 when it is not.
+ * The periodic domain is the width of the grid, from -periodic_x_length / 2 to periodic_x_length / 2.
+ * Set once, before the simulation starts.
+ */
+extern real periodic_x_length;
+
+/**
+ * Returns the X difference between two points with the minimum image convention:
+ * with periodic boundaries, the difference to the nearest periodic copy.
+ */
+static inline real minimum_image_x(real x_diff) {
+  if (periodic_x_length > 0) {
+    if (x_diff > periodic_x_length / 2) {
+      x_diff -= periodic_x_length;
+    } else if (x_diff < -periodic_x_length / 2) {
+      x_diff += periodic_x_length;
+    }
+  }
+  return x_diff;
+}
+
+/**
+ * Returns the X coordinate wrapped back into the periodic domain, or unchanged when X is not periodic.
+ */
+static inline real wrap_x(const real x) {
+  if (periodic_x_length > 0) {
+    return x - (periodic_x_length * floor((x + (periodic_x_length / 2)) / periodic_x_length));
+  }
+  return x;
+}
 
 /**
  * Computes the euclidean distance between two particles.
  */
-double compute_distance(const Particle *p1, const Particle *p2);
+real compute_distance(const Particle *p1, const Particle *p2);
 
 /**
  * Computes the overlap between two particles.
  */
-double compute_overlap(const Particle *p1, const Particle *p2);
+real compute_overlap(const Particle *p1, const Particle *p2);
 
 /**
  * Applies gravity to a particle.
  */
 void apply_gravity(const size_t size,
-                   const ParticleProperties *particles_properties,
+                   const Material *materials, const MaterialId *material_ids,
                    Vector *forces);
 
+/**
+ * Numerical damping of the particles, used while the bed settles.
+ */
+typedef enum {
+  DAMPING_NONE = 0,
+  DAMPING_LOCAL = 1, // Non-viscous, Cundall style: each component of the net force is reduced against the velocity.
+  DAMPING_VISCOUS = 2 // Global viscous: a force against the velocity, proportional to the mass.
+} DampingMode;
+
+/**
+ * Damps the contact forces of the particles, in parallel, before the integration.
+ * Local damping removes 'strength' (0 to 1) times the magnitude of each component of the net force,
+ * gravity included, against the velocity; viscous damping removes strength (in 1/s) * mass * velocity.
+ * The removed particles (radius 0) are skipped.
+ */
+void damp_forces(const DampingMode mode, const real strength, const size_t particles_size,
+                 const Particle *particles, const Material *materials, const MaterialId *material_ids,
+                 const Vector *velocities, Vector *forces);
+
 /**
  * Returns the size of a triangular matrix, without the diagonal.
  */
 size_t size_triangular_matrix(const size_t n);
 
 /**
- * Computes the forces applied to each particle.
+ * Computes the contact forces applied to each particle, with the given contact law.
+ * The history of each contact is stored at (p1_idx * particles_size) + p2_idx,
+ * so particles_size is the capacity of the particle arrays, not the number of particles in use.
+ * Note: Gravity is applied by integrate_particles.
  */
-void compute_forces(const double dt, const size_t particles_size,
+void compute_forces(const ContactLaw law, const ContactLawParams *params,
+                    const real dt, const size_t particles_size,
                     const size_t contacts_size, const Particle *particles,
-                    const ParticleProperties *properties, const Contact *contacts,
-                    const Vector *velocities, double *normal_forces,
-                    double *tangent_forces, Vector *forces);
+                    const Material *materials, const MaterialId *material_ids, const Contact *contacts,
+                    const Vector *velocities, accum *normal_forces,
+                    accum *tangent_forces, Vector *forces);
+
+/**
+ * How the contact forces are summed into the forces of the particles.
+ */
+typedef enum {
+  FORCE_ACCUMULATION_SERIAL = 0, // One thread, in the order of the contacts. Vectorized for the linear law.
+  FORCE_ACCUMULATION_ATOMIC = 1, // Parallel over the contacts, with atomic additions: the last bits depend on the scheduling.
+  FORCE_ACCUMULATION_DETERMINISTIC = 2 // Parallel over the particles: the same forces for any number of threads.
+} ForceAccumulation;
+
+/**
+ * Groups the contacts by receiving particle (p2), keeping their order within each group:
+ * the contacts of particle i are contact_order[contact_offsets[i]] to contact_order[contact_offsets[i + 1] - 1].
+ * contact_offsets holds particles_size + 1 elements, and contact_order one per contact.
+ */
+void group_contacts(const size_t particles_size, const size_t contacts_size, const Contact *contacts,
+                    size_t *contact_offsets, size_t *contact_order);
+
+/**
+ * Same as compute_forces, in parallel over the contacts, with atomic additions to the forces.
+ * The fastest parallel loop, but the order of the sums depends on the scheduling of the threads.
+ */
+void compute_forces_atomic(const ContactLaw law, const ContactLawParams *params,
+                           const real dt, const size_t particles_size,
+                           const size_t contacts_size, const Particle *particles,
+                           const Material *materials, const MaterialId *material_ids, const Contact *contacts,
+                           const Vector *velocities, accum *normal_forces,
+                           accum *tangent_forces, Vector *forces);
+
+/**
+ * Same as compute_forces, in parallel over the particles, with the contacts grouped by group_contacts.
+ * Each particle sums its contacts in the order of the contact list, so the forces are the same as
+ * the ones of compute_forces, bit for bit, for any number of threads.
+ */
+void compute_forces_grouped(const ContactLaw law, const ContactLawParams *params,
+                            const real dt, const size_t particles_size, const Particle *particles,
+                            const Material *materials, const MaterialId *material_ids, const Contact *contacts,
+                            const size_t *contact_offsets, const size_t *contact_order,
+                            const Vector *velocities, accum *normal_forces,
+                            accum *tangent_forces, Vector *forces);
+
+/**
+ * Finds the point of the wall closest to the given point.
+ */
+void closest_point_on_wall(const Wall *wall, const real x, const real y,
+                           real *closest_x, real *closest_y);
+
+/**
+ * Computes the overlap between a particle and a wall.
+ */
+real compute_wall_overlap(const Particle *p, const Wall *wall);
+
+/**
+ * Computes the forces applied to each particle by the walls it touches, with the given contact law.
+ * The history of each particle-wall pair is stored at (particle_idx * num_walls) + wall_idx.
+ */
+void compute_wall_forces(const ContactLaw law, const ContactLawParams *params,
+                         const real dt, const size_t num_walls, const size_t wall_contacts_size,
+                         const Particle *particles, const Material *materials, const MaterialId *material_ids,
+                         const Wall *walls, const WallContact *wall_contacts,
+                         const Vector *velocities, accum *wall_normal_forces,
+                         accum *wall_tangent_forces, Vector *forces);
+
 /**
  * Applies the forces to the particles with the same index,
  * and computes the resultant acceleration.
  */
 void compute_acceleration(const size_t particle_index,
-                          const ParticleProperties *particles_properties,
+                          const Material *materials, const MaterialId *material_ids,
                           const Vector *forces, Vector *accelerations);
 
 /**
  * Derives the resultant velocity,
  * of an initial velocity with an applied acceleration for given a time delta.
  */
-void compute_velocity(const double dt, const size_t particle_index,
+void compute_velocity(const real dt, const size_t particle_index,
                       const Vector *accelerations, Vector *velocities);
 
 /**
- * Computes the displacement of the particles,
- * with an applied velocity for a given time delta.
+ * Computes the displacement of the particles during a time delta,
+ * with an applied velocity.
  */
-void compute_displacement(const double dt, const size_t particle_index,
+void compute_displacement(const real dt, const size_t particle_index,
                           const Vector *velocities, Vector *displacements);
 
 /**
@@ -64,3 +186,15 @@ void displace_particle(const size_t particle_index, const Vector *displacements,
  * Changes the displacement if the new position would surpass the X or Y limit.
  */
 void fix_displacement(const size_t particle_index, Vector *velocities, Particle *particles);
+
+/**
+ * Integrates all the particles one step in a single pass:
+ * acceleration (with gravity), velocity, position and the floor limit.
+ * The removed particles (radius 0) are left where they are, at rest.
+ * The accelerations and displacements are only stored when both arrays are provided (debug builds),
+ * otherwise they can be NULL.
+ */
+void integrate_particles(const real dt, const size_t particles_size,
+                         const Material *materials, const MaterialId *material_ids, const Vector *forces,
+                         Vector *velocities, Particle *particles,
+                         Vector *accelerations, Vector *displacements);
@@ -6,8 +6,18 @@
  * Initialize all simulation data structures,
  * according to the simulation size.
  * Returns the number of initialized particles.
+ * The arrays are sized for the capacity of the config, if larger.
  *
  * Note: Except for the particles,
  * all structures are effectively initialized with zeros.
+ * The footprint is printed if report_memory is set.
+ * Without first_touch, the pages are left for the first step that writes them,
+ * so a plan only takes the memory its sampled steps reach.
  */
-size_t initialize(const Config *config);
+size_t initialize(const Config *config, const bool report_memory = true, const bool first_touch = true);
+
+/**
+ * Prints the memory each data structure of the config would take, without allocating them.
+ * Returns the total, in bytes.
+ */
+size_t plan_memory(const Config *config);
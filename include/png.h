@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Writes an 8 bit RGB image, stored row by row from the top, as a PNG file.
+ * The image data is stored without compression, so no external library is needed.
+ * Returns 0 on success.
+ */
+int write_png(const char *filename, const int width, const int height, const unsigned char *rgb);
+
+/**
+ * Returns the size, in bytes, of the PNG file write_png writes for an image of the given size.
+ */
+size_t png_file_size(const int width, const int height);
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "data.h"
+
+// Index given by compact_particles to the removed particles.
+#define REMOVED_PARTICLE ((size_t) -1)
+
+/**
+ * Inflow of particles: every 'every' steps, 'count' particles are placed evenly spaced
+ * along the segment from (x_min, y) to (x_max, y), on the spots that are free.
+ * A narrow segment behaves like a hopper, a wide one like rainfall.
+ */
+typedef struct {
+  double x_min;
+  double x_max;
+  double y;
+  int every;
+  int count;
+  double velocity; // Initial vertical velocity, in m/s.
+} ParticleSource;
+
+/**
+ * Rectangle where the particles are kept. The particles whose center leaves it are removed.
+ */
+typedef struct {
+  double x_min;
+  double y_min;
+  double x_max;
+  double y_max;
+} Region;
+
+/**
+ * Removes the particles whose center is outside the region, by giving them radius 0 and no velocity.
+ * Removed particles are skipped by fill_grid, so they do not touch anything, until compact_particles
+ * frees their slots. Returns the number of particles removed by this call.
+ */
+size_t remove_outside_region(const Region *region, const size_t particles_size, Particle *particles,
+                             Vector *velocities);
+
+/**
+ * Moves the particles that are not removed to the front of every per-particle array, keeping their order,
+ * and moves their contact history (rows of length capacity) and wall history (rows of num_walls) with them.
+ * The history left behind is zeroed, so the freed slots can be reused.
+ * remap receives the new index of each old index, or REMOVED_PARTICLE. Returns the number of particles kept.
+ */
+size_t compact_particles(const size_t particles_size, const size_t capacity, Particle *particles,
+                         MaterialId *material_ids, Vector *velocities, size_t *ids,
+                         accum *normal_forces, accum *tangent_forces, const size_t num_walls,
+                         accum *wall_normal_forces, accum *wall_tangent_forces, size_t *remap);
+
+/**
+ * Appends the particles of the source to the arrays, up to the capacity, skipping the spots closer
+ * than two diameters to a particle of the grid (filled this step) or to a particle appended by this call.
+ * Each new particle gets the next persistent id. Returns the new number of particles.
+ */
+size_t insert_particles(const ParticleSource *source, const real radius, const MaterialId material,
+                        const size_t particles_size, const size_t capacity,
+                        Particle const *const *const grid, const int x_squares, const int y_squares,
+                        const double square_length, Particle *particles, MaterialId *material_ids,
+                        Vector *velocities, size_t *ids, size_t *next_id);
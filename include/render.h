@@ -0,0 +1,47 @@
+#pragma once
+
+#include "data.h"
+
+// Side, in pixels, of the square tiles the image is split into between the threads.
+#define RENDER_TILE_SIZE 64
+
+/**
+ * Quantity used to color the particles.
+ */
+typedef enum {
+  RENDER_COLOR_VELOCITY = 0, // Velocity magnitude.
+  RENDER_COLOR_FORCE = 1, // Magnitude of the resultant contact force.
+  RENDER_COLOR_ID = 2 // Particle id, or index without ids, to follow the mixing.
+} RenderColor;
+
+/**
+ * Region of the simulation drawn, and the size of the image.
+ */
+typedef struct {
+  int width; // In pixels.
+  int height;
+  double x_min; // Coordinates of the bottom left corner of the image.
+  double y_min;
+  double scale; // Pixels per coordinate unit.
+  RenderColor color;
+} RenderView;
+
+/**
+ * Returns the number of tiles of an image of the given size.
+ */
+size_t render_num_tiles(const int width, const int height);
+
+/**
+ * Draws every particle as a disc on the 8 bit RGB image, stored row by row from the top.
+ * The colors are scaled from the lowest to the highest value of the chosen quantity in this frame.
+ * With ids (the persistent particle ids, or NULL when the particles keep their index), the particles are
+ * colored by id, so their colors do not change when the particles are compacted.
+ * The particles are first binned by the tile of their center, with a counting sort into tile_offsets
+ * (render_num_tiles + 1 entries) and tile_order (particles_size entries), so each tile only checks the bins
+ * within reach of the largest particle. The tiles of the image are drawn in parallel; within a tile,
+ * the particles are drawn bin by bin and in index order within each bin, so the image does not depend
+ * on the number of threads.
+ */
+void render_particles(const RenderView *view, const size_t particles_size, const Particle *particles,
+                      const Vector *velocities, const Vector *forces, const size_t *ids, size_t *tile_offsets,
+                      size_t *tile_order, unsigned char *image);
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include "data.h"
+
+/**
+ * The grid filled by fill_grid, as the spatial queries read it.
+ * The queries follow the particle positions, but the squares hold each particle where it was when the grid was filled:
+ * 'margin' is how far the particles may have moved since, 0 right after fill_grid,
+ * or the largest speed times dt after the integration of the step. Widens the squares searched.
+ * Removed particles and particles outside the grid are not in the grid, and are never found.
+ */
+typedef struct {
+  Particle const *const *grid;
+  int x_squares;
+  int y_squares;
+  double square_length;
+  real margin;
+} GridView;
+
+/**
+ * Kind of a spatial query.
+ */
+typedef enum {
+  SPATIAL_QUERY_RADIUS = 0, // Particles whose center is within 'radius' of (x, y).
+  SPATIAL_QUERY_BOX = 1, // Particles whose center is in the box from (x, y) to (x_max, y_max).
+  SPATIAL_QUERY_NEAREST = 2 // The 'k' particles whose centers are the closest to (x, y), the closest first.
+} SpatialQueryKind;
+
+/**
+ * One query of a batch.
+ */
+typedef struct {
+  SpatialQueryKind kind;
+  real x; // Center of the radius and nearest queries, left of the box.
+  real y; // Center of the radius and nearest queries, bottom of the box.
+  real x_max; // Right of the box.
+  real y_max; // Top of the box.
+  real radius; // Of the radius query.
+  size_t k; // Of the nearest query.
+} SpatialQuery;
+
+/**
+ * Finds the particles whose center is within 'radius' of (x, y), in the order of the grid.
+ * Writes the index of at most 'capacity' of them in 'results', and returns how many there are.
+ */
+size_t query_radius(const GridView *view, const real x, const real y, const real radius,
+                    size_t *results, const size_t capacity);
+
+/**
+ * Finds the particles whose center is in the box from (x_min, y_min) to (x_max, y_max), in the order of the grid.
+ * Writes the index of at most 'capacity' of them in 'results', and returns how many there are.
+ */
+size_t query_box(const GridView *view, const real x_min, const real y_min, const real x_max, const real y_max,
+                 size_t *results, const size_t capacity);
+
+/**
+ * Finds the k particles whose center is the closest to (x, y), searching rings of squares around it
+ * until no unsearched square can hold a closer one. Writes their indices in 'results', the closest first,
+ * and their distances in 'distances' (if not NULL). Returns how many were found, less than k if the grid holds fewer.
+ */
+size_t query_nearest(const GridView *view, const real x, const real y, const size_t k,
+                     size_t *results, real *distances);
+
+/**
+ * Runs the queries in parallel, on the same grid. The results of query i are written from results[i * capacity],
+ * at most 'capacity' of them (the nearest queries find at most that many), and counts[i] is their total number.
+ */
+void run_spatial_queries(const GridView *view, const size_t num_queries, const SpatialQuery *queries,
+                         const size_t capacity, size_t *results, size_t *counts);
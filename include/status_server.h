@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/**
+ * Phases of a step timed for the status server.
+ */
+enum StatusPhase {
+  STATUS_PHASE_CONTACTS = 0, // Grid and contact search.
+  STATUS_PHASE_FORCES = 1, // Particle and wall contact forces.
+  STATUS_PHASE_ANALYSIS = 2, // Statistics and fields of the step.
+  STATUS_PHASE_INTEGRATION = 3,
+  STATUS_PHASE_OUTPUT = 4, // CSV files, statistics and fields files, and frames.
+  NUM_STATUS_PHASES = 5
+};
+
+/**
+ * Progress of the run. The simulation loop writes it with relaxed atomic stores, without locks,
+ * and the server thread reads it when polled. A reader can see the numbers of two consecutive steps mixed,
+ * which does not matter for monitoring.
+ */
+struct StatusMetrics {
+  std::atomic<uint64_t> step;
+  std::atomic<uint64_t> max_steps;
+  std::atomic<double> dt;
+  std::atomic<uint64_t> particles;
+  std::atomic<uint64_t> contacts;
+  std::atomic<double> phase_seconds[NUM_STATUS_PHASES]; // Accumulated since the first step.
+  std::atomic<uint64_t> arena_bytes;
+  std::atomic<uint64_t> frames_written;
+  std::atomic<uint64_t> stream_queue_depth; // Frames waiting for the writer of the frame stream.
+  std::atomic<uint64_t> frames_dropped; // By the frame stream.
+};
+
+/**
+ * Starts the server thread, answering HTTP requests on a Unix domain socket (if socket_path is not empty)
+ * and on a localhost TCP port (if port is positive). /metrics returns Prometheus text, any other path JSON.
+ * Returns 0 on success.
+ */
+int start_status_server(StatusMetrics *metrics, const std::string &socket_path, const int port);
+
+/**
+ * Stops the server thread, and removes the Unix domain socket.
+ */
+void stop_status_server();
+
+/**
+ * Formats the metrics as a JSON object, or as Prometheus text.
+ * elapsed is the wall time since the run started, used for the steps per second and the ETA.
+ */
+std::string format_status(const StatusMetrics *metrics, const double elapsed, const bool prometheus);
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Threads that can record events. The events of any further thread are dropped.
+#define TRACE_MAX_THREADS 256
+
+/**
+ * Begin ('B') or end ('E') of a phase, recorded by one thread.
+ */
+typedef struct {
+  const char *name; // Static string.
+  uint64_t time; // Nanoseconds of the monotonic clock.
+  unsigned long step;
+  char type;
+} TraceEvent;
+
+/**
+ * Sets up the tracer, inactive, over num_threads buffers of capacity events, carved from events.
+ * Each thread gets its own buffer the first time it records, so recording takes no locks.
+ */
+void tracer_init(const size_t num_threads, const size_t capacity, TraceEvent *events);
+
+/**
+ * Sets the step of the events recorded from now on, and whether they are recorded at all.
+ */
+void tracer_set_step(const unsigned long step, const int active);
+
+/**
+ * Records the begin of the phase 'name' on the calling thread, if the tracer is active.
+ * A begin is only recorded if its buffer has room for it, its end and the ends of the phases still open,
+ * so the recorded phases are always closed.
+ */
+void trace_begin(const char *name);
+
+/**
+ * Records the end of the phase 'name' on the calling thread, if its begin was recorded.
+ */
+void trace_end(const char *name);
+
+/**
+ * Names the calling thread in the trace, instead of "thread <n>".
+ */
+void trace_thread_name(const char *name);
+
+/**
+ * Events recorded so far, over all the threads.
+ */
+size_t trace_recorded(void);
+
+/**
+ * Events dropped so far, because a buffer was full or there were too many threads.
+ */
+size_t trace_dropped(void);
+
+/**
+ * Writes the recorded events in the Chrome trace event format (JSON), readable by chrome://tracing and Perfetto,
+ * with one track per thread and the time in microseconds since tracer_init. Returns 0 on success.
+ * The threads can keep recording: only the events complete when their thread is reached are written.
+ */
+int write_trace(const char *path);
@@ -0,0 +1,215 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "data.h"
+#include "functions.h"
+#include "analysis.h"
+
+// Contacts or particles summed by each block of the statistics. The sums of the blocks are added in order,
+// so the floating point sums do not depend on the number of threads.
+#define STATISTICS_BLOCK 1024
+
+/**
+ * Floating point sums of one block of contacts.
+ */
+typedef struct {
+  double normal;
+  double fabric_xx;
+  double fabric_xy;
+  double fabric_yy;
+} ContactSums;
+
+/**
+ * Computes the statistics of the contact network from the contacts of the step,
+ * their normal forces (rows of history_stride) and the velocities of the particles, in parallel.
+ * The removed particles (radius 0) are not counted.
+ * Two passes over the contacts: the first finds the mean normal force,
+ * the second classifies each force with respect to it.
+ * The floating point sums are done in fixed blocks, added in order, so they are the same for any number of threads.
+ */
+void compute_statistics(const size_t particles_size, const size_t history_stride, const size_t contacts_size,
+                        const Particle *particles, const Material *materials, const MaterialId *material_ids,
+                        const Contact *contacts, const accum *normal_forces,
+                        const Vector *velocities, StepStatistics *statistics) {
+  const size_t contact_blocks = (contacts_size + STATISTICS_BLOCK - 1) / STATISTICS_BLOCK;
+  const size_t particle_blocks = (particles_size + STATISTICS_BLOCK - 1) / STATISTICS_BLOCK;
+  ContactSums *contact_sums = (ContactSums*) malloc((contact_blocks + 1) * sizeof(ContactSums));
+  double *kinetic_sums = (double*) malloc((particle_blocks + 1) * sizeof(double));
+  size_t pairs = 0;
+  double normal_max = 0;
+
+  #pragma omp parallel for schedule(static) reduction(+:pairs) reduction(max:normal_max)
+  for (size_t block = 0; block < contact_blocks; ++block) {
+    ContactSums sums = { 0, 0, 0, 0 };
+    const size_t end = (block + 1) * STATISTICS_BLOCK < contacts_size ? (block + 1) * STATISTICS_BLOCK : contacts_size;
+    for (size_t i = block * STATISTICS_BLOCK; i < end; ++i) {
+      const size_t p1_idx = contacts[i].p1_idx;
+      const size_t p2_idx = contacts[i].p2_idx;
+      // The other direction of the same pair.
+      if (p1_idx > p2_idx) {
+        continue;
+      }
+      const double normal_force = normal_forces[(p1_idx * history_stride) + p2_idx];
+      const double x_diff = minimum_image_x(particles[p2_idx].x_coordinate - particles[p1_idx].x_coordinate);
+      const double y_diff = particles[p2_idx].y_coordinate - particles[p1_idx].y_coordinate;
+      const double distance_squared = (x_diff * x_diff) + (y_diff * y_diff);
+
+      pairs += 1;
+      sums.normal += normal_force;
+      normal_max = fmax(normal_max, normal_force);
+      if (distance_squared > 0) {
+        sums.fabric_xx += (x_diff * x_diff) / distance_squared;
+        sums.fabric_xy += (x_diff * y_diff) / distance_squared;
+        sums.fabric_yy += (y_diff * y_diff) / distance_squared;
+      }
+    }
+    contact_sums[block] = sums;
+  }
+
+  double normal_sum = 0;
+  double fabric_xx = 0;
+  double fabric_xy = 0;
+  double fabric_yy = 0;
+  for (size_t block = 0; block < contact_blocks; ++block) {
+    normal_sum += contact_sums[block].normal;
+    fabric_xx += contact_sums[block].fabric_xx;
+    fabric_xy += contact_sums[block].fabric_xy;
+    fabric_yy += contact_sums[block].fabric_yy;
+  }
+
+  const double normal_mean = pairs > 0 ? normal_sum / pairs : 0;
+  size_t strong = 0;
+  size_t histogram[FORCE_HISTOGRAM_BINS] = { 0 };
+
+  #pragma omp parallel for schedule(static) reduction(+:strong,histogram[:FORCE_HISTOGRAM_BINS])
+  for (size_t i = 0; i < contacts_size; ++i) {
+    const size_t p1_idx = contacts[i].p1_idx;
+    const size_t p2_idx = contacts[i].p2_idx;
+    if (p1_idx > p2_idx || normal_mean <= 0) {
+      continue;
+    }
+    const double relative_force = normal_forces[(p1_idx * history_stride) + p2_idx] / normal_mean;
+    const size_t bin = (size_t) (relative_force / FORCE_HISTOGRAM_BIN_WIDTH);
+
+    strong += relative_force > 1;
+    histogram[bin < FORCE_HISTOGRAM_BINS ? bin : FORCE_HISTOGRAM_BINS - 1] += 1;
+  }
+
+  size_t active = 0;
+
+  #pragma omp parallel for schedule(static) reduction(+:active)
+  for (size_t block = 0; block < particle_blocks; ++block) {
+    double sum = 0;
+    const size_t end = (block + 1) * STATISTICS_BLOCK < particles_size ? (block + 1) * STATISTICS_BLOCK : particles_size;
+    for (size_t i = block * STATISTICS_BLOCK; i < end; ++i) {
+      if (particles[i].radius <= 0) {
+        continue;
+      }
+      active += 1;
+      const double speed_squared = (velocities[i].x_component * velocities[i].x_component)
+        + (velocities[i].y_component * velocities[i].y_component);
+      sum += 0.5 * materials[material_ids[i]].mass * speed_squared;
+    }
+    kinetic_sums[block] = sum;
+  }
+
+  double kinetic_energy = 0;
+  for (size_t block = 0; block < particle_blocks; ++block) {
+    kinetic_energy += kinetic_sums[block];
+  }
+  free(contact_sums);
+  free(kinetic_sums);
+
+  statistics->contacts = pairs;
+  statistics->coordination_number = active > 0 ? (2.0 * pairs) / active : 0;
+  statistics->mean_normal_force = normal_mean;
+  statistics->max_normal_force = normal_max;
+  statistics->strong_fraction = pairs > 0 ? (double) strong / pairs : 0;
+  memcpy(statistics->force_histogram, histogram, sizeof(histogram));
+  statistics->fabric_xx = pairs > 0 ? fabric_xx / pairs : 0;
+  statistics->fabric_xy = pairs > 0 ? fabric_xy / pairs : 0;
+  statistics->fabric_yy = pairs > 0 ? fabric_yy / pairs : 0;
+  statistics->kinetic_energy = kinetic_energy;
+  statistics->front_y = particles_size > 0 ? particles[0].y_coordinate - particles[0].radius : 0;
+  statistics->front_velocity = particles_size > 0 ? velocities[0].y_component : 0;
+}
+
+/**
+ * Floating point sums of one block of particles.
+ */
+typedef struct {
+  double kinetic;
+  double unbalanced;
+  double weight;
+} ParticleSums;
+
+/**
+ * Computes the kinetic energy, the largest speed and the unbalanced force ratio of the particles, in parallel,
+ * from the contact forces of the step (without gravity, which is added here).
+ * The removed particles (radius 0) are not counted.
+ * The sums are done in fixed blocks, added in order, like the statistics.
+ */
+void compute_equilibrium(const size_t particles_size, const Particle *particles, const Material *materials,
+                         const MaterialId *material_ids, const Vector *velocities, const Vector *forces,
+                         EquilibriumMeasures *measures) {
+  const size_t particle_blocks = (particles_size + STATISTICS_BLOCK - 1) / STATISTICS_BLOCK;
+  ParticleSums *particle_sums = (ParticleSums*) malloc((particle_blocks + 1) * sizeof(ParticleSums));
+  double max_squared = 0;
+
+  #pragma omp parallel for schedule(static) reduction(max:max_squared)
+  for (size_t block = 0; block < particle_blocks; ++block) {
+    ParticleSums sums = { 0, 0, 0 };
+    const size_t end = (block + 1) * STATISTICS_BLOCK < particles_size ? (block + 1) * STATISTICS_BLOCK : particles_size;
+    for (size_t i = block * STATISTICS_BLOCK; i < end; ++i) {
+      if (particles[i].radius <= 0) {
+        continue;
+      }
+      const double mass = materials[material_ids[i]].mass;
+      const double speed_squared = ((double) velocities[i].x_component * velocities[i].x_component)
+        + ((double) velocities[i].y_component * velocities[i].y_component);
+      const double net_y = forces[i].y_component - (mass * GRAVITY);
+
+      sums.kinetic += 0.5 * mass * speed_squared;
+      sums.unbalanced += sqrt(((double) forces[i].x_component * forces[i].x_component) + (net_y * net_y));
+      sums.weight += mass * GRAVITY;
+      max_squared = fmax(max_squared, speed_squared);
+    }
+    particle_sums[block] = sums;
+  }
+
+  double kinetic_energy = 0;
+  double unbalanced = 0;
+  double weight = 0;
+  for (size_t block = 0; block < particle_blocks; ++block) {
+    kinetic_energy += particle_sums[block].kinetic;
+    unbalanced += particle_sums[block].unbalanced;
+    weight += particle_sums[block].weight;
+  }
+  free(particle_sums);
+
+  measures->kinetic_energy = kinetic_energy;
+  measures->max_speed = sqrt(max_squared);
+  measures->unbalanced_force_ratio = weight > 0 ? unbalanced / weight : 0;
+}
+
+/**
+ * Returns the largest speed of the particles, in parallel.
+ * The removed particles (radius 0) are not counted.
+ */
+double max_speed(const size_t particles_size, const Particle *particles, const Vector *velocities) {
+  double max_squared = 0;
+
+  #pragma omp parallel for schedule(static) reduction(max:max_squared)
+  for (size_t i = 0; i < particles_size; ++i) {
+    if (particles[i].radius <= 0) {
+      continue;
+    }
+    const double speed_squared = ((double) velocities[i].x_component * velocities[i].x_component)
+      + ((double) velocities[i].y_component * velocities[i].y_component);
+    if (speed_squared > max_squared) {
+      max_squared = speed_squared;
+    }
+  }
+  return sqrt(max_squared);
+}
@@ -0,0 +1,101 @@
+#define _GNU_SOURCE // For MAP_ANONYMOUS, MAP_HUGETLB and MADV_HUGEPAGE.
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "arena.h"
+
+// Size of the huge pages, used to round the explicit huge pages mappings.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * Rounds bytes up to a multiple of alignment, which must be a power of two.
+ */
+static size_t round_up(const size_t bytes, const size_t alignment) {
+  return (bytes + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * Returns the bytes that an allocation of count elements of the given size takes in the arena.
+ */
+size_t arena_aligned_size(const size_t count, const size_t size) {
+  return round_up(count * size, ARENA_ALIGNMENT);
+}
+
+/**
+ * Maps a region of at least 'size' bytes. Returns 0 on success.
+ * Anonymous mappings are already zeroed, and page aligned.
+ */
+int arena_create(Arena *arena, const size_t size, const ArenaPages pages) {
+  void *base = MAP_FAILED;
+  size_t mapped = 0;
+  ArenaPages obtained = pages;
+
+  if (pages == ARENA_PAGES_HUGETLB) {
+    mapped = round_up(size > 0 ? size : 1, HUGE_PAGE_SIZE);
+    base = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED) {
+      // No huge pages reserved in the system.
+      obtained = ARENA_PAGES_TRANSPARENT;
+    }
+  }
+
+  if (base == MAP_FAILED) {
+    mapped = round_up(size > 0 ? size : 1, (size_t) sysconf(_SC_PAGESIZE));
+    base = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      return -1;
+    }
+    if (obtained == ARENA_PAGES_TRANSPARENT && madvise(base, mapped, MADV_HUGEPAGE) != 0) {
+      obtained = ARENA_PAGES_DEFAULT;
+    }
+  }
+
+  arena->base = (char*) base;
+  arena->size = mapped;
+  arena->used = 0;
+  arena->pages = obtained;
+  return 0;
+}
+
+/**
+ * Carves an aligned, zeroed, array of count elements of the given size.
+ * Returns NULL if the arena is exhausted.
+ */
+void *arena_alloc(Arena *arena, const size_t count, const size_t size) {
+  const size_t bytes = arena_aligned_size(count, size);
+  if (arena->used + bytes > arena->size) {
+    return NULL;
+  }
+  void *data = arena->base + arena->used;
+  arena->used += bytes;
+  return data;
+}
+
+/**
+ * Touches every page of an array of count rows of the given size, in parallel,
+ * with the same static schedule as the simulation loops over the particles.
+ */
+void arena_first_touch(void *data, const size_t count, const size_t size) {
+  char *bytes = (char*) data;
+  const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+  #pragma omp parallel for schedule(static)
+  for (size_t row = 0; row < count; ++row) {
+    // One write per page is enough; the rows smaller than a page write each row.
+    for (size_t offset = 0; offset < size; offset += page_size) {
+      bytes[(row * size) + offset] = 0;
+    }
+  }
+}
+
+/**
+ * Unmaps the region.
+ */
+void arena_destroy(Arena *arena) {
+  if (arena->base) {
+    munmap(arena->base, arena->size);
+  }
+  arena->base = NULL;
+  arena->size = 0;
+  arena->used = 0;
+}
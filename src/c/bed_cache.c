@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "bed_cache.h"
+
+/**
+ * Returns the FNV-1a hash of size bytes of data, continuing from hash.
+ * Start with FNV1A_OFFSET_BASIS.
+ */
+uint64_t fnv1a(uint64_t hash, const void *data, const size_t size) {
+  const unsigned char *bytes = (const unsigned char*) data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= FNV1A_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * Writes size bytes of data and adds them to the hash.
+ */
+static void write_hashed(FILE *file, const void *data, const size_t size, uint64_t *hash) {
+  fwrite(data, size, 1, file);
+  *hash = fnv1a(*hash, data, size);
+}
+
+/**
+ * Reads size bytes into data and adds them to the hash. Returns 0 on success.
+ */
+static int read_hashed(FILE *file, void *data, const size_t size, uint64_t *hash) {
+  if (fread(data, size, 1, file) != 1) {
+    return -1;
+  }
+  *hash = fnv1a(*hash, data, size);
+  return 0;
+}
+
+/**
+ * Writes the non zero entries of a rows x columns history, adding them to the hash, and returns how many there were.
+ * With file NULL, only counts them.
+ */
+static uint64_t write_history(FILE *file, const size_t rows, const size_t columns, const size_t stride,
+                              const accum *normal_forces, const accum *tangent_forces, uint64_t *hash) {
+  uint64_t count = 0;
+  for (size_t row = 0; row < rows; ++row) {
+    for (size_t column = 0; column < columns; ++column) {
+      const size_t index = (row * stride) + column;
+      if (normal_forces[index] == 0 && tangent_forces[index] == 0) {
+        continue;
+      }
+      if (file) {
+        const BedCacheEntry entry = { row, column, normal_forces[index], tangent_forces[index] };
+        write_hashed(file, &entry, sizeof(entry), hash);
+      }
+      count += 1;
+    }
+  }
+  return count;
+}
+
+/**
+ * Reads count history entries, checking they fit rows x columns, and adds them to the hash.
+ * The forces are only written if they are not NULL. Returns 0 on success.
+ */
+static int read_history(FILE *file, const uint64_t count, const size_t rows, const size_t columns,
+                        const size_t stride, accum *normal_forces, accum *tangent_forces, uint64_t *hash) {
+  for (uint64_t i = 0; i < count; ++i) {
+    BedCacheEntry entry;
+    if (read_hashed(file, &entry, sizeof(entry), hash) != 0 || entry.row >= rows || entry.column >= columns) {
+      return -1;
+    }
+    if (normal_forces) {
+      normal_forces[(entry.row * stride) + entry.column] = entry.normal;
+      tangent_forces[(entry.row * stride) + entry.column] = entry.tangent;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Reads the positions, velocities and histories after the header, adding them to the hash.
+ * With particles NULL, only checks them: nothing is written. Returns 0 on success.
+ */
+static int read_bed(FILE *file, const BedCacheHeader *header, const size_t history_stride, Particle *particles,
+                    Vector *velocities, accum *normal_forces, accum *tangent_forces,
+                    accum *wall_normal_forces, accum *wall_tangent_forces, uint64_t *hash) {
+  const size_t num_particles = header->num_particles;
+  for (size_t i = 0; i < num_particles; ++i) {
+    real position[2];
+    if (read_hashed(file, position, sizeof(position), hash) != 0) {
+      return -1;
+    }
+    if (particles) {
+      particles[i].x_coordinate = position[0];
+      particles[i].y_coordinate = position[1];
+    }
+  }
+  for (size_t i = 0; i < num_particles; ++i) {
+    Vector velocity;
+    if (read_hashed(file, &velocity, sizeof(velocity), hash) != 0) {
+      return -1;
+    }
+    if (particles) {
+      velocities[i] = velocity;
+    }
+  }
+  if (read_history(file, header->num_history, num_particles, num_particles, history_stride,
+                   particles ? normal_forces : NULL, tangent_forces, hash) != 0) {
+    return -1;
+  }
+  return read_history(file, header->num_wall_history, num_particles, header->num_walls, header->num_walls,
+                      particles ? wall_normal_forces : NULL, wall_tangent_forces, hash);
+}
+
+/**
+ * Writes the positions, the velocities and the contact histories (rows of history_stride)
+ * of the particles to the path, through a temporary file renamed at the end,
+ * so concurrent runs never read a partial file. Returns 0 on success.
+ */
+int bed_cache_save(const char *path, const uint64_t key, const uint64_t settle_steps,
+                   const size_t num_particles, const size_t history_stride, const Particle *particles,
+                   const Vector *velocities, const accum *normal_forces, const accum *tangent_forces,
+                   const size_t num_walls, const accum *wall_normal_forces, const accum *wall_tangent_forces) {
+  char temporary[4096];
+  if (snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long) getpid()) >= (int) sizeof(temporary)) {
+    return -1;
+  }
+  FILE *file = fopen(temporary, "wb");
+  if (!file) {
+    return -1;
+  }
+
+  BedCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BED_CACHE_MAGIC, sizeof(BED_CACHE_MAGIC));
+  header.version = BED_CACHE_VERSION;
+  header.real_size = sizeof(real);
+  header.key = key;
+  header.num_particles = num_particles;
+  header.num_walls = num_walls;
+  header.settle_steps = settle_steps;
+  header.num_history = write_history(NULL, num_particles, num_particles, history_stride,
+                                     normal_forces, tangent_forces, NULL);
+  header.num_wall_history = write_history(NULL, num_particles, num_walls, num_walls,
+                                          wall_normal_forces, wall_tangent_forces, NULL);
+  fwrite(&header, sizeof(header), 1, file);
+
+  // The checksum is only known at the end, so the header is written again with it.
+  uint64_t checksum = FNV1A_OFFSET_BASIS;
+  for (size_t i = 0; i < num_particles; ++i) {
+    const real position[2] = { particles[i].x_coordinate, particles[i].y_coordinate };
+    write_hashed(file, position, sizeof(position), &checksum);
+  }
+  for (size_t i = 0; i < num_particles; ++i) {
+    write_hashed(file, &velocities[i], sizeof(Vector), &checksum);
+  }
+  write_history(file, num_particles, num_particles, history_stride, normal_forces, tangent_forces, &checksum);
+  write_history(file, num_particles, num_walls, num_walls, wall_normal_forces, wall_tangent_forces, &checksum);
+  header.checksum = checksum;
+  if (fseek(file, 0, SEEK_SET) == 0) {
+    fwrite(&header, sizeof(header), 1, file);
+  }
+
+  const int failed = ferror(file);
+  if (fclose(file) != 0 || failed || rename(temporary, path) != 0) {
+    remove(temporary);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Reads a file written by bed_cache_save into the given arrays, which must be zeroed,
+ * if its key, number of particles and walls, and precision match. Returns 0 on success.
+ * The whole file is checked first (its size, the bounds of the history entries and the checksum),
+ * so a truncated or corrupted file leaves the arrays untouched.
+ * The radius, id and material of the particles are not stored, and are left as they are.
+ */
+int bed_cache_load(const char *path, const uint64_t key, uint64_t *settle_steps,
+                   const size_t num_particles, const size_t history_stride, Particle *particles,
+                   Vector *velocities, accum *normal_forces, accum *tangent_forces,
+                   const size_t num_walls, accum *wall_normal_forces, accum *wall_tangent_forces) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+
+  BedCacheHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1
+      || memcmp(header.magic, BED_CACHE_MAGIC, sizeof(BED_CACHE_MAGIC)) != 0
+      || header.version != BED_CACHE_VERSION || header.real_size != sizeof(real) || header.key != key
+      || header.num_particles != num_particles || header.num_walls != num_walls) {
+    fclose(file);
+    return -1;
+  }
+
+  // First pass: the whole file is read and checked, without touching the arrays.
+  uint64_t checksum = FNV1A_OFFSET_BASIS;
+  int result = read_bed(file, &header, history_stride, NULL, NULL, NULL, NULL, NULL, NULL, &checksum);
+  if (result == 0 && (fgetc(file) != EOF || checksum != header.checksum)) {
+    result = -1;
+  }
+  // Second pass: the checked file is copied into the arrays.
+  if (result == 0 && fseek(file, sizeof(header), SEEK_SET) == 0) {
+    checksum = FNV1A_OFFSET_BASIS;
+    result = read_bed(file, &header, history_stride, particles, velocities, normal_forces, tangent_forces,
+                      wall_normal_forces, wall_tangent_forces, &checksum);
+  } else {
+    result = -1;
+  }
+  fclose(file);
+  if (result == 0) {
+    *settle_steps = header.settle_steps;
+  }
+  return result;
+}
@@ -1,5 +1,6 @@
 #include <math.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include "data.h"
 #include "functions.h"
 #include "collisions.h"
@@ -7,8 +8,10 @@
 /**
  * Helper function. Return the column number given an x coordinate. If the x coordinate lies outside the x dimension covered by the grid,
  * then return a negative number: -2 for the left boundary and -1 for the right boundary.
+ * With periodic boundaries along X, the coordinate is wrapped first, so it is always inside.
  */
-int find_col(const double x, const int x_squares, const double square_length){
+int find_col(const double x_coordinate, const int x_squares, const double square_length){
+    const double x = wrap_x(x_coordinate);
     double x_left_limit = -(x_squares*square_length/2); // The far leftest (if that word exists) of the grid
     double diff = x_left_limit -x;
     if(diff>0) return -2; // outside the left boundary
@@ -72,7 +75,7 @@ size_t compute_contacts(Particle const *const *const grid, const int x_squares,
                 Particle* other = first;
                 while(other){ // First compare with particles within the same square
                     if(other != p){
-                        const double overlap = compute_overlap(p, other);
+                        const real overlap = compute_overlap(p, other);
                         if(overlap > 0){
                             contacts[k].p1_idx = p->idx;
                             contacts[k].p2_idx = other->idx;
@@ -88,19 +91,25 @@ size_t compute_contacts(Particle const *const *const grid, const int x_squares,
                 if(left_col == -2) left_col = 0;
                 int right_col = find_col(p->x_coordinate + p->radius*2, x_squares, square_length);
                 if(right_col == -1) right_col = x_squares-1;
+                if(periodic_x_length > 0){
+                    // The columns wrap around: walk them from the left one, at most once each
+                    if(right_col < left_col) right_col += x_squares;
+                    if(right_col - left_col >= x_squares) right_col = left_col + x_squares - 1;
+                }
                 int bottom_row = find_row(p->y_coordinate - p->radius*2, y_squares, square_length);
                 if(bottom_row==-2) bottom_row = 0;
                 int top_row = find_row(p->y_coordinate + p->radius*2, y_squares, square_length);
                 if(top_row==-1) top_row=y_squares-1;
                 // Iterate over the squares
                 for(int neighbor_row=bottom_row; neighbor_row<=top_row; neighbor_row++){
-                    for(int neighbor_col=left_col; neighbor_col<=right_col;neighbor_col++){
+                    for(int unwrapped_col=left_col; unwrapped_col<=right_col;unwrapped_col++){
+                        const int neighbor_col = unwrapped_col % x_squares;
                         size_t neighbor_square_idx = neighbor_row*x_squares+neighbor_col;
                         other = (Particle *)grid[neighbor_square_idx]; // Cast so the compiler does not yell because of referencing a const pointer
                         if(other==NULL) continue; // If there are no particles inside this square
                         if(neighbor_square_idx==square_idx) continue; // If this is p's square, then this has already been traversed
                         while(other){
-                            const double overlap = compute_overlap(p, other);
+                            const real overlap = compute_overlap(p, other);
                             if(overlap > 0){
                                 contacts[k].p1_idx = p->idx;
                                 contacts[k].p2_idx = other->idx;
@@ -121,6 +130,7 @@ size_t compute_contacts(Particle const *const *const grid, const int x_squares,
 /**
  * Fills the grid with particles. The side length of each square grid is twice the diameter of each particle,
  * since all particles have the same radius. Running time is O(N), and memory space is O(N) but really 2*N because of 'lasts' pointers array.
+ * Removed particles (radius 0) are left out.
  */
 void fill_grid(const size_t num_particles, const int x_squares, const int y_squares, const double square_length,
         Particle const *const particles, Particle* *const grid, Particle* *const grid_lasts){
@@ -129,6 +139,7 @@ void fill_grid(const size_t num_particles, const int x_squares, const int y_squa
     for(size_t i=0; i<num_particles; i++){
         Particle* p = (Particle*) &particles[i]; // Cast so the compiler does not yell because of referencing a const pointer
         p->next=NULL; // Make sure we do not do anything funny
+        if(p->radius <= 0) continue; // The particle was removed, and waits for compaction
         int square_ind = find_square(p->x_coordinate, p->y_coordinate, x_squares, y_squares, square_length);
         if(square_ind< 0) continue; // The particle is outside the boundaries of our grid
         if(!grid_lasts[square_ind]){ // if is the first element in the square
@@ -141,3 +152,129 @@ void fill_grid(const size_t num_particles, const int x_squares, const int y_squa
     }
 
 }
+
+/**
+ * Registers each wall in every square of the grid that it could touch, in compressed rows:
+ * the walls of square i are wall_cells[wall_cells_start[i]] to wall_cells[wall_cells_start[i + 1] - 1].
+ * A wall is registered in a square when it passes closer than 'margin' (the largest particle radius) to it,
+ * so a particle only has to check the walls of its own square.
+ * If wall_cells is NULL, only wall_cells_start is filled. Returns the total number of registrations.
+ */
+size_t bin_walls(const size_t num_walls, const Wall *walls, const int x_squares, const int y_squares,
+                 const double square_length, const double margin, size_t *wall_cells_start, size_t *wall_cells){
+    const size_t num_squares = (size_t) x_squares * y_squares;
+    const double x_left_limit = -(x_squares*square_length/2);
+    // Any point of a square is at most half its diagonal away from its center.
+    const double reach = margin + (square_length * 0.7071067811865476); // sqrt(2) / 2
+    size_t k = 0;
+    for(size_t square_idx=0; square_idx<num_squares; square_idx++){
+        wall_cells_start[square_idx] = k;
+        const int row = square_idx / x_squares;
+        const int col = square_idx % x_squares;
+        const Particle center = { x_left_limit + (col + 0.5)*square_length, (row + 0.5)*square_length, reach, NULL, -1 };
+        for(size_t wall_idx=0; wall_idx<num_walls; wall_idx++){
+            if(compute_wall_overlap(&center, &walls[wall_idx]) < 0) continue; // The wall is too far away from this square
+            if(wall_cells) wall_cells[k] = wall_idx;
+            k++;
+        }
+    }
+    wall_cells_start[num_squares] = k;
+    return k;
+}
+
+/**
+ * From the Grid and the walls registered in each square, find all the particles touching a wall,
+ * create a struct WallContact for each one and save it into 'wall_contacts'. Returns the number of contacts.
+ * Only the squares with walls are traversed.
+ */
+size_t compute_wall_contacts(Particle const *const *const grid, const int x_squares, const int y_squares,
+                             const Wall *walls, const size_t *wall_cells_start, const size_t *wall_cells,
+                             WallContact* wall_contacts){
+    size_t k = 0; // current number of contacts
+    const size_t num_squares = (size_t) x_squares * y_squares;
+    for(size_t square_idx=0; square_idx<num_squares; square_idx++){
+        const size_t first_wall = wall_cells_start[square_idx];
+        const size_t last_wall = wall_cells_start[square_idx + 1];
+        if(first_wall == last_wall) continue; // No walls in this square
+        for(const Particle* p = grid[square_idx]; p; p = p->next){
+            for(size_t w=first_wall; w<last_wall; w++){
+                const real overlap = compute_wall_overlap(p, &walls[wall_cells[w]]);
+                if(overlap > 0){
+                    wall_contacts[k].particle_idx = p->idx;
+                    wall_contacts[k].wall_idx = wall_cells[w];
+                    wall_contacts[k].overlap = overlap;
+                    k++;
+                }
+            }
+        }
+    }
+    return k;
+}
+
+/**
+ * qsort comparator of the sort and sweep entries, by the left end of their extent.
+ */
+static int compare_sweep_entries(const void *a, const void *b){
+    const real a_min_x = ((const SweepEntry*) a)->min_x;
+    const real b_min_x = ((const SweepEntry*) b)->min_x;
+    return (a_min_x > b_min_x) - (a_min_x < b_min_x);
+}
+
+/**
+ * Finds the contacts by sort and sweep along X. The entries keep the order of the previous step,
+ * so they are re-sorted with an insertion sort, linear when the particles barely moved.
+ * They are only rebuilt, and fully sorted, when the number of particles changes.
+ * The particles left out get an infinite left end, so they gather at the end of the order.
+ */
+size_t compute_contacts_sweep(const size_t particles_size, const Particle *particles, const int x_squares,
+                              const int y_squares, const double square_length, SweepList *list, Contact *contacts){
+    SweepEntry *entries = list->entries;
+    const int rebuild = list->size != particles_size;
+    if(rebuild){
+        for(size_t i=0; i<particles_size; i++) entries[i].idx = i;
+        list->size = particles_size;
+    }
+
+    // Update the left end of every particle.
+    #pragma omp parallel for schedule(static)
+    for(size_t i=0; i<particles_size; i++){
+        const Particle* p = &particles[entries[i].idx];
+        const int in_grid = p->radius > 0 && find_square(p->x_coordinate, p->y_coordinate, x_squares, y_squares, square_length) >= 0;
+        entries[i].min_x = in_grid ? p->x_coordinate - p->radius : (real) INFINITY;
+    }
+
+    if(rebuild){
+        qsort(entries, particles_size, sizeof(SweepEntry), compare_sweep_entries);
+    }else{
+        for(size_t i=1; i<particles_size; i++){
+            const SweepEntry entry = entries[i];
+            size_t j = i;
+            while(j > 0 && entries[j-1].min_x > entry.min_x){
+                entries[j] = entries[j-1];
+                j--;
+            }
+            entries[j] = entry;
+        }
+    }
+
+    // Each particle can only touch the following ones that start before it ends.
+    size_t k = 0; // current number of contacts
+    for(size_t i=0; i<particles_size && entries[i].min_x != (real) INFINITY; i++){
+        const Particle* p = &particles[entries[i].idx];
+        const real max_x = p->x_coordinate + p->radius;
+        for(size_t j=i+1; j<particles_size && entries[j].min_x < max_x; j++){
+            const Particle* other = &particles[entries[j].idx];
+            const real overlap = compute_overlap(p, other);
+            if(overlap > 0){
+                contacts[k].p1_idx = p->idx;
+                contacts[k].p2_idx = other->idx;
+                contacts[k].overlap = overlap;
+                contacts[k+1].p1_idx = other->idx;
+                contacts[k+1].p2_idx = p->idx;
+                contacts[k+1].overlap = overlap;
+                k += 2;
+            }
+        }
+    }
+    return k;
+}
@@ -0,0 +1,229 @@
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include "data.h"
+#include "functions.h"
+#include "fields.h"
+#include "tracer.h"
+
+#ifndef M_PI
+  #define M_PI 3.141592653589793
+#endif
+
+/**
+ * Sets the cells covering a grid of x_squares by y_squares squares of square_length,
+ * with cell_squares squares per cell side, accumulated in num_slabs slabs.
+ */
+void init_field_grid(const int x_squares, const int y_squares, const double square_length, const int cell_squares,
+                     const double thickness, const int periodic, const int num_slabs, FieldGrid *field_grid) {
+  field_grid->x_cells = (x_squares + cell_squares - 1) / cell_squares;
+  field_grid->y_cells = (y_squares + cell_squares - 1) / cell_squares;
+  field_grid->cell_length = cell_squares * square_length;
+  field_grid->x_min = -(x_squares * square_length / 2);
+  field_grid->thickness = thickness;
+  field_grid->periodic = periodic;
+  field_grid->num_slabs = num_slabs;
+}
+
+/**
+ * Returns the number of cells of one slab.
+ */
+size_t field_grid_cells(const FieldGrid *field_grid) {
+  return (size_t) field_grid->x_cells * field_grid->y_cells;
+}
+
+/**
+ * Returns the index of the cell along an axis of 'count' cells: wrapped around if periodic, clamped otherwise.
+ */
+static inline int cell_index(const int index, const int count, const int periodic) {
+  if (periodic) {
+    return ((index % count) + count) % count;
+  }
+  return index < 0 ? 0 : (index >= count ? count - 1 : index);
+}
+
+/**
+ * Adds 'weight' times the contribution to the cell.
+ */
+static inline void add_weighted(FieldCell *cell, const double weight, const FieldCell *contribution) {
+  cell->mass += weight * contribution->mass;
+  cell->solid_area += weight * contribution->solid_area;
+  cell->momentum_x += weight * contribution->momentum_x;
+  cell->momentum_y += weight * contribution->momentum_y;
+  cell->stress_xx += weight * contribution->stress_xx;
+  cell->stress_xy += weight * contribution->stress_xy;
+  cell->stress_yx += weight * contribution->stress_yx;
+  cell->stress_yy += weight * contribution->stress_yy;
+}
+
+/**
+ * Spreads the contribution of the point (x, y) over the four cells whose centers surround it,
+ * with the tent kernel (bilinear weights), so the weights add up to one.
+ */
+static inline void spread(const FieldGrid *field_grid, FieldCell *slab, const double x, const double y,
+                          const FieldCell *contribution) {
+  const double u = ((x - field_grid->x_min) / field_grid->cell_length) - 0.5;
+  const double v = (y / field_grid->cell_length) - 0.5;
+  const int x0 = (int) floor(u);
+  const int y0 = (int) floor(v);
+  const double x_weights[2] = { 1 - (u - x0), u - x0 };
+  const double y_weights[2] = { 1 - (v - y0), v - y0 };
+
+  for (int j = 0; j < 2; ++j) {
+    const int y_cell = cell_index(y0 + j, field_grid->y_cells, 0);
+    for (int i = 0; i < 2; ++i) {
+      const int x_cell = cell_index(x0 + i, field_grid->x_cells, field_grid->periodic);
+      add_weighted(&slab[((size_t) y_cell * field_grid->x_cells) + x_cell], x_weights[i] * y_weights[j],
+                   contribution);
+    }
+  }
+}
+
+/**
+ * Accumulates the mass, disc area and momentum of the particles, and the force times branch vector of the contacts
+ * (both directions of each pair, each counted half), into the cells, in one parallel pass over each.
+ * The force of each contact is rebuilt from its normal and tangent history, at (p1_idx * history_stride) + p2_idx,
+ * and is spread around the midpoint of the two centers. The removed particles (radius 0) are not counted.
+ * cells has num_slabs slabs; the result is left in the first one.
+ * Slab s takes the s-th of num_slabs equal ranges of the particles and of the contacts, whichever thread runs it,
+ * and the slabs are added in order, so there are no atomics and the sums only depend on num_slabs.
+ */
+void accumulate_fields(const FieldGrid *field_grid, const size_t particles_size, const Particle *particles,
+                       const Material *materials, const MaterialId *material_ids, const Vector *velocities,
+                       const size_t history_stride, const size_t contacts_size, const Contact *contacts,
+                       const accum *normal_forces, const accum *tangent_forces, FieldCell *cells) {
+  const size_t num_cells = field_grid_cells(field_grid);
+  const size_t num_slabs = (size_t) field_grid->num_slabs;
+  memset(cells, 0, num_cells * num_slabs * sizeof(FieldCell));
+
+  #pragma omp parallel
+  {
+    trace_begin("spread fields");
+    #pragma omp for schedule(static)
+    for (size_t s = 0; s < num_slabs; ++s) {
+      FieldCell *slab = cells + (s * num_cells);
+
+      const size_t first_particle = (particles_size * s) / num_slabs;
+      const size_t last_particle = (particles_size * (s + 1)) / num_slabs;
+      for (size_t i = first_particle; i < last_particle; ++i) {
+        if (particles[i].radius <= 0) {
+          continue;
+        }
+        const double mass = materials[material_ids[i]].mass;
+        const FieldCell contribution = {
+          .mass = mass,
+          .solid_area = M_PI * particles[i].radius * particles[i].radius,
+          .momentum_x = mass * velocities[i].x_component,
+          .momentum_y = mass * velocities[i].y_component
+        };
+        spread(field_grid, slab, particles[i].x_coordinate, particles[i].y_coordinate, &contribution);
+      }
+
+      const size_t first_contact = (contacts_size * s) / num_slabs;
+      const size_t last_contact = (contacts_size * (s + 1)) / num_slabs;
+      for (size_t i = first_contact; i < last_contact; ++i) {
+        const Particle *p1 = &particles[contacts[i].p1_idx];
+        const Particle *p2 = &particles[contacts[i].p2_idx];
+        // From P2 to P1, like the normal of the contact laws.
+        const double x_diff = minimum_image_x(p1->x_coordinate - p2->x_coordinate);
+        const double y_diff = p1->y_coordinate - p2->y_coordinate;
+        const double distance = sqrt((x_diff * x_diff) + (y_diff * y_diff));
+        if (p1->radius <= 0 || p2->radius <= 0 || distance <= 0) {
+          continue;
+        }
+        const size_t history = (contacts[i].p1_idx * history_stride) + contacts[i].p2_idx;
+        const double normal_x = x_diff / distance;
+        const double normal_y = y_diff / distance;
+        const double normal_force = normal_forces[history];
+        const double tangent_force = tangent_forces[history];
+        // Force on P2, as added by the contact loops, and branch vector from P1 to P2, in meters.
+        const double force_x = (-normal_x * normal_force) - (normal_y * tangent_force);
+        const double force_y = (-normal_y * normal_force) + (normal_x * tangent_force);
+        const double branch_x = -x_diff / METERS_TO_COORDINATES;
+        const double branch_y = -y_diff / METERS_TO_COORDINATES;
+        const FieldCell contribution = {
+          .stress_xx = 0.5 * force_x * branch_x,
+          .stress_xy = 0.5 * force_x * branch_y,
+          .stress_yx = 0.5 * force_y * branch_x,
+          .stress_yy = 0.5 * force_y * branch_y
+        };
+        spread(field_grid, slab, p2->x_coordinate + (x_diff / 2), p2->y_coordinate + (y_diff / 2), &contribution);
+      }
+    }
+    trace_end("spread fields");
+  }
+
+  #pragma omp parallel for schedule(static)
+  for (size_t cell = 0; cell < num_cells; ++cell) {
+    for (size_t slab = 1; slab < num_slabs; ++slab) {
+      add_weighted(&cells[cell], 1, &cells[(slab * num_cells) + cell]);
+    }
+  }
+}
+
+/**
+ * Returns the velocity component (0 for X, 1 for Y) of the cell, or NAN if it is outside the grid or holds no mass.
+ */
+static double cell_velocity(const FieldGrid *field_grid, const FieldCell *cells, int x, const int y,
+                            const int component) {
+  if (field_grid->periodic) {
+    x = cell_index(x, field_grid->x_cells, 1);
+  }
+  if (x < 0 || x >= field_grid->x_cells || y < 0 || y >= field_grid->y_cells) {
+    return NAN;
+  }
+  const FieldCell *cell = &cells[((size_t) y * field_grid->x_cells) + x];
+  if (cell->mass <= 0) {
+    return NAN;
+  }
+  return (component == 0 ? cell->momentum_x : cell->momentum_y) / cell->mass;
+}
+
+/**
+ * Returns the derivative of a velocity component of the cell (x, y) along the axis (dx, dy),
+ * with central differences, or one sided ones when a neighbor is missing, or 0 without neighbors.
+ */
+static double velocity_derivative(const FieldGrid *field_grid, const FieldCell *cells, const int x, const int y,
+                                  const int component, const int dx, const int dy) {
+  const double spacing = field_grid->cell_length / METERS_TO_COORDINATES;
+  const double center = cell_velocity(field_grid, cells, x, y, component);
+  const double before = cell_velocity(field_grid, cells, x - dx, y - dy, component);
+  const double after = cell_velocity(field_grid, cells, x + dx, y + dy, component);
+  if (!isnan(before) && !isnan(after)) {
+    return (after - before) / (2 * spacing);
+  }
+  if (!isnan(center) && !isnan(after)) {
+    return (after - center) / spacing;
+  }
+  if (!isnan(center) && !isnan(before)) {
+    return (center - before) / spacing;
+  }
+  return 0;
+}
+
+/**
+ * Turns the sums of the cell (x, y) into continuum values. The strain rate is the symmetric part
+ * of the velocity gradient, with central differences between the neighboring cells that hold mass,
+ * or one sided ones next to empty cells and the sides.
+ */
+void field_values(const FieldGrid *field_grid, const FieldCell *cells, const int x, const int y,
+                  FieldValues *values) {
+  const FieldCell *cell = &cells[((size_t) y * field_grid->x_cells) + x];
+  const double area = field_grid->cell_length * field_grid->cell_length;
+  const double coordinates_cubed = METERS_TO_COORDINATES * METERS_TO_COORDINATES * METERS_TO_COORDINATES;
+  const double volume = (area * field_grid->thickness) / coordinates_cubed;
+
+  values->x = field_grid->x_min + ((x + 0.5) * field_grid->cell_length);
+  values->y = (y + 0.5) * field_grid->cell_length;
+  values->density = cell->mass * coordinates_cubed / (area * field_grid->thickness);
+  values->porosity = 1 - (cell->solid_area / area);
+  values->velocity_x = cell->mass > 0 ? cell->momentum_x / cell->mass : 0;
+  values->velocity_y = cell->mass > 0 ? cell->momentum_y / cell->mass : 0;
+  values->stress_xx = cell->stress_xx / volume;
+  values->stress_xy = (cell->stress_xy + cell->stress_yx) / (2 * volume);
+  values->stress_yy = cell->stress_yy / volume;
+  values->strain_rate_xx = velocity_derivative(field_grid, cells, x, y, 0, 1, 0);
+  values->strain_rate_yy = velocity_derivative(field_grid, cells, x, y, 1, 0, 1);
+  values->strain_rate_xy = 0.5 * (velocity_derivative(field_grid, cells, x, y, 0, 0, 1)
+                                  + velocity_derivative(field_grid, cells, x, y, 1, 1, 0));
+}
@@ -0,0 +1,127 @@
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include "data.h"
+#include "functions.h"
+#include "population.h"
+#include "flight_recorder.h"
+
+/**
+ * Sets up the recorder over the given buffers: slots with one entry per particle,
+ * and states with capacity * num_tracked entries.
+ */
+void recorder_init(FlightRecorder *recorder, const size_t particles_size, const size_t num_tracked,
+                   size_t *tracked, const size_t capacity, int *slots, RecordedState *states) {
+  recorder->num_tracked = num_tracked;
+  recorder->tracked = tracked;
+  recorder->slots = slots;
+  recorder->capacity = capacity;
+  recorder->recorded = 0;
+  recorder->states = states;
+
+  for (size_t i = 0; i < particles_size; ++i) {
+    slots[i] = -1;
+  }
+  for (size_t k = 0; k < num_tracked; ++k) {
+    slots[tracked[k]] = (int) k;
+  }
+}
+
+/**
+ * Updates the tracked particles after compact_particles, with its remap of the old particles_size indices.
+ * The removed ones keep their column in the buffer, recorded with REMOVED_PARTICLE as index.
+ */
+void recorder_remap(FlightRecorder *recorder, const size_t particles_size, const size_t *remap) {
+  for (size_t i = 0; i < particles_size; ++i) {
+    recorder->slots[i] = -1;
+  }
+  for (size_t k = 0; k < recorder->num_tracked; ++k) {
+    if (recorder->tracked[k] == REMOVED_PARTICLE) {
+      continue;
+    }
+    recorder->tracked[k] = remap[recorder->tracked[k]];
+    if (recorder->tracked[k] != REMOVED_PARTICLE) {
+      recorder->slots[recorder->tracked[k]] = (int) k;
+    }
+  }
+}
+
+/**
+ * Records the state of the tracked particles at the end of the given step,
+ * overwriting the oldest step once the buffer is full.
+ * The contacts are found with one pass over the contacts of the step,
+ * keeping those where a tracked particle receives the force.
+ */
+void recorder_record(FlightRecorder *recorder, const unsigned long step, const real dt,
+                     const size_t history_stride, const Particle *particles,
+                     const Material *materials, const MaterialId *material_ids, const Vector *forces, const Vector *velocities,
+                     const size_t contacts_size, const Contact *contacts,
+                     const accum *normal_forces, const accum *tangent_forces) {
+  RecordedState *row = &recorder->states[(recorder->recorded % recorder->capacity) * recorder->num_tracked];
+
+  for (size_t k = 0; k < recorder->num_tracked; ++k) {
+    const size_t i = recorder->tracked[k];
+    RecordedState *state = &row[k];
+    state->step = step;
+    state->particle_idx = i;
+    state->num_contacts = 0;
+    if (i == REMOVED_PARTICLE) {
+      continue;
+    }
+    state->particle = particles[i];
+    state->particle.next = NULL;
+    state->material = materials[material_ids[i]];
+    state->normal_force = 0;
+    state->tangent_force = 0;
+    state->force = forces[i];
+    state->acceleration.x_component = forces[i].x_component * state->material.inverse_mass;
+    state->acceleration.y_component = (forces[i].y_component * state->material.inverse_mass) - GRAVITY;
+    state->velocity = velocities[i];
+    state->displacement.x_component = velocities[i].x_component * dt;
+    state->displacement.y_component = velocities[i].y_component * dt;
+  }
+
+  for (size_t c = 0; c < contacts_size; ++c) {
+    const int slot = recorder->slots[contacts[c].p2_idx];
+    if (slot < 0) {
+      continue;
+    }
+    RecordedState *state = &row[slot];
+    const size_t history_idx = (contacts[c].p1_idx * history_stride) + contacts[c].p2_idx;
+    state->normal_force += normal_forces[history_idx];
+    state->tangent_force += tangent_forces[history_idx];
+    if (state->num_contacts < RECORDER_MAX_CONTACTS) {
+      RecordedContact *contact = &state->contacts[state->num_contacts];
+      contact->other_idx = contacts[c].p1_idx;
+      contact->overlap = contacts[c].overlap;
+      contact->normal_force = normal_forces[history_idx];
+      contact->tangent_force = tangent_forces[history_idx];
+    }
+    state->num_contacts += 1;
+  }
+
+  recorder->recorded += 1;
+}
+
+/**
+ * Returns the index of the first particle whose position or velocity is not finite,
+ * or whose speed is above max_speed (if positive). Returns -1 if there is none.
+ */
+long find_blow_up(const size_t particles_size, const Particle *particles, const Vector *velocities,
+                  const double max_speed) {
+  size_t first = particles_size;
+  const double max_speed_squared = max_speed > 0 ? max_speed * max_speed : INFINITY;
+
+  #pragma omp parallel for schedule(static) reduction(min:first)
+  for (size_t i = 0; i < particles_size; ++i) {
+    const double speed_squared = ((double) velocities[i].x_component * velocities[i].x_component)
+      + ((double) velocities[i].y_component * velocities[i].y_component);
+    // A NaN in any of them fails the comparisons.
+    const int valid = isfinite(particles[i].x_coordinate) && isfinite(particles[i].y_coordinate)
+      && isfinite(speed_squared) && speed_squared <= max_speed_squared;
+    if (!valid && i < first) {
+      first = i;
+    }
+  }
+  return first < particles_size ? (long) first : -1;
+}
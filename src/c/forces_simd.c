@@ -0,0 +1,190 @@
+#include <math.h>
+#include <stddef.h>
+#include "data.h"
+#include "functions.h"
+#include "forces_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+/**
+ * Returns the widest instruction set supported by the running CPU.
+ */
+SimdLevel detect_simd_level(void) {
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return SIMD_AVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return SIMD_AVX2;
+  }
+#endif
+  return SIMD_NONE;
+}
+
+/**
+ * Scalar version of the batch kernel, used for the contacts that do not fill a whole vector.
+ * Same operations as collide_two_particles, but with the Coulomb cap written as a clamp.
+ */
+static void contact_kernel_scalar(const accum dt, const accum friction, ContactBatch *batch,
+                                  const size_t begin, const size_t end) {
+  for (size_t i = begin; i < end; ++i) {
+    const accum distance = sqrt((batch->x_diff[i] * batch->x_diff[i]) + (batch->y_diff[i] * batch->y_diff[i]));
+    const accum normal_x = batch->x_diff[i] / distance;
+    const accum normal_y = batch->y_diff[i] / distance;
+    const accum normal_velocity = (normal_x * batch->velocity_x_diff[i]) + (normal_y * batch->velocity_y_diff[i]);
+    const accum tangent_velocity = (normal_y * batch->velocity_x_diff[i]) - (normal_x * batch->velocity_y_diff[i]);
+
+    const accum Fn = fmax(batch->normal[i] + ((normal_velocity * batch->kn[i]) * dt), 0.0);
+    const accum Fs_max = Fn * friction;
+    const accum Fs = fmin(fmax(batch->tangent[i] + ((tangent_velocity * batch->ks[i]) * dt), -Fs_max), Fs_max);
+
+    batch->normal[i] = Fn;
+    batch->tangent[i] = Fs;
+    batch->force_x[i] = (-normal_x * Fn) - (normal_y * Fs);
+    batch->force_y[i] = (-normal_y * Fn) + (normal_x * Fs);
+  }
+}
+
+#ifdef SIMD_X86
+/**
+ * Batch kernel for AVX2, 4 contacts per iteration.
+ * The Fn < 0 and Coulomb cap branches are replaced by max/min clamps:
+ * once Fn is clamped to zero, the cap clamps Fs to zero too.
+ */
+__attribute__((target("avx2")))
+static void contact_kernel_avx2(const accum dt, const accum friction, ContactBatch *batch, const size_t size) {
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  const __m256d time = _mm256_set1_pd(dt);
+  const __m256d friction_coefficient = _mm256_set1_pd(friction);
+
+  size_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    const __m256d x_diff = _mm256_loadu_pd(&batch->x_diff[i]);
+    const __m256d y_diff = _mm256_loadu_pd(&batch->y_diff[i]);
+    const __m256d velocity_x_diff = _mm256_loadu_pd(&batch->velocity_x_diff[i]);
+    const __m256d velocity_y_diff = _mm256_loadu_pd(&batch->velocity_y_diff[i]);
+
+    const __m256d distance = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(x_diff, x_diff), _mm256_mul_pd(y_diff, y_diff)));
+    const __m256d normal_x = _mm256_div_pd(x_diff, distance);
+    const __m256d normal_y = _mm256_div_pd(y_diff, distance);
+    const __m256d normal_velocity = _mm256_add_pd(_mm256_mul_pd(normal_x, velocity_x_diff), _mm256_mul_pd(normal_y, velocity_y_diff));
+    const __m256d tangent_velocity = _mm256_sub_pd(_mm256_mul_pd(normal_y, velocity_x_diff), _mm256_mul_pd(normal_x, velocity_y_diff));
+
+    const __m256d dfn = _mm256_mul_pd(_mm256_mul_pd(normal_velocity, _mm256_loadu_pd(&batch->kn[i])), time);
+    const __m256d dfs = _mm256_mul_pd(_mm256_mul_pd(tangent_velocity, _mm256_loadu_pd(&batch->ks[i])), time);
+    const __m256d Fn = _mm256_max_pd(_mm256_add_pd(_mm256_loadu_pd(&batch->normal[i]), dfn), zero);
+    const __m256d Fs_max = _mm256_mul_pd(Fn, friction_coefficient);
+    const __m256d Fs = _mm256_min_pd(_mm256_max_pd(_mm256_add_pd(_mm256_loadu_pd(&batch->tangent[i]), dfs),
+                                                   _mm256_xor_pd(Fs_max, sign)), Fs_max);
+
+    _mm256_storeu_pd(&batch->normal[i], Fn);
+    _mm256_storeu_pd(&batch->tangent[i], Fs);
+    _mm256_storeu_pd(&batch->force_x[i], _mm256_sub_pd(_mm256_xor_pd(_mm256_mul_pd(normal_x, Fn), sign), _mm256_mul_pd(normal_y, Fs)));
+    _mm256_storeu_pd(&batch->force_y[i], _mm256_add_pd(_mm256_xor_pd(_mm256_mul_pd(normal_y, Fn), sign), _mm256_mul_pd(normal_x, Fs)));
+  }
+  contact_kernel_scalar(dt, friction, batch, i, size);
+}
+
+/**
+ * Batch kernel for AVX-512, 8 contacts per iteration.
+ * Same operations as contact_kernel_avx2.
+ */
+__attribute__((target("avx512f")))
+static void contact_kernel_avx512(const accum dt, const accum friction, ContactBatch *batch, const size_t size) {
+  const __m512d zero = _mm512_setzero_pd();
+  const __m512d time = _mm512_set1_pd(dt);
+  const __m512d friction_coefficient = _mm512_set1_pd(friction);
+
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    const __m512d x_diff = _mm512_loadu_pd(&batch->x_diff[i]);
+    const __m512d y_diff = _mm512_loadu_pd(&batch->y_diff[i]);
+    const __m512d velocity_x_diff = _mm512_loadu_pd(&batch->velocity_x_diff[i]);
+    const __m512d velocity_y_diff = _mm512_loadu_pd(&batch->velocity_y_diff[i]);
+
+    const __m512d distance = _mm512_sqrt_pd(_mm512_add_pd(_mm512_mul_pd(x_diff, x_diff), _mm512_mul_pd(y_diff, y_diff)));
+    const __m512d normal_x = _mm512_div_pd(x_diff, distance);
+    const __m512d normal_y = _mm512_div_pd(y_diff, distance);
+    const __m512d normal_velocity = _mm512_add_pd(_mm512_mul_pd(normal_x, velocity_x_diff), _mm512_mul_pd(normal_y, velocity_y_diff));
+    const __m512d tangent_velocity = _mm512_sub_pd(_mm512_mul_pd(normal_y, velocity_x_diff), _mm512_mul_pd(normal_x, velocity_y_diff));
+
+    const __m512d dfn = _mm512_mul_pd(_mm512_mul_pd(normal_velocity, _mm512_loadu_pd(&batch->kn[i])), time);
+    const __m512d dfs = _mm512_mul_pd(_mm512_mul_pd(tangent_velocity, _mm512_loadu_pd(&batch->ks[i])), time);
+    const __m512d Fn = _mm512_max_pd(_mm512_add_pd(_mm512_loadu_pd(&batch->normal[i]), dfn), zero);
+    const __m512d Fs_max = _mm512_mul_pd(Fn, friction_coefficient);
+    const __m512d Fs = _mm512_min_pd(_mm512_max_pd(_mm512_add_pd(_mm512_loadu_pd(&batch->tangent[i]), dfs),
+                                                   _mm512_sub_pd(zero, Fs_max)), Fs_max);
+
+    _mm512_storeu_pd(&batch->normal[i], Fn);
+    _mm512_storeu_pd(&batch->tangent[i], Fs);
+    _mm512_storeu_pd(&batch->force_x[i], _mm512_sub_pd(_mm512_sub_pd(zero, _mm512_mul_pd(normal_x, Fn)), _mm512_mul_pd(normal_y, Fs)));
+    _mm512_storeu_pd(&batch->force_y[i], _mm512_add_pd(_mm512_sub_pd(zero, _mm512_mul_pd(normal_y, Fn)), _mm512_mul_pd(normal_x, Fs)));
+  }
+  contact_kernel_scalar(dt, friction, batch, i, size);
+}
+#endif
+
+/**
+ * Same as compute_forces, but processes the contacts in batches with the vectorized kernel
+ * of the given level. Falls back to compute_forces with SIMD_NONE, or for other laws than the linear one.
+ */
+void compute_forces_simd(const SimdLevel level, const ContactLaw law, const ContactLawParams *params,
+                         const real dt, const size_t particles_size,
+                         const size_t contacts_size, const Particle *particles,
+                         const Material *materials, const MaterialId *material_ids, const Contact *contacts,
+                         const Vector *velocities, accum *normal_forces,
+                         accum *tangent_forces, Vector *forces) {
+#ifdef SIMD_X86
+  if (level != SIMD_NONE && law == CONTACT_LAW_LINEAR) {
+    _Alignas(64) ContactBatch batch;
+
+    for (size_t start = 0; start < contacts_size; start += CONTACT_BATCH_SIZE) {
+      const size_t remaining = contacts_size - start;
+      const size_t batch_size = remaining < CONTACT_BATCH_SIZE ? remaining : CONTACT_BATCH_SIZE;
+
+      // Gather.
+      for (size_t j = 0; j < batch_size; ++j) {
+        const size_t p1_idx = contacts[start + j].p1_idx;
+        const size_t p2_idx = contacts[start + j].p2_idx;
+        const size_t p2_p1_idx = (p1_idx * particles_size) + p2_idx;
+        batch.x_diff[j] = minimum_image_x(particles[p1_idx].x_coordinate - particles[p2_idx].x_coordinate);
+        batch.y_diff[j] = particles[p1_idx].y_coordinate - particles[p2_idx].y_coordinate;
+        batch.velocity_x_diff[j] = velocities[p2_idx].x_component - velocities[p1_idx].x_component;
+        batch.velocity_y_diff[j] = velocities[p2_idx].y_component - velocities[p1_idx].y_component;
+        const Material *material_p1 = &materials[material_ids[p1_idx]];
+        const Material *material_p2 = &materials[material_ids[p2_idx]];
+        batch.kn[j] = pair_rigidity(material_p1->kn, material_p2->kn);
+        batch.ks[j] = pair_rigidity(material_p1->ks, material_p2->ks);
+        batch.normal[j] = normal_forces[p2_p1_idx];
+        batch.tangent[j] = tangent_forces[p2_p1_idx];
+      }
+
+      if (level == SIMD_AVX512) {
+        contact_kernel_avx512(dt, params->friction, &batch, batch_size);
+      } else {
+        contact_kernel_avx2(dt, params->friction, &batch, batch_size);
+      }
+
+      // Scatter, in the same order as the contacts.
+      for (size_t j = 0; j < batch_size; ++j) {
+        const size_t p1_idx = contacts[start + j].p1_idx;
+        const size_t p2_idx = contacts[start + j].p2_idx;
+        const size_t p2_p1_idx = (p1_idx * particles_size) + p2_idx;
+        normal_forces[p2_p1_idx] = batch.normal[j];
+        tangent_forces[p2_p1_idx] = batch.tangent[j];
+        forces[p2_idx].x_component += (real) batch.force_x[j];
+        forces[p2_idx].y_component += (real) batch.force_y[j];
+      }
+    }
+    return;
+  }
+#endif
+  (void) level;
+  compute_forces(law, params, dt, particles_size, contacts_size, particles, materials, material_ids, contacts,
+                 velocities, normal_forces, tangent_forces, forces);
+}
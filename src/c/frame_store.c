@@ -0,0 +1,174 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "frame_store.h"
+
+/**
+ * Returns the offset after a section of count elements of the given size starting at offset,
+ * aligned for the next section.
+ */
+static size_t next_section(const size_t offset, const size_t count, const size_t size) {
+  const size_t end = offset + (count * size);
+  return (end + FRAME_STORE_ALIGNMENT - 1) & ~((size_t) FRAME_STORE_ALIGNMENT - 1);
+}
+
+/**
+ * Fills the sizes and offsets of the header for the given number of frames, rows and squares,
+ * with each section aligned to FRAME_STORE_ALIGNMENT. Returns the size of the file.
+ */
+size_t frame_store_layout(const size_t num_frames, const size_t num_rows, const size_t num_squares,
+                          FrameStoreHeader *header) {
+  memset(header, 0, sizeof(FrameStoreHeader));
+  memcpy(header->magic, FRAME_STORE_MAGIC, sizeof(header->magic));
+  header->version = FRAME_STORE_VERSION;
+  header->num_frames = num_frames;
+  header->num_rows = num_rows;
+  header->num_squares = num_squares;
+  header->frames_offset = next_section(0, 1, sizeof(FrameStoreHeader));
+  header->x_offset = next_section(header->frames_offset, num_frames, sizeof(FrameEntry));
+  header->y_offset = next_section(header->x_offset, num_rows, sizeof(double));
+  header->radius_offset = next_section(header->y_offset, num_rows, sizeof(double));
+  header->id_offset = next_section(header->radius_offset, num_rows, sizeof(double));
+  header->squares_offset = next_section(header->id_offset, num_rows, sizeof(uint64_t));
+  header->size = next_section(header->squares_offset, num_squares, sizeof(StoredSquare));
+  return header->size;
+}
+
+/**
+ * Points the arrays of the store to the sections of a file mapped at data.
+ */
+void frame_store_attach(void *data, const size_t size, FrameStore *store) {
+  const char *bytes = (const char*) data;
+  const FrameStoreHeader *header = (const FrameStoreHeader*) data;
+  store->data = data;
+  store->size = size;
+  store->header = header;
+  store->frames = (const FrameEntry*) (bytes + header->frames_offset);
+  store->x = (const double*) (bytes + header->x_offset);
+  store->y = (const double*) (bytes + header->y_offset);
+  store->radius = (const double*) (bytes + header->radius_offset);
+  store->ids = (const uint64_t*) (bytes + header->id_offset);
+  store->squares = (const StoredSquare*) (bytes + header->squares_offset);
+}
+
+/**
+ * Returns 1 if a section of count elements of the given size at offset lies within size bytes,
+ * and is aligned for its elements, without overflowing.
+ */
+static int section_fits(const uint64_t offset, const uint64_t count, const size_t element_size, const size_t size) {
+  if (offset > size || (offset % FRAME_STORE_ALIGNMENT) != 0) {
+    return 0;
+  }
+  return count <= (size - offset) / element_size;
+}
+
+/**
+ * Returns 1 if every section of the header lies within the file, and every frame within the rows.
+ */
+static int frame_store_valid(const FrameStoreHeader *header, const void *data, const size_t size) {
+  if (!section_fits(header->frames_offset, header->num_frames, sizeof(FrameEntry), size)
+      || !section_fits(header->x_offset, header->num_rows, sizeof(double), size)
+      || !section_fits(header->y_offset, header->num_rows, sizeof(double), size)
+      || !section_fits(header->radius_offset, header->num_rows, sizeof(double), size)
+      || !section_fits(header->id_offset, header->num_rows, sizeof(uint64_t), size)
+      || !section_fits(header->squares_offset, header->num_squares, sizeof(StoredSquare), size)) {
+    return 0;
+  }
+  const FrameEntry *frames = (const FrameEntry*) ((const char*) data + header->frames_offset);
+  for (uint64_t i = 0; i < header->num_frames; ++i) {
+    if (frames[i].first_row > header->num_rows || frames[i].num_rows > header->num_rows - frames[i].first_row) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Maps the file read only, and checks its header, its sections and the rows of its frames. Returns 0 on success.
+ */
+int frame_store_open(const char *path, FrameStore *store) {
+  const int file = open(path, O_RDONLY);
+  if (file < 0) {
+    return -1;
+  }
+  struct stat status;
+  if (fstat(file, &status) != 0 || (size_t) status.st_size < sizeof(FrameStoreHeader)) {
+    close(file);
+    return -1;
+  }
+  const size_t size = (size_t) status.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, file, 0);
+  close(file);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+
+  const FrameStoreHeader *header = (const FrameStoreHeader*) data;
+  if (memcmp(header->magic, FRAME_STORE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != FRAME_STORE_VERSION || header->size != size || !frame_store_valid(header, data, size)) {
+    munmap(data, size);
+    return -1;
+  }
+  frame_store_attach(data, size, store);
+  return 0;
+}
+
+/**
+ * Unmaps the file.
+ */
+void frame_store_close(FrameStore *store) {
+  if (store->data) {
+    munmap(store->data, store->size);
+  }
+  store->data = NULL;
+  store->size = 0;
+}
+
+/**
+ * Returns the index of the first frame of the given kind whose step is at least 'step',
+ * or the index after the last frame of that kind if there is none. Binary search.
+ */
+size_t frame_store_find_step(const FrameStore *store, const FrameKind kind, const uint64_t step) {
+  size_t low = 0;
+  size_t high = store->header->num_frames;
+  while (low < high) {
+    const size_t middle = low + ((high - low) / 2);
+    const FrameEntry *frame = &store->frames[middle];
+    if (frame->kind < (uint32_t) kind || (frame->kind == (uint32_t) kind && frame->step < step)) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/**
+ * Returns the row of the particle with the given id in the frame, or SIZE_MAX if it is not there.
+ * Binary search when the ids of the frame are sorted, which the simulation keeps since compactions preserve the order.
+ */
+size_t frame_store_find_particle(const FrameStore *store, const FrameEntry *frame, const uint64_t id) {
+  const uint64_t *ids = store->ids + frame->first_row;
+  if (frame->flags & FRAME_IDS_SORTED) {
+    size_t low = 0;
+    size_t high = frame->num_rows;
+    while (low < high) {
+      const size_t middle = low + ((high - low) / 2);
+      if (ids[middle] < id) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    return (low < frame->num_rows && ids[low] == id) ? frame->first_row + low : SIZE_MAX;
+  }
+  for (size_t row = 0; row < frame->num_rows; ++row) {
+    if (ids[row] == id) {
+      return frame->first_row + row;
+    }
+  }
+  return SIZE_MAX;
+}
@@ -1,18 +1,19 @@
-#include <math.h>
+#include <tgmath.h> // Type-generic math, so float builds call the float variants.
 #include <stdlib.h>
 #include <string.h> // For memset.
 #include "data.h"
 #include "functions.h"
+#include "tracer.h"
 
-// tan((30 * PI) / 180).
-#define TAN_30_PI_180 0.5773502691896257
+// Not periodic by default.
+real periodic_x_length = 0;
 
 /**
- * Computes the distance between two particles.
+ * Computes the distance between two particles, to the nearest periodic copy of p2.
  */
-inline double compute_distance(const Particle *p1, const Particle *p2) {
-  const double x_diff = p1->x_coordinate - p2->x_coordinate;
-  const double y_diff = p1->y_coordinate - p2->y_coordinate;
+inline real compute_distance(const Particle *p1, const Particle *p2) {
+  const real x_diff = minimum_image_x(p1->x_coordinate - p2->x_coordinate);
+  const real y_diff = p1->y_coordinate - p2->y_coordinate;
 
   return sqrt((x_diff * x_diff) + (y_diff * y_diff));
 }
@@ -21,9 +22,9 @@ inline double compute_distance(const Particle *p1, const Particle *p2) {
  * Computes the overlap between two particles.
  * Note: If the overlap is negative, there is no overlap.
  */
-inline double compute_overlap(const Particle *p1, const Particle *p2) {
-  const double d = p1->radius + p2->radius;
-  const double distance = compute_distance(p1, p2);
+inline real compute_overlap(const Particle *p1, const Particle *p2) {
+  const real d = p1->radius + p2->radius;
+  const real distance = compute_distance(p1, p2);
 
   return d - distance;
 }
@@ -33,112 +34,234 @@ inline double compute_overlap(const Particle *p1, const Particle *p2) {
  * and computes the resultant acceleration.
  */
 inline void compute_acceleration(const size_t particle_index,
-                                 const ParticleProperties *particles_properties,
+                                 const Material *materials, const MaterialId *material_ids,
                                  const Vector *forces, Vector *accelerations) {
-  accelerations[particle_index].x_component =
-    forces[particle_index].x_component / particles_properties[particle_index].mass;
-  accelerations[particle_index].y_component =
-    forces[particle_index].y_component / particles_properties[particle_index].mass;
+  const real inverse_mass = materials[material_ids[particle_index]].inverse_mass;
+  accelerations[particle_index].x_component = forces[particle_index].x_component * inverse_mass;
+  accelerations[particle_index].y_component = forces[particle_index].y_component * inverse_mass;
 }
 
 /**
  * Apply gravity to a vector of forces.
  */
 inline void apply_gravity(const size_t size,
-                          const ParticleProperties *particles_properties,
+                          const Material *materials, const MaterialId *material_ids,
                           Vector *forces) {
   for (size_t i = 0; i < size; ++i) {
-    forces[i].y_component -= (particles_properties[i].mass * 9.81d);
+    forces[i].y_component -= (materials[material_ids[i]].mass * GRAVITY);
   }
 }
 
 /**
- * Compute the forces applied to P2 given it was collided by P1.
- * Note: previous_normal and previous_tangent correspond to P2 with respect to P1.
+ * Damps the contact forces of the particles, in parallel, before the integration.
+ * Local damping removes 'strength' (0 to 1) times the magnitude of each component of the net force,
+ * gravity included, against the velocity; viscous damping removes strength (in 1/s) * mass * velocity.
+ * The removed particles (radius 0) are skipped.
+ * The forces do not hold gravity, which integrate_particles adds, so the local damping adds it to find the net force.
  */
-void collide_two_particles(const double dt, const double distance,
-                           const Particle *p1, const Particle *p2,
-                           const Vector *velocity_p1, const Vector *velocity_p2,
-                           const ParticleProperties *properties_p2,
-                           double *previous_normal, double *previous_tangent,
-                           Vector *force_p2) {
-  const Vector normal = {
-    .x_component = (p1->x_coordinate - p2->x_coordinate) / distance,
-    .y_component = (p1->y_coordinate - p2->y_coordinate) / distance
-  };
-
-  const double velocity_x_diff = velocity_p2->x_component - velocity_p1->x_component;
-  const double velocity_y_diff = velocity_p2->y_component - velocity_p1->y_component;
-  const double normal_velocity = (normal.x_component * velocity_x_diff)
-    + (normal.y_component * velocity_y_diff);
-  const double tangent_velocity = (normal.y_component * velocity_x_diff)
-    - (normal.x_component * velocity_y_diff);
+void damp_forces(const DampingMode mode, const real strength, const size_t particles_size,
+                 const Particle *particles, const Material *materials, const MaterialId *material_ids,
+                 const Vector *velocities, Vector *forces) {
+  #pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < particles_size; ++i) {
+    if (particles[i].radius <= 0) {
+      continue;
+    }
+    const real mass = materials[material_ids[i]].mass;
+    if (mode == DAMPING_LOCAL) {
+      const real net_x = forces[i].x_component;
+      const real net_y = forces[i].y_component - (mass * GRAVITY);
+      const real sign_x = (velocities[i].x_component > 0) - (velocities[i].x_component < 0);
+      const real sign_y = (velocities[i].y_component > 0) - (velocities[i].y_component < 0);
+      forces[i].x_component -= strength * fabs(net_x) * sign_x;
+      forces[i].y_component -= strength * fabs(net_y) * sign_y;
+    } else if (mode == DAMPING_VISCOUS) {
+      forces[i].x_component -= strength * mass * velocities[i].x_component;
+      forces[i].y_component -= strength * mass * velocities[i].y_component;
+    }
+  }
+}
 
-  const double dfn = normal_velocity * properties_p2->kn * dt;
-  const double dfs = tangent_velocity * properties_p2->ks * dt;
+// One instance of the contact loops per contact law.
+#define CONTACT_LAW linear
+#include "contact_loop.inc"
+#undef CONTACT_LAW
+#define CONTACT_LAW linear_damped
+#include "contact_loop.inc"
+#undef CONTACT_LAW
+#define CONTACT_LAW hertz_mindlin
+#include "contact_loop.inc"
+#undef CONTACT_LAW
 
-  // Forces for P2 with respect to P1.
-  double Fn_1_2 = *previous_normal + dfn;
-  double Fs_1_2 = *previous_tangent + dfs;
+/**
+ * Computes the resulting contact forces of each particle, with the given contact law.
+ * The law is selected once here, and each loop has its law inlined.
+ * Note: Gravity is applied by integrate_particles.
+ */
+void compute_forces(const ContactLaw law, const ContactLawParams *params,
+                    const real dt, const size_t particles_size,
+                    const size_t contacts_size, const Particle *particles,
+                    const Material *materials, const MaterialId *material_ids, const Contact *contacts,
+                    const Vector *velocities, accum *normal_forces,
+                    accum *tangent_forces, Vector *forces) {
+  switch (law) {
+    case CONTACT_LAW_LINEAR_DAMPED:
+      compute_forces_linear_damped(params, dt, particles_size, contacts_size, particles, materials, material_ids,
+                                   contacts, velocities, normal_forces, tangent_forces, forces);
+      break;
+    case CONTACT_LAW_HERTZ_MINDLIN:
+      compute_forces_hertz_mindlin(params, dt, particles_size, contacts_size, particles, materials, material_ids,
+                                   contacts, velocities, normal_forces, tangent_forces, forces);
+      break;
+    default:
+      compute_forces_linear(params, dt, particles_size, contacts_size, particles, materials, material_ids,
+                            contacts, velocities, normal_forces, tangent_forces, forces);
+  }
+}
 
-  if (Fn_1_2 < 0) {
-    Fn_1_2 = 0;
-    Fs_1_2 = 0;
+/**
+ * Groups the contacts by receiving particle (p2), keeping their order within each group:
+ * the contacts of particle i are contact_order[contact_offsets[i]] to contact_order[contact_offsets[i + 1] - 1].
+ * A counting sort: count the contacts of each particle, turn the counts into offsets, and place the contacts in order.
+ */
+void group_contacts(const size_t particles_size, const size_t contacts_size, const Contact *contacts,
+                    size_t *contact_offsets, size_t *contact_order) {
+  memset(contact_offsets, 0, (particles_size + 1) * sizeof(size_t));
+  for (size_t i = 0; i < contacts_size; ++i) {
+    contact_offsets[contacts[i].p2_idx + 1] += 1;
+  }
+  for (size_t i = 0; i < particles_size; ++i) {
+    contact_offsets[i + 1] += contact_offsets[i];
   }
+  // Each offset is used as the cursor of its group, and ends at the start of the next one.
+  for (size_t i = 0; i < contacts_size; ++i) {
+    contact_order[contact_offsets[contacts[i].p2_idx]++] = i;
+  }
+  for (size_t i = particles_size; i > 0; --i) {
+    contact_offsets[i] = contact_offsets[i - 1];
+  }
+  contact_offsets[0] = 0;
+}
 
-  const double Fs_1_2_max = Fn_1_2 * TAN_30_PI_180;
-  if (fabs(Fs_1_2) > Fs_1_2_max) {
-    Fs_1_2 = (fabs(Fs_1_2_max) * fabs(Fs_1_2)) / Fs_1_2;
+/**
+ * Same as compute_forces, in parallel over the contacts, with atomic additions to the forces.
+ * The fastest parallel loop, but the order of the sums depends on the scheduling of the threads.
+ */
+void compute_forces_atomic(const ContactLaw law, const ContactLawParams *params,
+                           const real dt, const size_t particles_size,
+                           const size_t contacts_size, const Particle *particles,
+                           const Material *materials, const MaterialId *material_ids, const Contact *contacts,
+                           const Vector *velocities, accum *normal_forces,
+                           accum *tangent_forces, Vector *forces) {
+  switch (law) {
+    case CONTACT_LAW_LINEAR_DAMPED:
+      compute_forces_atomic_linear_damped(params, dt, particles_size, contacts_size, particles, materials, material_ids,
+                                          contacts, velocities, normal_forces, tangent_forces, forces);
+      break;
+    case CONTACT_LAW_HERTZ_MINDLIN:
+      compute_forces_atomic_hertz_mindlin(params, dt, particles_size, contacts_size, particles, materials, material_ids,
+                                          contacts, velocities, normal_forces, tangent_forces, forces);
+      break;
+    default:
+      compute_forces_atomic_linear(params, dt, particles_size, contacts_size, particles, materials, material_ids,
+                                   contacts, velocities, normal_forces, tangent_forces, forces);
   }
+}
 
-  // Update the forces of p2.
-  force_p2->x_component += (-normal.x_component * Fn_1_2) - (normal.y_component * Fs_1_2);
-  force_p2->y_component += (-normal.y_component * Fn_1_2) + (normal.x_component * Fs_1_2);
+/**
+ * Same as compute_forces, in parallel over the particles, with the contacts grouped by group_contacts.
+ * Each particle sums its contacts in the order of the contact list, so the forces are the same as
+ * the ones of compute_forces, bit for bit, for any number of threads.
+ */
+void compute_forces_grouped(const ContactLaw law, const ContactLawParams *params,
+                            const real dt, const size_t particles_size, const Particle *particles,
+                            const Material *materials, const MaterialId *material_ids, const Contact *contacts,
+                            const size_t *contact_offsets, const size_t *contact_order,
+                            const Vector *velocities, accum *normal_forces,
+                            accum *tangent_forces, Vector *forces) {
+  switch (law) {
+    case CONTACT_LAW_LINEAR_DAMPED:
+      compute_forces_grouped_linear_damped(params, dt, particles_size, particles, materials, material_ids, contacts,
+                                           contact_offsets, contact_order, velocities, normal_forces,
+                                           tangent_forces, forces);
+      break;
+    case CONTACT_LAW_HERTZ_MINDLIN:
+      compute_forces_grouped_hertz_mindlin(params, dt, particles_size, particles, materials, material_ids, contacts,
+                                           contact_offsets, contact_order, velocities, normal_forces,
+                                           tangent_forces, forces);
+      break;
+    default:
+      compute_forces_grouped_linear(params, dt, particles_size, particles, materials, material_ids, contacts,
+                                    contact_offsets, contact_order, velocities, normal_forces,
+                                    tangent_forces, forces);
+  }
+}
 
-  // Update the normal and tangent forces between p1 and p2 for the next simulation step.
-  *previous_normal = Fn_1_2;
-  *previous_tangent = Fs_1_2;
+/**
+ * Finds the point of the wall closest to the given point.
+ */
+inline void closest_point_on_wall(const Wall *wall, const real x, const real y,
+                                  real *closest_x, real *closest_y) {
+  const real wall_x = wall->x2 - wall->x1;
+  const real wall_y = wall->y2 - wall->y1;
+  const real length_squared = (wall_x * wall_x) + (wall_y * wall_y);
+  real t = 0;
+  if (length_squared > 0) {
+    t = (((x - wall->x1) * wall_x) + ((y - wall->y1) * wall_y)) / length_squared;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+  }
+  *closest_x = wall->x1 + (t * wall_x);
+  *closest_y = wall->y1 + (t * wall_y);
 }
 
 /**
- * Computes the resulting forces each particle.
+ * Computes the overlap between a particle and a wall.
+ * Note: If the overlap is negative, there is no overlap.
  */
-inline void compute_forces(const double dt, const size_t particles_size,
-                           const size_t contacts_size, const Particle *particles,
-                           const ParticleProperties *properties, const Contact *contacts,
-                           const Vector *velocities, double *normal_forces,
-                           double *tangent_forces, Vector *forces) {
+inline real compute_wall_overlap(const Particle *p, const Wall *wall) {
+  real closest_x;
+  real closest_y;
+  closest_point_on_wall(wall, p->x_coordinate, p->y_coordinate, &closest_x, &closest_y);
+  const real x_diff = p->x_coordinate - closest_x;
+  const real y_diff = p->y_coordinate - closest_y;
 
-  for (size_t i = 0; i < contacts_size; ++i) {
-    const size_t p1_idx = contacts[i].p1_idx;
-    const size_t p2_idx = contacts[i].p2_idx;
-    const size_t p2_p1_idx = (p1_idx * particles_size) + p2_idx;
-    const Particle *p1 = &particles[p1_idx];
-    const Particle *p2 = &particles[p2_idx];
-    const double distance = compute_distance(p1, p2);
-
-    // P1 collides P2.
-    collide_two_particles(
-      dt,
-      distance,
-      p1,
-      p2,
-      &velocities[p1_idx],
-      &velocities[p2_idx],
-      &properties[p2_idx],
-      &normal_forces[p2_p1_idx],
-      &tangent_forces[p2_p1_idx],
-      &forces[p2_idx]
-    );
+  return p->radius - sqrt((x_diff * x_diff) + (y_diff * y_diff));
+}
+
+/**
+ * Computes the forces applied to each particle by the walls it touches, with the given contact law.
+ * Each wall behaves like a fixed particle placed at the contact point,
+ * so the walls share the normal and tangent history model of the particle contacts.
+ */
+void compute_wall_forces(const ContactLaw law, const ContactLawParams *params,
+                         const real dt, const size_t num_walls, const size_t wall_contacts_size,
+                         const Particle *particles, const Material *materials, const MaterialId *material_ids,
+                         const Wall *walls, const WallContact *wall_contacts,
+                         const Vector *velocities, accum *wall_normal_forces,
+                         accum *wall_tangent_forces, Vector *forces) {
+  switch (law) {
+    case CONTACT_LAW_LINEAR_DAMPED:
+      compute_wall_forces_linear_damped(params, dt, num_walls, wall_contacts_size, particles, materials, material_ids,
+                                        walls, wall_contacts, velocities, wall_normal_forces,
+                                        wall_tangent_forces, forces);
+      break;
+    case CONTACT_LAW_HERTZ_MINDLIN:
+      compute_wall_forces_hertz_mindlin(params, dt, num_walls, wall_contacts_size, particles, materials, material_ids,
+                                        walls, wall_contacts, velocities, wall_normal_forces,
+                                        wall_tangent_forces, forces);
+      break;
+    default:
+      compute_wall_forces_linear(params, dt, num_walls, wall_contacts_size, particles, materials, material_ids,
+                                 walls, wall_contacts, velocities, wall_normal_forces,
+                                 wall_tangent_forces, forces);
   }
-  apply_gravity(particles_size, properties, forces);
 }
 
 /**
  * Derives the resultant velocity,
  * of an initial velocity with an applied acceleration for given a time delta.
  */
-inline void compute_velocity(const double dt, const size_t particle_index,
+inline void compute_velocity(const real dt, const size_t particle_index,
                              const Vector *accelerations, Vector *velocities) {
   velocities[particle_index].x_component =
     velocities[particle_index].x_component + accelerations[particle_index].x_component * dt;
@@ -147,15 +270,13 @@ inline void compute_velocity(const double dt, const size_t particle_index,
 }
 
 /**
- * Computes the displacement of the particles,
- * with an applied velocity for a given time delta.
+ * Computes the displacement of the particles during a time delta,
+ * with an applied velocity.
  */
-inline void compute_displacement(const double dt, const size_t particle_index,
+inline void compute_displacement(const real dt, const size_t particle_index,
                                  const Vector *velocities, Vector *displacements) {
-  displacements[particle_index].x_component =
-    displacements[particle_index].x_component + velocities[particle_index].x_component * dt;
-  displacements[particle_index].y_component =
-    displacements[particle_index].y_component + velocities[particle_index].y_component * dt;
+  displacements[particle_index].x_component = velocities[particle_index].x_component * dt;
+  displacements[particle_index].y_component = velocities[particle_index].y_component * dt;
 }
 
 /**
@@ -163,8 +284,9 @@ inline void compute_displacement(const double dt, const size_t particle_index,
  */
 inline void displace_particle(const size_t particle_index, const Vector *displacements,
                               Particle *particles) {
-  particles[particle_index].x_coordinate += (displacements[particle_index].x_component * 1000);
-  particles[particle_index].y_coordinate += (displacements[particle_index].y_component * 1000);
+  particles[particle_index].x_coordinate = wrap_x(particles[particle_index].x_coordinate
+                                                 + (displacements[particle_index].x_component * METERS_TO_COORDINATES));
+  particles[particle_index].y_coordinate += (displacements[particle_index].y_component * METERS_TO_COORDINATES);
 }
 
 /**
@@ -172,9 +294,80 @@ inline void displace_particle(const size_t particle_index, const Vector *displac
   */
 inline void fix_displacement(const size_t particle_index, Vector *velocities, Particle *particles) {
 
-  double diff = particles[particle_index].y_coordinate - particles[particle_index].radius;
+  real diff = particles[particle_index].y_coordinate - particles[particle_index].radius;
   if (diff < 0) {
     particles[particle_index].y_coordinate = particles[particle_index].radius;
     velocities[particle_index].y_component = 0;
   }
 }
+
+/**
+ * Integrates the particles one step in a single pass:
+ * acceleration (with gravity), velocity, displacement and the floor limit.
+ * The removed particles (radius 0) are left where they are, at rest.
+ * Same results as calling compute_acceleration, compute_velocity, compute_displacement,
+ * displace_particle and fix_displacement for each particle, with gravity in the forces.
+ * The floor limit is written as selects, so the loop can be vectorized.
+ */
+static inline void integrate_particles_loop(const real dt, const size_t particles_size,
+                                            const Material *restrict materials,
+                                            const MaterialId *restrict material_ids,
+                                            const Vector *restrict forces,
+                                            Vector *restrict velocities,
+                                            Particle *restrict particles,
+                                            Vector *restrict accelerations,
+                                            Vector *restrict displacements,
+                                            const int store_intermediates) {
+  // Each thread traces its share, so the imbalance between the threads shows before the barrier.
+  #pragma omp parallel
+  {
+    trace_begin("integrate particles");
+    #pragma omp for schedule(static) nowait
+    for (size_t i = 0; i < particles_size; ++i) {
+      const real inverse_mass = materials[material_ids[i]].inverse_mass;
+      const real acceleration_x = forces[i].x_component * inverse_mass;
+      const real acceleration_y = (forces[i].y_component * inverse_mass) - GRAVITY;
+      const real velocity_x = velocities[i].x_component + acceleration_x * dt;
+      const real velocity_y = velocities[i].y_component + acceleration_y * dt;
+      const real displacement_x = velocity_x * dt;
+      const real displacement_y = velocity_y * dt;
+      const real x = particles[i].x_coordinate + (displacement_x * METERS_TO_COORDINATES);
+      const real y = particles[i].y_coordinate + (displacement_y * METERS_TO_COORDINATES);
+
+      // Floor limit. The removed particles (radius 0) stay where they are, at rest, until the compaction,
+      // selected rather than skipped so the loop stays vectorized.
+      const int removed = particles[i].radius <= 0;
+      const int below = (y - particles[i].radius) < 0;
+      particles[i].x_coordinate = removed ? particles[i].x_coordinate : wrap_x(x);
+      particles[i].y_coordinate = removed ? particles[i].y_coordinate : (below ? particles[i].radius : y);
+      velocities[i].x_component = removed ? 0 : velocity_x;
+      velocities[i].y_component = (removed || below) ? 0 : velocity_y;
+
+      if (store_intermediates) {
+        accelerations[i].x_component = acceleration_x;
+        accelerations[i].y_component = acceleration_y;
+        displacements[i].x_component = displacement_x;
+        displacements[i].y_component = displacement_y;
+      }
+    }
+    trace_end("integrate particles");
+  }
+}
+
+/**
+ * Integrates all the particles one step.
+ * The accelerations and displacements are only stored when both arrays are provided.
+ */
+void integrate_particles(const real dt, const size_t particles_size,
+                         const Material *materials, const MaterialId *material_ids, const Vector *forces,
+                         Vector *velocities, Particle *particles,
+                         Vector *accelerations, Vector *displacements) {
+  // Two instances of the loop, so the production one does not carry the stores.
+  if (accelerations && displacements) {
+    integrate_particles_loop(dt, particles_size, materials, material_ids, forces, velocities, particles,
+                             accelerations, displacements, 1);
+  } else {
+    integrate_particles_loop(dt, particles_size, materials, material_ids, forces, velocities, particles,
+                             NULL, NULL, 0);
+  }
+}
@@ -0,0 +1,174 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "png.h"
+
+// Largest payload of a stored (uncompressed) deflate block.
+#define MAX_STORED_BLOCK 65535
+
+/**
+ * Updates a CRC-32 (the one used by the PNG chunks) with the given bytes.
+ * The table is built on the first call.
+ */
+static uint32_t update_crc(uint32_t crc, const unsigned char *bytes, const size_t length) {
+  static uint32_t table[256];
+  static int table_ready = 0;
+  if (!table_ready) {
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      table[n] = c;
+    }
+    table_ready = 1;
+  }
+
+  for (size_t i = 0; i < length; ++i) {
+    crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+/**
+ * Stores a 32 bit value in big endian order.
+ */
+static void put_u32(unsigned char *bytes, const uint32_t value) {
+  bytes[0] = (unsigned char) (value >> 24);
+  bytes[1] = (unsigned char) (value >> 16);
+  bytes[2] = (unsigned char) (value >> 8);
+  bytes[3] = (unsigned char) value;
+}
+
+/**
+ * Chunk being written: keeps the running CRC of its type and data.
+ */
+typedef struct {
+  FILE *file;
+  uint32_t crc;
+} PngChunk;
+
+static void begin_chunk(PngChunk *chunk, FILE *file, const char *type, const uint32_t length) {
+  unsigned char header[8];
+  put_u32(header, length);
+  memcpy(header + 4, type, 4);
+  fwrite(header, 1, 8, file);
+  chunk->file = file;
+  chunk->crc = update_crc(0xFFFFFFFFu, header + 4, 4);
+}
+
+static void chunk_data(PngChunk *chunk, const unsigned char *bytes, const size_t length) {
+  fwrite(bytes, 1, length, chunk->file);
+  chunk->crc = update_crc(chunk->crc, bytes, length);
+}
+
+static void end_chunk(PngChunk *chunk) {
+  unsigned char crc[4];
+  put_u32(crc, chunk->crc ^ 0xFFFFFFFFu);
+  fwrite(crc, 1, 4, chunk->file);
+}
+
+/**
+ * Returns the size of the data of the IDAT chunk of an image of the given size:
+ * the zlib header, the header of each stored block, the rows with their filter byte, and the Adler-32.
+ */
+static size_t idat_size(const int width, const int height) {
+  const size_t raw_size = (((size_t) width * 3) + 1) * height;
+  const size_t num_blocks = raw_size > 0 ? ((raw_size + MAX_STORED_BLOCK - 1) / MAX_STORED_BLOCK) : 1;
+  return 2 + (num_blocks * 5) + raw_size + 4;
+}
+
+/**
+ * Returns the size, in bytes, of the PNG file write_png writes for an image of the given size:
+ * the signature, and the IHDR, IDAT and IEND chunks, each with 12 bytes of length, type and CRC.
+ */
+size_t png_file_size(const int width, const int height) {
+  return 8 + (12 + 13) + (12 + idat_size(width, height)) + 12;
+}
+
+/**
+ * Writes an 8 bit RGB image, stored row by row from the top, as a PNG file.
+ * The image data is a zlib stream of stored deflate blocks: each row is prefixed
+ * by its filter type (0, none), and the stream is split in blocks of at most 65535 bytes.
+ * Returns 0 on success.
+ */
+int write_png(const char *filename, const int width, const int height, const unsigned char *rgb) {
+  FILE *file = fopen(filename, "wb");
+  if (!file) {
+    return -1;
+  }
+
+  static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  fwrite(signature, 1, 8, file);
+
+  PngChunk chunk;
+  unsigned char header[13];
+  put_u32(header, (uint32_t) width);
+  put_u32(header + 4, (uint32_t) height);
+  header[8] = 8; // Bit depth.
+  header[9] = 2; // Truecolor.
+  header[10] = 0; // Deflate.
+  header[11] = 0; // Adaptive filtering.
+  header[12] = 0; // No interlace.
+  begin_chunk(&chunk, file, "IHDR", 13);
+  chunk_data(&chunk, header, 13);
+  end_chunk(&chunk);
+
+  const size_t row_size = ((size_t) width * 3) + 1;
+  const size_t raw_size = row_size * height;
+  const size_t num_blocks = raw_size > 0 ? ((raw_size + MAX_STORED_BLOCK - 1) / MAX_STORED_BLOCK) : 1;
+  const size_t data_size = idat_size(width, height);
+
+  begin_chunk(&chunk, file, "IDAT", (uint32_t) data_size);
+  static const unsigned char zlib_header[2] = { 0x78, 0x01 };
+  chunk_data(&chunk, zlib_header, 2);
+
+  // Walk the rows as one stream of bytes, cutting it into blocks.
+  uint32_t adler_a = 1;
+  uint32_t adler_b = 0;
+  size_t written = 0;
+  for (size_t block = 0; block < num_blocks; ++block) {
+    const size_t block_size = (raw_size - written) < MAX_STORED_BLOCK ? (raw_size - written) : MAX_STORED_BLOCK;
+    const unsigned char block_header[5] = {
+      (unsigned char) (block + 1 == num_blocks), // Final block flag, stored type.
+      (unsigned char) block_size, (unsigned char) (block_size >> 8),
+      (unsigned char) ~block_size, (unsigned char) (~block_size >> 8)
+    };
+    chunk_data(&chunk, block_header, 5);
+
+    const size_t block_end = written + block_size;
+    while (written < block_end) {
+      const size_t row = written / row_size;
+      const size_t column = written % row_size;
+      const unsigned char filter = 0;
+      const unsigned char *bytes;
+      size_t length;
+      if (column == 0) {
+        bytes = &filter;
+        length = 1;
+      } else {
+        bytes = rgb + (row * (row_size - 1)) + (column - 1);
+        length = row_size - column;
+        if (length > block_end - written) {
+          length = block_end - written;
+        }
+      }
+      chunk_data(&chunk, bytes, length);
+      for (size_t i = 0; i < length; ++i) {
+        adler_a = (adler_a + bytes[i]) % 65521;
+        adler_b = (adler_b + adler_a) % 65521;
+      }
+      written += length;
+    }
+  }
+
+  unsigned char adler[4];
+  put_u32(adler, (adler_b << 16) | adler_a);
+  chunk_data(&chunk, adler, 4);
+  end_chunk(&chunk);
+
+  begin_chunk(&chunk, file, "IEND", 0);
+  end_chunk(&chunk);
+
+  return fclose(file) == 0 ? 0 : -1;
+}
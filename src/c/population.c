@@ -0,0 +1,180 @@
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include "data.h"
+#include "functions.h"
+#include "collisions.h"
+#include "population.h"
+
+/**
+ * Removes the particles whose center is outside the region, by giving them radius 0 and no velocity.
+ * Removed particles are skipped by fill_grid, so they do not touch anything, until compact_particles
+ * frees their slots. Returns the number of particles removed by this call.
+ */
+size_t remove_outside_region(const Region *region, const size_t particles_size, Particle *particles,
+                             Vector *velocities) {
+  size_t removed = 0;
+
+  #pragma omp parallel for schedule(static) reduction(+:removed)
+  for (size_t i = 0; i < particles_size; ++i) {
+    if (particles[i].radius <= 0) {
+      continue;
+    }
+    const real x = particles[i].x_coordinate;
+    const real y = particles[i].y_coordinate;
+    if (x < region->x_min || x > region->x_max || y < region->y_min || y > region->y_max) {
+      particles[i].radius = 0;
+      velocities[i].x_component = 0;
+      velocities[i].y_component = 0;
+      removed += 1;
+    }
+  }
+  return removed;
+}
+
+/**
+ * Moves the contact history of the kept particles. Row and column of each kept pair only move
+ * to lower or equal indices, so walking the old entries in increasing order never overwrites
+ * an entry that is still to be read.
+ */
+static void compact_history(const size_t particles_size, const size_t kept, const size_t capacity,
+                            const size_t *remap, accum *history) {
+  for (size_t i = 0; i < particles_size; ++i) {
+    if (remap[i] == REMOVED_PARTICLE) {
+      continue;
+    }
+    accum *old_row = &history[i * capacity];
+    accum *new_row = &history[remap[i] * capacity];
+    for (size_t j = 0; j < particles_size; ++j) {
+      if (remap[j] != REMOVED_PARTICLE) {
+        new_row[remap[j]] = old_row[j];
+      }
+    }
+    memset(&new_row[kept], 0, (particles_size - kept) * sizeof(accum));
+  }
+  for (size_t i = kept; i < particles_size; ++i) {
+    memset(&history[i * capacity], 0, particles_size * sizeof(accum));
+  }
+}
+
+/**
+ * Moves the particles that are not removed to the front of every per-particle array, keeping their order,
+ * and moves their contact history (rows of length capacity) and wall history (rows of num_walls) with them.
+ * The history left behind is zeroed, so the freed slots can be reused.
+ * remap receives the new index of each old index, or REMOVED_PARTICLE. Returns the number of particles kept.
+ */
+size_t compact_particles(const size_t particles_size, const size_t capacity, Particle *particles,
+                         MaterialId *material_ids, Vector *velocities, size_t *ids,
+                         accum *normal_forces, accum *tangent_forces, const size_t num_walls,
+                         accum *wall_normal_forces, accum *wall_tangent_forces, size_t *remap) {
+  size_t kept = 0;
+  for (size_t i = 0; i < particles_size; ++i) {
+    remap[i] = particles[i].radius > 0 ? kept++ : REMOVED_PARTICLE;
+  }
+  if (kept == particles_size) {
+    return kept;
+  }
+
+  for (size_t i = 0; i < particles_size; ++i) {
+    const size_t new_idx = remap[i];
+    if (new_idx == REMOVED_PARTICLE) {
+      continue;
+    }
+    particles[new_idx] = particles[i];
+    particles[new_idx].idx = new_idx;
+    particles[new_idx].next = NULL;
+    material_ids[new_idx] = material_ids[i];
+    velocities[new_idx] = velocities[i];
+    ids[new_idx] = ids[i];
+    if (num_walls > 0) {
+      memmove(&wall_normal_forces[new_idx * num_walls], &wall_normal_forces[i * num_walls], num_walls * sizeof(accum));
+      memmove(&wall_tangent_forces[new_idx * num_walls], &wall_tangent_forces[i * num_walls], num_walls * sizeof(accum));
+    }
+  }
+  if (num_walls > 0) {
+    memset(&wall_normal_forces[kept * num_walls], 0, (particles_size - kept) * num_walls * sizeof(accum));
+    memset(&wall_tangent_forces[kept * num_walls], 0, (particles_size - kept) * num_walls * sizeof(accum));
+  }
+  memset(&velocities[kept], 0, (particles_size - kept) * sizeof(Vector));
+
+  compact_history(particles_size, kept, capacity, remap, normal_forces);
+  compact_history(particles_size, kept, capacity, remap, tangent_forces);
+  return kept;
+}
+
+/**
+ * Returns 1 if no particle of the grid, nor any of the given new particles,
+ * has its center closer than 'clearance' to (x, y).
+ */
+static int is_free_spot(const double x, const double y, const double clearance,
+                        Particle const *const *const grid, const int x_squares, const int y_squares,
+                        const double square_length, const Particle *new_particles, const size_t new_size) {
+  const double clearance_squared = clearance * clearance;
+  for (size_t i = 0; i < new_size; ++i) {
+    const double x_diff = minimum_image_x(new_particles[i].x_coordinate - x);
+    const double y_diff = new_particles[i].y_coordinate - y;
+    if ((x_diff * x_diff) + (y_diff * y_diff) < clearance_squared) {
+      return 0;
+    }
+  }
+
+  // Same search of the neighboring squares as compute_contacts.
+  int left_col = find_col(x - clearance, x_squares, square_length);
+  if (left_col == -2) left_col = 0;
+  int right_col = find_col(x + clearance, x_squares, square_length);
+  if (right_col == -1) right_col = x_squares - 1;
+  if (periodic_x_length > 0) {
+    if (right_col < left_col) right_col += x_squares;
+    if (right_col - left_col >= x_squares) right_col = left_col + x_squares - 1;
+  }
+  int bottom_row = find_row(y - clearance, y_squares, square_length);
+  if (bottom_row == -2) bottom_row = 0;
+  int top_row = find_row(y + clearance, y_squares, square_length);
+  if (top_row == -1) top_row = y_squares - 1;
+  for (int row = bottom_row; row <= top_row; ++row) {
+    for (int col = left_col; col <= right_col; ++col) {
+      for (const Particle *p = grid[(row * x_squares) + (col % x_squares)]; p; p = p->next) {
+        const double x_diff = minimum_image_x(p->x_coordinate - x);
+        const double y_diff = p->y_coordinate - y;
+        if ((x_diff * x_diff) + (y_diff * y_diff) < clearance_squared) {
+          return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+/**
+ * Appends the particles of the source to the arrays, up to the capacity, skipping the spots closer
+ * than two diameters to a particle of the grid (filled this step) or to a particle appended by this call.
+ * The grid is from the start of the step, so the clearance also covers what the particles moved since.
+ * Each new particle gets the next persistent id. Returns the new number of particles.
+ */
+size_t insert_particles(const ParticleSource *source, const real radius, const MaterialId material,
+                        const size_t particles_size, const size_t capacity,
+                        Particle const *const *const grid, const int x_squares, const int y_squares,
+                        const double square_length, Particle *particles, MaterialId *material_ids,
+                        Vector *velocities, size_t *ids, size_t *next_id) {
+  const double spacing = (source->x_max - source->x_min) / source->count;
+  size_t size = particles_size;
+
+  for (int k = 0; k < source->count && size < capacity; ++k) {
+    const double x = source->x_min + ((k + 0.5) * spacing);
+    if (!is_free_spot(x, source->y, 4 * radius, grid, x_squares, y_squares, square_length,
+                      &particles[particles_size], size - particles_size)) {
+      continue;
+    }
+    particles[size].x_coordinate = x;
+    particles[size].y_coordinate = source->y;
+    particles[size].radius = radius;
+    particles[size].next = NULL;
+    particles[size].idx = size;
+    material_ids[size] = material;
+    velocities[size].x_component = 0;
+    velocities[size].y_component = source->velocity;
+    ids[size] = (*next_id)++;
+    size += 1;
+  }
+  return size;
+}
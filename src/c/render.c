@@ -0,0 +1,199 @@
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include "data.h"
+#include "render.h"
+
+// Background of the image, and the darkening applied to the border of each disc.
+#define BACKGROUND 255
+#define BORDER_SHADE 0.6
+
+// Stops of the color map, from the lowest to the highest value.
+#define COLOR_STOPS 5
+static const double color_map[COLOR_STOPS][3] = {
+  { 48, 18, 160 },
+  { 30, 120, 220 },
+  { 40, 190, 120 },
+  { 240, 200, 40 },
+  { 210, 40, 30 }
+};
+
+/**
+ * Returns the value of the chosen quantity for particle i, whose id is its index without ids.
+ */
+static double color_value(const RenderColor color, const size_t i, const Vector *velocities, const Vector *forces,
+                          const size_t *ids) {
+  switch (color) {
+    case RENDER_COLOR_VELOCITY:
+      return hypot(velocities[i].x_component, velocities[i].y_component);
+    case RENDER_COLOR_FORCE:
+      return hypot(forces[i].x_component, forces[i].y_component);
+    case RENDER_COLOR_ID:
+    default:
+      return (double) (ids ? ids[i] : i);
+  }
+}
+
+/**
+ * Returns the tile of the image that holds the center of the particle, or the nearest one
+ * when the center is outside the image.
+ */
+static size_t center_tile(const RenderView *view, const Particle *particle, const int x_tiles, const int y_tiles) {
+  const double column = floor((particle->x_coordinate - view->x_min) * view->scale / RENDER_TILE_SIZE);
+  const double row = floor((view->height - ((particle->y_coordinate - view->y_min) * view->scale)) / RENDER_TILE_SIZE);
+  return ((size_t) fmin(fmax(row, 0), y_tiles - 1) * x_tiles) + (size_t) fmin(fmax(column, 0), x_tiles - 1);
+}
+
+/**
+ * Interpolates the color map at t, between 0 and 1.
+ */
+static void map_color(const double t, unsigned char rgb[3]) {
+  const double position = fmin(fmax(t, 0), 1) * (COLOR_STOPS - 1);
+  const int stop = position >= COLOR_STOPS - 1 ? COLOR_STOPS - 2 : (int) position;
+  const double fraction = position - stop;
+  for (int c = 0; c < 3; ++c) {
+    rgb[c] = (unsigned char) (color_map[stop][c] + (fraction * (color_map[stop + 1][c] - color_map[stop][c])));
+  }
+}
+
+/**
+ * Draws the part of the disc of particle i that falls inside the tile [x_begin, x_end) x [y_begin, y_end).
+ */
+static void draw_disc(const RenderView *view, const Particle *particle, const unsigned char rgb[3],
+                      const int x_begin, const int x_end, const int y_begin, const int y_end,
+                      unsigned char *image) {
+  // Center and radius in pixels; the image rows grow downwards.
+  const double center_x = (particle->x_coordinate - view->x_min) * view->scale;
+  const double center_y = view->height - ((particle->y_coordinate - view->y_min) * view->scale);
+  const double radius = particle->radius * view->scale;
+  const double inner_radius = radius > 2 ? radius - 1 : 0;
+
+  const int left = (int) fmax(floor(center_x - radius), x_begin);
+  const int right = (int) fmin(ceil(center_x + radius), x_end - 1);
+  const int top = (int) fmax(floor(center_y - radius), y_begin);
+  const int bottom = (int) fmin(ceil(center_y + radius), y_end - 1);
+
+  for (int y = top; y <= bottom; ++y) {
+    const double dy = (y + 0.5) - center_y;
+    for (int x = left; x <= right; ++x) {
+      const double dx = (x + 0.5) - center_x;
+      const double distance_squared = (dx * dx) + (dy * dy);
+      if (distance_squared > radius * radius) {
+        continue;
+      }
+      const double shade = distance_squared > inner_radius * inner_radius ? BORDER_SHADE : 1;
+      unsigned char *pixel = &image[(((size_t) y * view->width) + x) * 3];
+      pixel[0] = (unsigned char) (rgb[0] * shade);
+      pixel[1] = (unsigned char) (rgb[1] * shade);
+      pixel[2] = (unsigned char) (rgb[2] * shade);
+    }
+  }
+}
+
+/**
+ * Returns the number of tiles of an image of the given size.
+ */
+size_t render_num_tiles(const int width, const int height) {
+  return (size_t) ((width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE) * ((height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE);
+}
+
+/**
+ * Draws every particle as a disc on the 8 bit RGB image, stored row by row from the top.
+ * The colors are scaled from the lowest to the highest value of the chosen quantity in this frame.
+ * With ids (the persistent particle ids, or NULL when the particles keep their index), the particles are
+ * colored by id, so their colors do not change when the particles are compacted.
+ * The particles are first binned by the tile of their center, with a counting sort into tile_offsets
+ * (render_num_tiles + 1 entries) and tile_order (particles_size entries), so each tile only checks the bins
+ * within reach of the largest particle. The tiles of the image are drawn in parallel; within a tile,
+ * the particles are drawn bin by bin and in index order within each bin, so the image does not depend
+ * on the number of threads.
+ */
+void render_particles(const RenderView *view, const size_t particles_size, const Particle *particles,
+                      const Vector *velocities, const Vector *forces, const size_t *ids, size_t *tile_offsets,
+                      size_t *tile_order, unsigned char *image) {
+  double min_value = INFINITY;
+  double max_value = -INFINITY;
+  double max_radius = 0;
+
+  #pragma omp parallel for schedule(static) reduction(min:min_value) reduction(max:max_value, max_radius)
+  for (size_t i = 0; i < particles_size; ++i) {
+    const double value = color_value(view->color, i, velocities, forces, ids);
+    min_value = fmin(min_value, value);
+    max_value = fmax(max_value, value);
+    max_radius = fmax(max_radius, particles[i].radius);
+  }
+  const double range = max_value > min_value ? max_value - min_value : 1;
+
+  const int x_tiles = (view->width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+  const int y_tiles = (view->height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+  const size_t num_tiles = render_num_tiles(view->width, view->height);
+
+  // Bin the drawn particles by the tile of their center, keeping the index order within each bin.
+  memset(tile_offsets, 0, (num_tiles + 1) * sizeof(size_t));
+  for (size_t i = 0; i < particles_size; ++i) {
+    if (particles[i].radius > 0) {
+      tile_offsets[center_tile(view, &particles[i], x_tiles, y_tiles) + 1] += 1;
+    }
+  }
+  for (size_t tile = 0; tile < num_tiles; ++tile) {
+    tile_offsets[tile + 1] += tile_offsets[tile];
+  }
+  // Each offset is used as the cursor of its bin, and ends at the start of the next one.
+  for (size_t i = 0; i < particles_size; ++i) {
+    if (particles[i].radius > 0) {
+      tile_order[tile_offsets[center_tile(view, &particles[i], x_tiles, y_tiles)]++] = i;
+    }
+  }
+  for (size_t tile = num_tiles; tile > 0; --tile) {
+    tile_offsets[tile] = tile_offsets[tile - 1];
+  }
+  tile_offsets[0] = 0;
+  // Tiles around its own that a disc can reach.
+  const int max_tiles = x_tiles > y_tiles ? x_tiles : y_tiles;
+  const int reach = (int) fmin(ceil(max_radius * view->scale / RENDER_TILE_SIZE), max_tiles);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int tile = 0; tile < x_tiles * y_tiles; ++tile) {
+    const int x_begin = (tile % x_tiles) * RENDER_TILE_SIZE;
+    const int y_begin = (tile / x_tiles) * RENDER_TILE_SIZE;
+    const int x_end = x_begin + RENDER_TILE_SIZE < view->width ? x_begin + RENDER_TILE_SIZE : view->width;
+    const int y_end = y_begin + RENDER_TILE_SIZE < view->height ? y_begin + RENDER_TILE_SIZE : view->height;
+
+    for (int y = y_begin; y < y_end; ++y) {
+      for (int x = x_begin; x < x_end; ++x) {
+        unsigned char *pixel = &image[(((size_t) y * view->width) + x) * 3];
+        pixel[0] = pixel[1] = pixel[2] = BACKGROUND;
+      }
+    }
+
+    // Tile bounds in coordinates, to skip the particles that do not touch it.
+    const double tile_left = view->x_min + (x_begin / view->scale);
+    const double tile_right = view->x_min + (x_end / view->scale);
+    const double tile_top = view->y_min + ((view->height - y_begin) / view->scale);
+    const double tile_bottom = view->y_min + ((view->height - y_end) / view->scale);
+
+    const int column = tile % x_tiles;
+    const int row = tile / x_tiles;
+    for (int bin_row = row - reach; bin_row <= row + reach; ++bin_row) {
+      for (int bin_column = column - reach; bin_column <= column + reach; ++bin_column) {
+        if (bin_row < 0 || bin_row >= y_tiles || bin_column < 0 || bin_column >= x_tiles) {
+          continue;
+        }
+        const size_t bin = ((size_t) bin_row * x_tiles) + bin_column;
+        for (size_t k = tile_offsets[bin]; k < tile_offsets[bin + 1]; ++k) {
+          const size_t i = tile_order[k];
+          const Particle *particle = &particles[i];
+          if (particle->x_coordinate + particle->radius < tile_left
+              || particle->x_coordinate - particle->radius > tile_right
+              || particle->y_coordinate + particle->radius < tile_bottom
+              || particle->y_coordinate - particle->radius > tile_top) {
+            continue;
+          }
+          unsigned char rgb[3];
+          map_color((color_value(view->color, i, velocities, forces, ids) - min_value) / range, rgb);
+          draw_disc(view, particle, rgb, x_begin, x_end, y_begin, y_end, image);
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,246 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "data.h"
+#include "functions.h"
+#include "spatial_query.h"
+
+// Nearest queries without a distances array keep up to this many distances on the stack.
+#define NEAREST_LOCAL_DISTANCES 64
+
+/**
+ * Range of squares of one axis, as offsets from the square of the query point.
+ */
+typedef struct {
+  int center; // Square of the point, clamped to the grid.
+  int lowest; // Offsets of the first and the last square of the grid, or of one period with periodic boundaries.
+  int highest;
+} AxisRange;
+
+/**
+ * Finds the square of the coordinate along an axis of 'squares' squares starting at 'start',
+ * and the offsets that stay inside the grid. With 'periodic', the offsets cover each square once.
+ */
+static AxisRange axis_range(const double coordinate, const double start, const int squares,
+                            const double square_length, const int periodic) {
+  const double square = floor((coordinate - start) / square_length);
+  AxisRange range;
+  range.center = (square < 0) ? 0 : (square >= squares) ? squares - 1 : (int) square;
+  if (periodic) {
+    range.lowest = -((squares - 1) / 2);
+    range.highest = squares / 2;
+  } else {
+    range.lowest = -range.center;
+    range.highest = squares - 1 - range.center;
+  }
+  return range;
+}
+
+/**
+ * Clamps the offsets of the squares from 'from' to 'to' (coordinates along the axis) to the range.
+ * Returns 0 if none of them is inside it.
+ */
+static int clamp_offsets(const AxisRange *range, const double start, const double square_length,
+                         const double from, const double to, int *first, int *last) {
+  const double first_offset = floor((from - start) / square_length) - range->center;
+  const double last_offset = floor((to - start) / square_length) - range->center;
+  if (first_offset > range->highest || last_offset < range->lowest) {
+    return 0;
+  }
+  *first = (first_offset < range->lowest) ? range->lowest : (int) first_offset;
+  *last = (last_offset > range->highest) ? range->highest : (int) last_offset;
+  return 1;
+}
+
+/**
+ * Returns the first particle of the square at the given offsets from the squares of the query point.
+ */
+static Particle *square_at(const GridView *view, const AxisRange *columns, const AxisRange *rows,
+                           const int column_offset, const int row_offset) {
+  const int row = rows->center + row_offset;
+  const int column = (columns->center + column_offset + view->x_squares) % view->x_squares;
+  return (Particle*) view->grid[(row * view->x_squares) + column];
+}
+
+/**
+ * Visits the particles of the squares that cover the box (x - half_width, y_min) to (x + half_width, y_max),
+ * widened by the margin, and keeps the ones whose center is within 'radius' of (x, y) when radius is positive,
+ * or in the box otherwise. Returns how many there are, and writes at most 'capacity' of them.
+ */
+static size_t query_squares(const GridView *view, const real x, const real half_width, const real y_min,
+                            const real y_max, const real y, const real radius, size_t *results, const size_t capacity) {
+  const double x_start = -(view->x_squares * view->square_length / 2);
+  const real center_x = wrap_x(x);
+  const AxisRange columns = axis_range(center_x, x_start, view->x_squares, view->square_length, periodic_x_length > 0);
+  const AxisRange rows = axis_range(y, 0, view->y_squares, view->square_length, 0);
+  int first_column, last_column, first_row, last_row;
+  if (!clamp_offsets(&columns, x_start, view->square_length, center_x - half_width - view->margin,
+                     center_x + half_width + view->margin, &first_column, &last_column)
+      || !clamp_offsets(&rows, 0, view->square_length, y_min - view->margin, y_max + view->margin,
+                        &first_row, &last_row)) {
+    return 0;
+  }
+
+  size_t found = 0;
+  for (int row_offset = first_row; row_offset <= last_row; ++row_offset) {
+    for (int column_offset = first_column; column_offset <= last_column; ++column_offset) {
+      for (const Particle *p = square_at(view, &columns, &rows, column_offset, row_offset); p; p = p->next) {
+        const real x_diff = minimum_image_x(p->x_coordinate - center_x);
+        const int inside = (radius > 0)
+          ? (x_diff * x_diff) + ((p->y_coordinate - y) * (p->y_coordinate - y)) <= radius * radius
+          : fabs(x_diff) <= half_width && p->y_coordinate >= y_min && p->y_coordinate <= y_max;
+        if (inside) {
+          if (found < capacity) {
+            results[found] = p->idx;
+          }
+          found += 1;
+        }
+      }
+    }
+  }
+  return found;
+}
+
+/**
+ * Finds the particles whose center is within 'radius' of (x, y), in the order of the grid.
+ * Writes the index of at most 'capacity' of them in 'results', and returns how many there are.
+ */
+size_t query_radius(const GridView *view, const real x, const real y, const real radius,
+                    size_t *results, const size_t capacity) {
+  if (radius <= 0) {
+    return 0;
+  }
+  return query_squares(view, x, radius, y - radius, y + radius, y, radius, results, capacity);
+}
+
+/**
+ * Finds the particles whose center is in the box from (x_min, y_min) to (x_max, y_max), in the order of the grid.
+ * Writes the index of at most 'capacity' of them in 'results', and returns how many there are.
+ */
+size_t query_box(const GridView *view, const real x_min, const real y_min, const real x_max, const real y_max,
+                 size_t *results, const size_t capacity) {
+  if (x_max < x_min || y_max < y_min) {
+    return 0;
+  }
+  return query_squares(view, (x_min + x_max) / 2, (x_max - x_min) / 2, y_min, y_max, 0, 0, results, capacity);
+}
+
+/**
+ * Inserts the particle in the k closest found so far, sorted by squared distance, if it is closer than the last one.
+ */
+static void keep_nearest(const size_t k, const size_t index, const real distance_squared, size_t *found,
+                         size_t *results, real *distances_squared) {
+  if (*found == k && distance_squared >= distances_squared[k - 1]) {
+    return;
+  }
+  size_t position = (*found < k) ? (*found)++ : k - 1;
+  while (position > 0 && distances_squared[position - 1] > distance_squared) {
+    results[position] = results[position - 1];
+    distances_squared[position] = distances_squared[position - 1];
+    position -= 1;
+  }
+  results[position] = index;
+  distances_squared[position] = distance_squared;
+}
+
+/**
+ * Finds the k particles whose center is the closest to (x, y), searching rings of squares around it
+ * until no unsearched square can hold a closer one. Writes their indices in 'results', the closest first,
+ * and their distances in 'distances' (if not NULL). Returns how many were found, less than k if the grid holds fewer.
+ *
+ * After ring r, the squares searched form a block; a particle outside it is at least as far as the closest open side
+ * of the block (the sides at the edge of the grid are closed), minus the margin.
+ */
+size_t query_nearest(const GridView *view, const real x, const real y, const size_t k,
+                     size_t *results, real *distances) {
+  if (k == 0) {
+    return 0;
+  }
+  const double length = view->square_length;
+  const double x_start = -(view->x_squares * length / 2);
+  const real center_x = wrap_x(x);
+  const AxisRange columns = axis_range(center_x, x_start, view->x_squares, length, periodic_x_length > 0);
+  const AxisRange rows = axis_range(y, 0, view->y_squares, length, 0);
+  // The squared distances are kept in 'distances' when given.
+  real local_distances[NEAREST_LOCAL_DISTANCES];
+  real *distances_squared = distances ? distances
+    : (k <= NEAREST_LOCAL_DISTANCES) ? local_distances : (real*) malloc(k * sizeof(real));
+  if (!distances_squared) {
+    return 0;
+  }
+
+  size_t found = 0;
+  for (int ring = 0; ; ++ring) {
+    const int first_row = (-ring < rows.lowest) ? rows.lowest : -ring;
+    const int last_row = (ring > rows.highest) ? rows.highest : ring;
+    const int first_column = (-ring < columns.lowest) ? columns.lowest : -ring;
+    const int last_column = (ring > columns.highest) ? columns.highest : ring;
+    for (int row_offset = first_row; row_offset <= last_row; ++row_offset) {
+      const int edge_row = row_offset == -ring || row_offset == ring;
+      for (int column_offset = first_column; column_offset <= last_column; ++column_offset) {
+        // Only the squares of the ring, the inner ones were searched before.
+        if (!edge_row && column_offset != -ring && column_offset != ring) {
+          column_offset = ring - 1;
+          continue;
+        }
+        for (const Particle *p = square_at(view, &columns, &rows, column_offset, row_offset); p; p = p->next) {
+          const real x_diff = minimum_image_x(p->x_coordinate - center_x);
+          const real y_diff = p->y_coordinate - y;
+          keep_nearest(k, p->idx, (x_diff * x_diff) + (y_diff * y_diff), &found, results, distances_squared);
+        }
+      }
+    }
+
+    // Distance to the closest open side of the block searched.
+    double bound = INFINITY;
+    if (-ring > columns.lowest) {
+      bound = fmin(bound, center_x - (x_start + ((columns.center - ring) * length)));
+    }
+    if (ring < columns.highest) {
+      bound = fmin(bound, x_start + ((columns.center + ring + 1) * length) - center_x);
+    }
+    if (-ring > rows.lowest) {
+      bound = fmin(bound, y - ((rows.center - ring) * length));
+    }
+    if (ring < rows.highest) {
+      bound = fmin(bound, ((rows.center + ring + 1) * length) - y);
+    }
+    if (isinf(bound)) {
+      break;
+    }
+    bound -= view->margin;
+    if (found == k && bound > 0 && distances_squared[k - 1] <= bound * bound) {
+      break;
+    }
+  }
+
+  if (distances) {
+    for (size_t i = 0; i < found; ++i) {
+      distances[i] = sqrt(distances[i]);
+    }
+  } else if (distances_squared != local_distances) {
+    free(distances_squared);
+  }
+  return found;
+}
+
+/**
+ * Runs the queries in parallel, on the same grid. The results of query i are written from results[i * capacity],
+ * at most 'capacity' of them (the nearest queries find at most that many), and counts[i] is their total number.
+ */
+void run_spatial_queries(const GridView *view, const size_t num_queries, const SpatialQuery *queries,
+                         const size_t capacity, size_t *results, size_t *counts) {
+  #pragma omp parallel for schedule(dynamic, 16)
+  for (size_t i = 0; i < num_queries; ++i) {
+    const SpatialQuery *query = &queries[i];
+    size_t *query_results = results + (i * capacity);
+    if (query->kind == SPATIAL_QUERY_RADIUS) {
+      counts[i] = query_radius(view, query->x, query->y, query->radius, query_results, capacity);
+    } else if (query->kind == SPATIAL_QUERY_BOX) {
+      counts[i] = query_box(view, query->x, query->y, query->x_max, query->y_max, query_results, capacity);
+    } else {
+      const size_t k = (query->k < capacity) ? query->k : capacity;
+      counts[i] = query_nearest(view, query->x, query->y, k, query_results, NULL);
+    }
+  }
+}
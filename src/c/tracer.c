@@ -0,0 +1,238 @@
+#define _POSIX_C_SOURCE 199309L // For clock_gettime.
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "tracer.h"
+
+/**
+ * Buffer of one thread. Only its thread writes it; count is atomic so write_trace reads complete events,
+ * and dropped and name are atomic since trace_dropped and write_trace read them from other threads.
+ * Aligned to a cache line, so the threads do not share the lines of their counters.
+ */
+typedef struct {
+  _Alignas(64) _Atomic size_t count;
+  size_t open; // Recorded begins not yet ended.
+  size_t skipped; // Dropped begins not yet ended, whose ends are dropped too.
+  _Atomic size_t dropped;
+  _Atomic(const char*) name;
+} TraceThread;
+
+static TraceThread threads[TRACE_MAX_THREADS];
+static TraceEvent *trace_events = NULL;
+static size_t num_trace_threads = 0;
+static size_t trace_capacity = 0;
+static uint64_t trace_start = 0;
+static atomic_size_t registered = 0;
+static atomic_size_t unregistered_dropped = 0;
+static atomic_int trace_active = 0;
+static atomic_ulong trace_step = 0;
+static atomic_uint trace_generation = 0;
+
+// Buffer of the calling thread, and the tracer_init it belongs to.
+static _Thread_local size_t thread_index = 0;
+static _Thread_local unsigned thread_generation = 0;
+
+/**
+ * Returns the nanoseconds of the monotonic clock.
+ */
+static uint64_t now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return ((uint64_t) time.tv_sec * 1000000000u) + (uint64_t) time.tv_nsec;
+}
+
+/**
+ * Sets up the tracer, inactive, over num_threads buffers of capacity events, carved from events.
+ * Each thread gets its own buffer the first time it records, so recording takes no locks.
+ */
+void tracer_init(const size_t num_threads, const size_t capacity, TraceEvent *events) {
+  trace_events = events;
+  num_trace_threads = num_threads < TRACE_MAX_THREADS ? num_threads : TRACE_MAX_THREADS;
+  trace_capacity = capacity;
+  for (size_t i = 0; i < TRACE_MAX_THREADS; ++i) {
+    atomic_store(&threads[i].count, 0);
+    threads[i].open = 0;
+    threads[i].skipped = 0;
+    atomic_store(&threads[i].dropped, 0);
+    atomic_store(&threads[i].name, NULL);
+  }
+  atomic_store(&registered, 0);
+  atomic_store(&unregistered_dropped, 0);
+  atomic_store(&trace_active, 0);
+  trace_start = now();
+  // The threads registered by a previous tracer_init register again.
+  atomic_fetch_add(&trace_generation, 1);
+}
+
+/**
+ * Sets the step of the events recorded from now on, and whether they are recorded at all.
+ */
+void tracer_set_step(const unsigned long step, const int active) {
+  atomic_store_explicit(&trace_step, step, memory_order_relaxed);
+  atomic_store_explicit(&trace_active, active, memory_order_relaxed);
+}
+
+/**
+ * Returns the buffer of the calling thread, registering it on its first call, or NULL if there are too many threads.
+ */
+static TraceThread *current_thread(void) {
+  const unsigned generation = atomic_load_explicit(&trace_generation, memory_order_relaxed);
+  if (thread_generation != generation) {
+    thread_generation = generation;
+    thread_index = atomic_fetch_add_explicit(&registered, 1, memory_order_relaxed);
+  }
+  return thread_index < num_trace_threads ? &threads[thread_index] : NULL;
+}
+
+/**
+ * Counts one dropped event of the thread. Only the thread writes its counter, so a relaxed load and store are enough.
+ */
+static void add_dropped(TraceThread *thread) {
+  const size_t dropped = atomic_load_explicit(&thread->dropped, memory_order_relaxed);
+  atomic_store_explicit(&thread->dropped, dropped + 1, memory_order_relaxed);
+}
+
+/**
+ * Appends an event to the buffer of the thread. Only the thread writes its buffer,
+ * and the release store publishes the event to write_trace.
+ */
+static void record(TraceThread *thread, const char *name, const char type) {
+  const size_t count = atomic_load_explicit(&thread->count, memory_order_relaxed);
+  TraceEvent *event = &trace_events[((size_t) (thread - threads) * trace_capacity) + count];
+  event->name = name;
+  event->time = now();
+  event->step = atomic_load_explicit(&trace_step, memory_order_relaxed);
+  event->type = type;
+  atomic_store_explicit(&thread->count, count + 1, memory_order_release);
+}
+
+/**
+ * Records the begin of the phase 'name' on the calling thread, if the tracer is active.
+ * A begin is only recorded if its buffer has room for it, its end and the ends of the phases still open,
+ * so the recorded phases are always closed.
+ */
+void trace_begin(const char *name) {
+  if (!atomic_load_explicit(&trace_active, memory_order_relaxed)) {
+    return;
+  }
+  TraceThread *thread = current_thread();
+  if (!thread) {
+    atomic_fetch_add_explicit(&unregistered_dropped, 1, memory_order_relaxed);
+    return;
+  }
+  const size_t count = atomic_load_explicit(&thread->count, memory_order_relaxed);
+  // Inside a dropped phase, or without room for this phase and the ends of the open ones.
+  if (thread->skipped > 0 || count + thread->open + 2 > trace_capacity) {
+    thread->skipped += 1;
+    add_dropped(thread);
+    return;
+  }
+  thread->open += 1;
+  record(thread, name, 'B');
+}
+
+/**
+ * Records the end of the phase 'name' on the calling thread, if its begin was recorded.
+ */
+void trace_end(const char *name) {
+  const unsigned generation = atomic_load_explicit(&trace_generation, memory_order_relaxed);
+  if (thread_generation != generation) {
+    // Nothing recorded by this thread since tracer_init, so no phase to close.
+    return;
+  }
+  TraceThread *thread = current_thread();
+  if (!thread) {
+    if (atomic_load_explicit(&trace_active, memory_order_relaxed)) {
+      atomic_fetch_add_explicit(&unregistered_dropped, 1, memory_order_relaxed);
+    }
+    return;
+  }
+  if (thread->skipped > 0) {
+    thread->skipped -= 1;
+    add_dropped(thread);
+    return;
+  }
+  // The phases still open when the tracer turns inactive are closed, so they are never left unmatched.
+  if (thread->open > 0) {
+    thread->open -= 1;
+    record(thread, name, 'E');
+  }
+}
+
+/**
+ * Names the calling thread in the trace, instead of "thread <n>".
+ */
+void trace_thread_name(const char *name) {
+  TraceThread *thread = current_thread();
+  if (thread) {
+    // Released, so write_trace sees the whole string once it sees the pointer.
+    atomic_store_explicit(&thread->name, name, memory_order_release);
+  }
+}
+
+/**
+ * Events recorded so far, over all the threads.
+ */
+size_t trace_recorded(void) {
+  size_t recorded = 0;
+  for (size_t i = 0; i < num_trace_threads; ++i) {
+    recorded += atomic_load_explicit(&threads[i].count, memory_order_acquire);
+  }
+  return recorded;
+}
+
+/**
+ * Events dropped so far, because a buffer was full or there were too many threads.
+ */
+size_t trace_dropped(void) {
+  size_t dropped = atomic_load_explicit(&unregistered_dropped, memory_order_relaxed);
+  for (size_t i = 0; i < num_trace_threads; ++i) {
+    dropped += atomic_load_explicit(&threads[i].dropped, memory_order_relaxed);
+  }
+  return dropped;
+}
+
+/**
+ * Writes the recorded events in the Chrome trace event format (JSON), readable by chrome://tracing and Perfetto,
+ * with one track per thread and the time in microseconds since tracer_init. Returns 0 on success.
+ * The threads can keep recording: only the events complete when their thread is reached are written.
+ */
+int write_trace(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return -1;
+  }
+  fprintf(file, "{\"displayTimeUnit\": \"ns\", \"otherData\": {\"dropped_events\": %zu}, \"traceEvents\": [\n",
+          trace_dropped());
+  fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"2DPartInt\"}}");
+  const size_t num_threads = atomic_load(&registered) < num_trace_threads ? atomic_load(&registered) : num_trace_threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    const TraceThread *thread = &threads[i];
+    // The acquire loads make the recorded events, and the name string, visible.
+    const size_t count = atomic_load_explicit(&thread->count, memory_order_acquire);
+    const char *name = atomic_load_explicit(&thread->name, memory_order_acquire);
+    if (name) {
+      fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": \"%s\"}}",
+              i, name);
+    } else {
+      fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": \"thread %zu\"}}",
+              i, i);
+    }
+    const TraceEvent *events = &trace_events[i * trace_capacity];
+    for (size_t e = 0; e < count; ++e) {
+      // Timestamps in microseconds, with the nanoseconds as decimals.
+      const uint64_t time = events[e].time - trace_start;
+      fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": 1, \"tid\": %zu, \"ts\": %llu.%03llu",
+              events[e].name, events[e].type, i, (unsigned long long) (time / 1000),
+              (unsigned long long) (time % 1000));
+      if (events[e].type == 'B') {
+        fprintf(file, ", \"args\": {\"step\": %lu}", events[e].step);
+      }
+      fprintf(file, "}");
+    }
+  }
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0 ? 0 : -1;
+}
@@ -1,14 +1,170 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <vector>
 #include "config.h"
+#include "csv.h"
+
+/**
+ * Parses a comma separated list of numbers.
+ */
+static std::vector<double> parse_numbers(const std::string &value) {
+  std::vector<double> numbers;
+  std::istringstream is_value(value);
+  std::string number;
+  while (std::getline(is_value, number, ',')) {
+    numbers.push_back(std::stod(number));
+  }
+  return numbers;
+}
+
+/**
+ * Parses a number of bytes, with an optional K, M or G suffix (powers of 1024).
+ */
+static size_t parse_bytes(const std::string &value) {
+  size_t suffix_position;
+  const double number = std::stod(value, &suffix_position);
+  const std::string suffix = value.substr(suffix_position);
+  double scale = 1;
+  if (suffix == "K" || suffix == "k") {
+    scale = 1024.0;
+  } else if (suffix == "M" || suffix == "m") {
+    scale = 1024.0 * 1024;
+  } else if (suffix == "G" || suffix == "g") {
+    scale = 1024.0 * 1024 * 1024;
+  } else if (!suffix.empty()) {
+    std::cerr << "Invalid size suffix: " << value << std::endl;
+  }
+  return (size_t) (number * scale);
+}
+
+/**
+ * Appends the segments between each pair of consecutive points (x, y) to the config walls.
+ */
+static void add_walls(const std::vector<double> &points, Config *config) {
+  const int num_segments = (points.size() / 2) - 1;
+  config->walls = (Wall*) realloc(config->walls, (config->num_walls + num_segments) * sizeof(Wall));
+  for (int i = 0; i < num_segments; ++i) {
+    Wall *wall = &config->walls[config->num_walls + i];
+    wall->x1 = points[2 * i];
+    wall->y1 = points[(2 * i) + 1];
+    wall->x2 = points[(2 * i) + 2];
+    wall->y2 = points[(2 * i) + 3];
+  }
+  config->num_walls += num_segments;
+}
+
+/**
+ * Derives the grid settings left to auto from the radius and the bounding box of the scene.
+ * The squares are twice the diameter, so the neighbors of a particle are in at most 2 x 2 squares.
+ * The grid covers the bed, the falling particle, the walls, the sources and the keep region,
+ * with one square of margin, and stays centered at 0 in X.
+ * The grid is reported on stderr: the config is parsed before a frame stream to stdout is opened,
+ * and the stream has to start with its first frame.
+ */
+static void auto_size_grid(Config *config) {
+  const double diameter = 2 * config->radius;
+  if (config->square_in_grid_length <= 0) {
+    config->square_in_grid_length = 2 * diameter;
+  }
+  const double square_length = config->square_in_grid_length;
+
+  // The bed, and the falling particle above it.
+  double half_width = config->x_particles * config->radius;
+  double top = (config->y_particles * diameter) + (5 * config->radius);
+  for (int i = 0; i < config->num_walls; ++i) {
+    const Wall &wall = config->walls[i];
+    half_width = std::max({ half_width, (double) std::fabs(wall.x1), (double) std::fabs(wall.x2) });
+    top = std::max({ top, (double) wall.y1, (double) wall.y2 });
+  }
+  for (int i = 0; i < config->num_sources; ++i) {
+    const ParticleSource &source = config->sources[i];
+    half_width = std::max({ half_width, std::fabs(source.x_min) + config->radius, std::fabs(source.x_max) + config->radius });
+    top = std::max(top, source.y + config->radius);
+  }
+  if (config->has_keep_region) {
+    half_width = std::max({ half_width, std::fabs(config->keep_region.x_min), std::fabs(config->keep_region.x_max) });
+    top = std::max(top, config->keep_region.y_max);
+  }
+
+  if (config->x_squares <= 0) {
+    config->x_squares = (int) std::ceil((2 * (half_width + square_length)) / square_length);
+  }
+  if (config->y_squares <= 0) {
+    config->y_squares = (int) std::ceil((top + square_length) / square_length);
+  }
+  std::cerr << "Grid: " << config->x_squares << " x " << config->y_squares
+            << " squares of " << square_length << std::endl;
+}
 
 /**
  * Parses the provided config file,
  * and stores the results in the provided structure.
  */
 void parse_config(const char *filename, Config *config) {
+  // Default values of the optional settings.
+  config->x_squares = 0;
+  config->y_squares = 0;
+  config->square_in_grid_length = 0;
+  config->walls = NULL;
+  config->num_walls = 0;
+  config->contact_law = CONTACT_LAW_LINEAR;
+  config->friction_angle = 30;
+  config->damping_ratio = 0;
+  config->young_modulus = 0;
+  config->poisson_ratio = 0.3;
+  config->huge_pages = ARENA_PAGES_DEFAULT;
+  config->output_every = 1;
+  config->csv_precision = 6;
+  config->stats_every = 0;
+  config->render_every = 0;
+  config->render_width = 800;
+  config->render_height = 0;
+  config->render_color = RENDER_COLOR_VELOCITY;
+  config->capacity = 0;
+  config->sources = NULL;
+  config->num_sources = 0;
+  config->has_keep_region = 0;
+  config->compact_every = 100;
+  config->tracked = NULL;
+  config->num_tracked = 0;
+  config->recorder_steps = 1000;
+  config->recorder_max_speed = 0;
+  config->periodic_x = 0;
+  config->broad_phase = BROAD_PHASE_GRID;
+  config->material_layers = NULL;
+  config->num_material_layers = 0;
+  config->status_socket = NULL;
+  config->status_port = 0;
+  config->settle_cache = NULL;
+  config->settle_speed = 0.01;
+  config->settle_window = 0.01;
+  config->settle_max_time = 1;
+  config->settle_damping = DAMPING_NONE;
+  config->settle_damping_strength = 0.7;
+  config->settle_damping_time = 0;
+  config->stream = NULL;
+  config->stream_policy = STREAM_POLICY_BLOCK;
+  config->stream_buffers = 4;
+  config->force_accumulation = FORCE_ACCUMULATION_SERIAL;
+  config->fields_every = 0;
+  config->fields_cell_squares = 8;
+  config->converge_every = 0;
+  config->converge_kinetic_ratio = 0;
+  config->converge_max_speed = 0;
+  config->converge_force_ratio = 0;
+  config->max_memory = 0;
+  config->max_disk = 0;
+  config->plan_steps = 100;
+  config->trace_first_step = 1;
+  config->trace_last_step = 0;
+  config->trace_events = 65536;
+
   std::ifstream config_file;
   config_file.open(filename, std::ios_base::in);
 
@@ -34,11 +190,11 @@ void parse_config(const char *filename, Config *config) {
         } else if (key == "x_particles") {
           config->x_particles = std::stoi(value);
         } else if (key == "y_squares") {
-          config->y_squares = std::stoi(value);
+          config->y_squares = (value == "auto") ? 0 : std::stoi(value);
         } else if (key == "x_squares") {
-          config->x_squares = std::stoi(value);
+          config->x_squares = (value == "auto") ? 0 : std::stoi(value);
         } else if (key == "square_in_grid_length") {
-          config->square_in_grid_length = std::stod(value);
+          config->square_in_grid_length = (value == "auto") ? 0 : std::stod(value);
         } else if (key == "radius") {
           config->radius = std::stof(value);
         } else if (key == "kn") {
@@ -53,6 +209,203 @@ void parse_config(const char *filename, Config *config) {
           config->v0 = std::stod(value);
         } else if (key == "r0") {
           config->r0 = std::stod(value);
+        } else if (key == "wall" || key == "polyline") {
+          const std::vector<double> points = parse_numbers(value);
+          if (points.size() < 4 || (points.size() % 2) != 0
+              || (key == "wall" && points.size() != 4)) {
+            std::cerr << "Invalid points for " << key << ": " << value << std::endl;
+          } else {
+            add_walls(points, config);
+          }
+        } else if (key == "contact_law") {
+          if (value == "linear") {
+            config->contact_law = CONTACT_LAW_LINEAR;
+          } else if (value == "linear_damped") {
+            config->contact_law = CONTACT_LAW_LINEAR_DAMPED;
+          } else if (value == "hertz_mindlin") {
+            config->contact_law = CONTACT_LAW_HERTZ_MINDLIN;
+          } else {
+            std::cerr << "Invalid contact law: " << value << std::endl;
+          }
+        } else if (key == "friction_angle") {
+          config->friction_angle = std::stod(value);
+        } else if (key == "damping_ratio") {
+          config->damping_ratio = std::stod(value);
+        } else if (key == "young_modulus") {
+          config->young_modulus = std::stod(value);
+        } else if (key == "poisson_ratio") {
+          config->poisson_ratio = std::stod(value);
+        } else if (key == "huge_pages") {
+          if (value == "none") {
+            config->huge_pages = ARENA_PAGES_DEFAULT;
+          } else if (value == "transparent") {
+            config->huge_pages = ARENA_PAGES_TRANSPARENT;
+          } else if (value == "hugetlb") {
+            config->huge_pages = ARENA_PAGES_HUGETLB;
+          } else {
+            std::cerr << "Invalid huge pages mode: " << value << std::endl;
+          }
+        } else if (key == "output_every") {
+          config->output_every = std::stoi(value);
+        } else if (key == "csv_precision") {
+          config->csv_precision = std::stoi(value);
+        } else if (key == "stats_every") {
+          config->stats_every = std::stoi(value);
+        } else if (key == "render_every") {
+          config->render_every = std::stoi(value);
+        } else if (key == "render_width") {
+          config->render_width = std::stoi(value);
+        } else if (key == "render_height") {
+          config->render_height = std::stoi(value);
+        } else if (key == "render_color") {
+          if (value == "velocity") {
+            config->render_color = RENDER_COLOR_VELOCITY;
+          } else if (value == "force") {
+            config->render_color = RENDER_COLOR_FORCE;
+          } else if (value == "id") {
+            config->render_color = RENDER_COLOR_ID;
+          } else {
+            std::cerr << "Invalid render color: " << value << std::endl;
+          }
+        } else if (key == "capacity") {
+          config->capacity = std::stoi(value);
+        } else if (key == "source") {
+          const std::vector<double> numbers = parse_numbers(value);
+          if ((numbers.size() != 5 && numbers.size() != 6) || numbers[3] < 1 || numbers[4] < 1) {
+            std::cerr << "Invalid source: " << value << std::endl;
+          } else {
+            config->sources = (ParticleSource*) realloc(config->sources, (config->num_sources + 1) * sizeof(ParticleSource));
+            ParticleSource *source = &config->sources[config->num_sources++];
+            source->x_min = numbers[0];
+            source->x_max = numbers[1];
+            source->y = numbers[2];
+            source->every = (int) numbers[3];
+            source->count = (int) numbers[4];
+            source->velocity = numbers.size() == 6 ? numbers[5] : 0;
+          }
+        } else if (key == "keep_region") {
+          const std::vector<double> numbers = parse_numbers(value);
+          if (numbers.size() != 4) {
+            std::cerr << "Invalid keep region: " << value << std::endl;
+          } else {
+            config->keep_region.x_min = numbers[0];
+            config->keep_region.y_min = numbers[1];
+            config->keep_region.x_max = numbers[2];
+            config->keep_region.y_max = numbers[3];
+            config->has_keep_region = 1;
+          }
+        } else if (key == "compact_every") {
+          config->compact_every = std::stoi(value);
+        } else if (key == "track") {
+          const std::vector<double> indices = parse_numbers(value);
+          config->tracked = (size_t*) realloc(config->tracked, (config->num_tracked + indices.size()) * sizeof(size_t));
+          for (const double index : indices) {
+            config->tracked[config->num_tracked++] = (size_t) index;
+          }
+        } else if (key == "recorder_steps") {
+          config->recorder_steps = std::stoi(value);
+        } else if (key == "recorder_max_speed") {
+          config->recorder_max_speed = std::stod(value);
+        } else if (key == "periodic_x") {
+          config->periodic_x = std::stoi(value);
+        } else if (key == "material") {
+          const std::vector<double> numbers = parse_numbers(value);
+          if (numbers.size() != 5) {
+            std::cerr << "Invalid material: " << value << std::endl;
+          } else if (config->num_material_layers + 1 >= MAX_MATERIALS) {
+            std::cerr << "Too many materials, at most " << MAX_MATERIALS << std::endl;
+          } else {
+            config->material_layers = (MaterialLayer*) realloc(config->material_layers,
+                                                               (config->num_material_layers + 1) * sizeof(MaterialLayer));
+            config->material_layers[config->num_material_layers++] = {
+              numbers[0], numbers[1], numbers[2], (int) numbers[3], (int) numbers[4]
+            };
+          }
+        } else if (key == "status_socket") {
+          free(config->status_socket);
+          config->status_socket = strdup(value.c_str());
+        } else if (key == "status_port") {
+          config->status_port = std::stoi(value);
+        } else if (key == "settle_cache") {
+          free(config->settle_cache);
+          config->settle_cache = strdup(value.c_str());
+        } else if (key == "settle_speed") {
+          config->settle_speed = std::stod(value);
+        } else if (key == "settle_window") {
+          config->settle_window = std::stod(value);
+        } else if (key == "settle_max_time") {
+          config->settle_max_time = std::stod(value);
+        } else if (key == "settle_damping") {
+          if (value == "none") {
+            config->settle_damping = DAMPING_NONE;
+          } else if (value == "local") {
+            config->settle_damping = DAMPING_LOCAL;
+          } else if (value == "viscous") {
+            config->settle_damping = DAMPING_VISCOUS;
+          } else {
+            std::cerr << "Invalid settle damping: " << value << std::endl;
+          }
+        } else if (key == "settle_damping_strength") {
+          config->settle_damping_strength = std::stod(value);
+        } else if (key == "settle_damping_time") {
+          config->settle_damping_time = std::stod(value);
+        } else if (key == "stream") {
+          free(config->stream);
+          config->stream = strdup(value.c_str());
+        } else if (key == "stream_policy") {
+          if (value == "block") {
+            config->stream_policy = STREAM_POLICY_BLOCK;
+          } else if (value == "drop") {
+            config->stream_policy = STREAM_POLICY_DROP;
+          } else {
+            std::cerr << "Invalid stream policy: " << value << std::endl;
+          }
+        } else if (key == "stream_buffers") {
+          config->stream_buffers = std::stoi(value);
+        } else if (key == "force_accumulation") {
+          if (value == "serial") {
+            config->force_accumulation = FORCE_ACCUMULATION_SERIAL;
+          } else if (value == "atomic") {
+            config->force_accumulation = FORCE_ACCUMULATION_ATOMIC;
+          } else if (value == "deterministic") {
+            config->force_accumulation = FORCE_ACCUMULATION_DETERMINISTIC;
+          } else {
+            std::cerr << "Invalid force accumulation: " << value << std::endl;
+          }
+        } else if (key == "fields_every") {
+          config->fields_every = std::stoi(value);
+        } else if (key == "fields_cell_squares") {
+          config->fields_cell_squares = std::stoi(value);
+        } else if (key == "converge_every") {
+          config->converge_every = std::stoi(value);
+        } else if (key == "converge_kinetic_ratio") {
+          config->converge_kinetic_ratio = std::stod(value);
+        } else if (key == "converge_max_speed") {
+          config->converge_max_speed = std::stod(value);
+        } else if (key == "converge_force_ratio") {
+          config->converge_force_ratio = std::stod(value);
+        } else if (key == "max_memory") {
+          config->max_memory = parse_bytes(value);
+        } else if (key == "max_disk") {
+          config->max_disk = parse_bytes(value);
+        } else if (key == "plan_steps") {
+          config->plan_steps = std::stoi(value);
+        } else if (key == "trace_first_step") {
+          config->trace_first_step = std::stoi(value);
+        } else if (key == "trace_last_step") {
+          config->trace_last_step = std::stoi(value);
+        } else if (key == "trace_events") {
+          config->trace_events = std::stoi(value);
+        } else if (key == "broad_phase") {
+          if (value == "grid") {
+            config->broad_phase = BROAD_PHASE_GRID;
+          } else if (value == "sweep") {
+            config->broad_phase = BROAD_PHASE_SWEEP;
+          } else if (value == "auto") {
+            config->broad_phase = BROAD_PHASE_AUTO;
+          } else {
+            std::cerr << "Invalid broad phase: " << value << std::endl;
+          }
         } else {
           std::cerr << "Invalid key: " << key << std::endl;
         }
@@ -64,4 +417,150 @@ void parse_config(const char *filename, Config *config) {
     }
   }
   config_file.close();
+
+  if (config->compact_every < 1) {
+    std::cerr << "compact_every must be at least 1" << std::endl;
+    config->compact_every = 1;
+  }
+
+  if (config->recorder_steps < 1) {
+    std::cerr << "recorder_steps must be at least 1" << std::endl;
+    config->recorder_steps = 1;
+  }
+
+  if (config->output_every < 1) {
+    std::cerr << "output_every must be at least 1" << std::endl;
+    config->output_every = 1;
+  }
+
+  if (config->plan_steps < 1) {
+    std::cerr << "plan_steps must be at least 1" << std::endl;
+    config->plan_steps = 1;
+  }
+
+  if (config->trace_last_step > 0
+      && (config->trace_first_step < 1 || config->trace_first_step > config->trace_last_step)) {
+    std::cerr << "trace_first_step must be from 1 to trace_last_step" << std::endl;
+    config->trace_last_step = 0;
+  }
+
+  if (config->trace_events < 2) {
+    std::cerr << "trace_events must be at least 2" << std::endl;
+    config->trace_events = 2;
+  }
+
+  if (config->csv_precision < 0 || config->csv_precision > CSV_MAX_PRECISION) {
+    std::cerr << "csv_precision must be from 0 to " << CSV_MAX_PRECISION << std::endl;
+    config->csv_precision = std::min(std::max(config->csv_precision, 0), CSV_MAX_PRECISION);
+  }
+
+  if (config->stream_buffers < 1) {
+    std::cerr << "stream_buffers must be at least 1" << std::endl;
+    config->stream_buffers = 1;
+  }
+
+  if (config->settle_damping == DAMPING_LOCAL
+      && (config->settle_damping_strength < 0 || config->settle_damping_strength >= 1)) {
+    std::cerr << "settle_damping_strength must be from 0 to 1 for local damping" << std::endl;
+    config->settle_damping_strength = 0.7;
+  }
+
+  if (config->converge_every > 0 && config->converge_kinetic_ratio <= 0 && config->converge_max_speed <= 0
+      && config->converge_force_ratio <= 0) {
+    std::cerr << "converge_every needs converge_kinetic_ratio, converge_max_speed or converge_force_ratio" << std::endl;
+    config->converge_every = 0;
+  }
+
+  if (config->x_squares <= 0 || config->y_squares <= 0 || config->square_in_grid_length <= 0) {
+    auto_size_grid(config);
+  }
+
+  if (config->fields_cell_squares < 1) {
+    std::cerr << "fields_cell_squares must be at least 1" << std::endl;
+    config->fields_cell_squares = 1;
+  }
+
+  // The field cells wrap around with the grid, so they have to tile it exactly.
+  if (config->periodic_x && (config->x_squares % config->fields_cell_squares) != 0) {
+    int divisor = config->fields_cell_squares;
+    while (config->x_squares % divisor != 0) {
+      divisor--;
+    }
+    std::cerr << "With periodic_x, fields_cell_squares must divide x_squares, using " << divisor << std::endl;
+    config->fields_cell_squares = divisor;
+  }
+
+  if (config->periodic_x && config->broad_phase != BROAD_PHASE_GRID) {
+    std::cerr << "The sort and sweep broad phase does not wrap around, using the grid" << std::endl;
+    config->broad_phase = BROAD_PHASE_GRID;
+  }
+
+  // Keep the aspect ratio of the grid, which is the region rendered.
+  if (config->render_height <= 0) {
+    config->render_height = std::max(1, (int) std::lround(config->render_width * config->y_squares
+                                                          / (double) config->x_squares));
+  }
+
+  if (config->contact_law == CONTACT_LAW_HERTZ_MINDLIN && config->young_modulus <= 0) {
+    std::cerr << "The hertz_mindlin contact law needs a positive young_modulus" << std::endl;
+  }
+}
+
+/**
+ * Returns the FNV-1a hash of the settings that determine the settled bed: the lattice, the grid,
+ * the materials, the contact law, the walls, the settling criteria and damping, the broad phase it settles with,
+ * the force accumulation and the precision of the build, but not v0, the simulation time or the output settings.
+ * Each field is hashed on its own, so the padding of the structures is left out.
+ */
+uint64_t settled_bed_key(const Config *config) {
+  const double numbers[] = {
+    config->dt, config->radius, config->kn, config->ks, config->rho, config->thickness,
+    config->square_in_grid_length, config->friction_angle, config->damping_ratio, config->young_modulus,
+    config->poisson_ratio, config->settle_speed, config->settle_window, config->settle_max_time
+  };
+  const int64_t integers[] = {
+    config->x_particles, config->y_particles, config->x_squares, config->y_squares, config->contact_law,
+    config->periodic_x, config->num_walls, config->num_material_layers, (int64_t) sizeof(real)
+  };
+  uint64_t key = fnv1a(FNV1A_OFFSET_BASIS, numbers, sizeof(numbers));
+  key = fnv1a(key, integers, sizeof(integers));
+  // Without damping the key is the same as before the damping settings existed, so those caches stay valid.
+  if (config->settle_damping != DAMPING_NONE) {
+    const double damping[] = {
+      (double) config->settle_damping, config->settle_damping_strength, config->settle_damping_time
+    };
+    key = fnv1a(key, damping, sizeof(damping));
+  }
+  // The broad phase and the force accumulation set the order of the force sums, so the last bits of the bed.
+  // The automatic broad phase settles with the grid. With the defaults the key is the same as before, as with damping.
+  const BroadPhase settle_broad_phase = (config->broad_phase == BROAD_PHASE_SWEEP) ? BROAD_PHASE_SWEEP : BROAD_PHASE_GRID;
+  if (settle_broad_phase != BROAD_PHASE_GRID || config->force_accumulation != FORCE_ACCUMULATION_SERIAL) {
+    const int64_t order[] = { settle_broad_phase, config->force_accumulation };
+    key = fnv1a(key, order, sizeof(order));
+  }
+  for (int i = 0; i < config->num_walls; ++i) {
+    const real points[] = { config->walls[i].x1, config->walls[i].y1, config->walls[i].x2, config->walls[i].y2 };
+    key = fnv1a(key, points, sizeof(points));
+  }
+  for (int i = 0; i < config->num_material_layers; ++i) {
+    const MaterialLayer &layer = config->material_layers[i];
+    const double properties[] = { layer.rho, layer.kn, layer.ks };
+    const int64_t rows[] = { layer.first_row, layer.last_row };
+    key = fnv1a(key, properties, sizeof(properties));
+    key = fnv1a(key, rows, sizeof(rows));
+  }
+  return key;
+}
+
+/**
+ * Frees the memory allocated by parse_config.
+ */
+void free_config(Config *config) {
+  free(config->walls);
+  free(config->tracked);
+  free(config->sources);
+  free(config->material_layers);
+  free(config->status_socket);
+  free(config->settle_cache);
+  free(config->stream);
 }
@@ -1,11 +1,149 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <iostream>
 #include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 extern "C" {
   #include "data.h"
+  #include "analysis.h"
+  #include "flight_recorder.h"
+  #include "fields.h"
+  #include "tracer.h"
 }
 #include "csv.h"
 
+// Buffer where the frames are formatted, and the significant digits of the numbers.
+static char *csv_buffer = NULL;
+static size_t csv_buffer_capacity = 0;
+static int csv_precision = 6;
+
+/**
+ * Sets the buffer where the frames are formatted, which needs CSV_ROW_CAPACITY bytes
+ * per particle plus one row for the header, and the significant digits of the numbers.
+ * With precision 0, each number is written with the shortest representation that reads back the same value.
+ * Frames too large for the buffer are formatted in a temporary one.
+ */
+void init_csv_writer(char *buffer, const size_t capacity, const int precision) {
+  csv_buffer = buffer;
+  csv_buffer_capacity = capacity;
+  csv_precision = precision;
+}
+
+/**
+ * Returns a buffer large enough to format a frame of num_particles rows.
+ */
+static char *frame_buffer(const size_t num_particles) {
+  static std::vector<char> fallback;
+  const size_t needed = (num_particles + 1) * CSV_ROW_CAPACITY;
+  if (needed <= csv_buffer_capacity) {
+    return csv_buffer;
+  }
+  if (fallback.size() < needed) {
+    fallback.resize(needed);
+  }
+  return fallback.data();
+}
+
+// Bytes format_number may write, including the terminating null.
+#define CSV_NUMBER_CAPACITY 32
+
+/**
+ * Formats the number with printf's %g and the given significant digits.
+ * Returns the number of characters actually written, even if snprintf had to truncate them.
+ */
+static size_t format_digits(char *output, const int digits, const real value) {
+  const int length = snprintf(output, CSV_NUMBER_CAPACITY, "%.*g", digits, (double) value);
+  return length < 0 ? 0 : std::min((size_t) length, (size_t) CSV_NUMBER_CAPACITY - 1);
+}
+
+/**
+ * Formats a number like std::ofstream does with the given precision (printf's %g).
+ * With precision 0, it uses the fewest significant digits that read back the same value.
+ * Returns the number of characters written, at most 24 (the precision is at most CSV_MAX_PRECISION).
+ */
+static size_t format_number(char *output, const real value) {
+  if (csv_precision > 0) {
+    return format_digits(output, csv_precision, value);
+  }
+
+  // Below these digits every value has an exact representation, and above them none needs more.
+  const int min_digits = sizeof(real) == sizeof(float) ? 6 : 15;
+  const int max_digits = sizeof(real) == sizeof(float) ? 9 : 17;
+  size_t length = 0;
+  for (int digits = min_digits; digits <= max_digits; ++digits) {
+    length = format_digits(output, digits, value);
+    if ((real) strtod(output, NULL) == value) {
+      break;
+    }
+  }
+  return length;
+}
+
+/**
+ * Formats the row of one particle: "x, y, 0, radius\n", or "x, y, 0, radius, id\n" if id is not NULL.
+ * Returns the number of characters written.
+ */
+static size_t format_particle_row(char *output, const Particle *particle, const size_t *id) {
+  char *position = output;
+  position += format_number(position, particle->x_coordinate);
+  memcpy(position, ", ", 2);
+  position += 2;
+  position += format_number(position, particle->y_coordinate);
+  memcpy(position, ", 0, ", 5); // Z Coordinate.
+  position += 5;
+  position += format_number(position, particle->radius);
+  if (id) {
+    position += snprintf(position, 24, ", %zu", *id);
+  }
+  *position++ = '\n';
+  return position - output;
+}
+
+/**
+ * Writes the header of a frame, with the id column if asked. Returns the number of characters written.
+ */
+static size_t write_frame_header(char *output, const bool with_ids) {
+  const char header[] = "x coord, y coord, z coord, radius\n";
+  const char header_with_ids[] = "x coord, y coord, z coord, radius, id\n";
+  if (with_ids) {
+    memcpy(output, header_with_ids, sizeof(header_with_ids) - 1);
+    return sizeof(header_with_ids) - 1;
+  }
+  memcpy(output, header, sizeof(header) - 1);
+  return sizeof(header) - 1;
+}
+
+/**
+ * Writes size bytes to the file, replacing it. A single write call, unless it is interrupted.
+ */
+static void write_file(const char *path, const char *data, size_t size) {
+  const int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file < 0) {
+    std::cerr << "Could not open " << path << std::endl;
+    return;
+  }
+  while (size > 0) {
+    const ssize_t written = write(file, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Could not write " << path << std::endl;
+      break;
+    }
+    data += written;
+    size -= written;
+  }
+  close(file);
+}
+
 /**
  * Ensures the output folder exists
  * Note: If not, it tries to create it.
@@ -14,38 +152,72 @@ int ensure_output_folder(const char *output_folder) {
   return system(("mkdir -p " + std::string(output_folder)).c_str());
 }
 
+/**
+ * Formats the particles CSV file of a frame, in parallel chunks, into the frame buffer.
+ * Returns its size, and sets frame to its start.
+ */
+static size_t format_simulation_step(const size_t num_particles, const Particle *particles, const size_t *ids,
+                                     char **frame) {
+  char *buffer = frame_buffer(num_particles);
+  const size_t header_size = write_frame_header(buffer, ids != NULL);
+
+  const size_t num_chunks = (num_particles + CSV_CHUNK_PARTICLES - 1) / CSV_CHUNK_PARTICLES;
+  std::vector<size_t> chunk_sizes(num_chunks);
+
+  // Each chunk formats its rows at the start of its reserved region.
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+    trace_begin("format chunk");
+    const size_t begin = chunk * CSV_CHUNK_PARTICLES;
+    const size_t end = std::min(begin + CSV_CHUNK_PARTICLES, num_particles);
+    char *row = buffer + header_size + (begin * CSV_ROW_CAPACITY);
+    for (size_t i = begin; i < end; ++i) {
+      // With ids the rows say which particle they are, so the removed ones (radius 0) can be left out.
+      if (ids && particles[i].radius <= 0) {
+        continue;
+      }
+      row += format_particle_row(row, &particles[i], ids ? &ids[i] : NULL);
+    }
+    chunk_sizes[chunk] = row - (buffer + header_size + (begin * CSV_ROW_CAPACITY));
+    trace_end("format chunk");
+  }
+
+  // Close the gaps between the chunks.
+  size_t size = header_size;
+  for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+    memmove(buffer + size, buffer + header_size + (chunk * CSV_CHUNK_PARTICLES * CSV_ROW_CAPACITY),
+            chunk_sizes[chunk]);
+    size += chunk_sizes[chunk];
+  }
+  *frame = buffer;
+  return size;
+}
+
 /**
  * Writes a CSV file that can be read by ParaView,
  * with the current status of the simulation.
  * The file will be written on the specified folder,
  * and suffixed with the step number.
+ * The rows are formatted in parallel chunks, and the file is written with a single write call.
+ * If ids is not NULL, each row ends with the persistent id of the particle, and the removed particles
+ * (radius 0) are left out; without ids there are none, and the row is the particle index.
  */
-void write_simulation_step(const size_t num_particles, const Particle *particles,
+void write_simulation_step(const size_t num_particles, const Particle *particles, const size_t *ids,
                            const char *folder, const unsigned long step) {
-  // Open the csv file to write.
-  std::ofstream output_file;
-  output_file.open(
-    std::string(folder) + "/2DPartInt-Out.csv." + std::to_string(step),
-    std::ios_base::out | std::ios_base::trunc
-  );
-
-  // Write the header.
-  output_file << "x coord, y coord, z coord, radius\n";
-
-  // Write the current status of each particle.
-  for (size_t i = 0; i < num_particles; ++i) {
-    output_file << particles[i].x_coordinate
-                << ", "
-                << particles[i].y_coordinate
-                << ", "
-                << 0 // Z Coordinate.
-                << ", "
-                << particles[i].radius
-                << "\n";
-  }
+  char *frame;
+  const size_t size = format_simulation_step(num_particles, particles, ids, &frame);
 
-  // Close the CSV file.
-  output_file.close();
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/2DPartInt-Out.csv.%lu", folder, step);
+  write_file(path, frame, size);
+}
+
+/**
+ * Returns the size of the file write_simulation_step would write for these particles, formatting it without writing it.
+ */
+size_t simulation_step_size(const size_t num_particles, const Particle *particles, const size_t *ids) {
+  char *frame;
+  return format_simulation_step(num_particles, particles, ids, &frame);
 }
 
 void write_grid(const int x_squares, const int y_squares, const double square_length, const char* folder)
@@ -79,33 +251,282 @@ void write_grid(const int x_squares, const int y_squares, const double square_le
     output_file.close();
 }
 
-void write_particles_from_grid(const int x_squares, const int y_squares, const char* folder, Particle** grid, const int step)
+/**
+ * Writes a CSV file with the wall segments, one per row.
+ */
+void write_walls(const int num_walls, const Wall *walls, const char* folder)
 {
     // Open the csv file to write.
     std::ofstream output_file;
     output_file.open(
-        std::string(folder) + "/2DPartInt-Out-FROM-GRID.csv." + std::to_string(step),
+        std::string(folder) + "/2DPartInt-Out-WALLS.csv",
         std::ios_base::out | std::ios_base::trunc);
 
     // Write the header.
-    output_file << "x coord, y coord, length\n";
-    int counter = 0;
+    output_file << "x1 coord, y1 coord, x2 coord, y2 coord\n";
+    for (int i = 0; i < num_walls; ++i) {
+        output_file << walls[i].x1
+                    << ", "
+                    << walls[i].y1
+                    << ", "
+                    << walls[i].x2
+                    << ", "
+                    << walls[i].y2
+                    << "\n";
+    }
+
+    // Close the CSV file.
+    output_file.close();
+}
+
+/**
+ * Creates the statistics time series file of the folder, with only its header.
+ */
+void write_statistics_header(const char* folder)
+{
+    std::ofstream output_file;
+    output_file.open(
+        std::string(folder) + "/2DPartInt-Out-STATS.csv",
+        std::ios_base::out | std::ios_base::trunc);
+
+    output_file << "step, time, contacts, coordination number, mean normal force, max normal force, "
+                << "strong fraction, fabric xx, fabric xy, fabric yy, kinetic energy, front y, front velocity";
+    for (int i = 0; i < FORCE_HISTOGRAM_BINS; ++i) {
+        output_file << ", force bin " << i;
+    }
+    output_file << "\n";
+
+    output_file.close();
+}
+
+/**
+ * Appends one row, with the statistics of the given step, to the statistics time series file.
+ */
+void write_statistics(const StepStatistics *statistics, const double time, const unsigned long step,
+                      const char* folder)
+{
+    std::ofstream output_file;
+    output_file.open(
+        std::string(folder) + "/2DPartInt-Out-STATS.csv",
+        std::ios_base::out | std::ios_base::app);
+
+    output_file << step
+                << ", " << time
+                << ", " << statistics->contacts
+                << ", " << statistics->coordination_number
+                << ", " << statistics->mean_normal_force
+                << ", " << statistics->max_normal_force
+                << ", " << statistics->strong_fraction
+                << ", " << statistics->fabric_xx
+                << ", " << statistics->fabric_xy
+                << ", " << statistics->fabric_yy
+                << ", " << statistics->kinetic_energy
+                << ", " << statistics->front_y
+                << ", " << statistics->front_velocity;
+    for (int i = 0; i < FORCE_HISTOGRAM_BINS; ++i) {
+        output_file << ", " << statistics->force_histogram[i];
+    }
+    output_file << "\n";
+
+    output_file.close();
+}
+
+/**
+ * Returns an upper bound of the size of the statistics time series file, with the given number of rows.
+ */
+size_t statistics_size_bound(const size_t rows)
+{
+    return CSV_HEADER_BOUND + (rows * (13 + FORCE_HISTOGRAM_BINS) * CSV_COLUMN_BOUND);
+}
+
+/**
+ * Writes the continuum fields of the cells as a CSV file, one row per cell with mass, with its center as the coordinates,
+ * so it can be read by ParaView like the particles. The file is suffixed with the step number.
+ */
+void write_fields(const FieldGrid *field_grid, const FieldCell *cells, const char* folder, const unsigned long step)
+{
+    std::ofstream output_file;
+    output_file.open(
+        std::string(folder) + "/2DPartInt-Fields.csv." + std::to_string(step),
+        std::ios_base::out | std::ios_base::trunc);
+
+    output_file << "x coord, y coord, z coord, density, porosity, velocity x, velocity y, "
+                << "stress xx, stress xy, stress yy, strain rate xx, strain rate xy, strain rate yy\n";
+    for (int y = 0; y < field_grid->y_cells; ++y) {
+        for (int x = 0; x < field_grid->x_cells; ++x) {
+            // The empty cells, usually most of the grid, are left out.
+            if (cells[((size_t) y * field_grid->x_cells) + x].mass <= 0) {
+                continue;
+            }
+            FieldValues values;
+            field_values(field_grid, cells, x, y, &values);
+            output_file << values.x
+                        << ", " << values.y
+                        << ", 0"
+                        << ", " << values.density
+                        << ", " << values.porosity
+                        << ", " << values.velocity_x
+                        << ", " << values.velocity_y
+                        << ", " << values.stress_xx
+                        << ", " << values.stress_xy
+                        << ", " << values.stress_yy
+                        << ", " << values.strain_rate_xx
+                        << ", " << values.strain_rate_xy
+                        << ", " << values.strain_rate_yy
+                        << "\n";
+        }
+    }
+
+    output_file.close();
+}
+
+/**
+ * Returns an upper bound of the size of one continuum fields file: every cell holding mass.
+ */
+size_t fields_size_bound(const FieldGrid *field_grid)
+{
+    return CSV_HEADER_BOUND + (field_grid_cells(field_grid) * 13 * CSV_COLUMN_BOUND);
+}
+
+/**
+ * Writes why and when the run ended (END, EQUILIBRIUM or BLOWUP), the simulated time it skipped,
+ * and the equilibrium measures of its last check, to a one row CSV file.
+ */
+void write_termination(const char *reason, const unsigned long step, const double time, const double skipped_time,
+                       const EquilibriumMeasures *measures, const double kinetic_ratio, const char* folder)
+{
+    std::ofstream output_file;
+    output_file.open(
+        std::string(folder) + "/2DPartInt-Termination.csv",
+        std::ios_base::out | std::ios_base::trunc);
+
+    output_file << "reason, step, time, skipped time, kinetic energy ratio, max speed, unbalanced force ratio\n"
+                << reason
+                << ", " << step
+                << ", " << time
+                << ", " << skipped_time
+                << ", " << kinetic_ratio
+                << ", " << measures->max_speed
+                << ", " << measures->unbalanced_force_ratio
+                << "\n";
+
+    output_file.close();
+}
+
+/**
+ * Writes the steps kept by the flight recorder, from the oldest to the newest, in two CSV files:
+ * one row per tracked particle and step, and one row per recorded contact.
+ * The files are named after the reason of the dump, and suffixed with the step number.
+ */
+void write_flight_recorder(const FlightRecorder *recorder, const char *reason, const char* folder,
+                           const unsigned long step)
+{
+    const std::string suffix = std::string(reason) + ".csv." + std::to_string(step);
+    std::ofstream states_file;
+    states_file.open(
+        std::string(folder) + "/2DPartInt-Recorder-" + suffix,
+        std::ios_base::out | std::ios_base::trunc);
+    std::ofstream contacts_file;
+    contacts_file.open(
+        std::string(folder) + "/2DPartInt-Recorder-CONTACTS-" + suffix,
+        std::ios_base::out | std::ios_base::trunc);
+
+    // Same columns as the DEBUG_STEP dump.
+    states_file << "step, particle, x_coor, y_coor, radius, mass, kn, ks, norm_f, tang_f, forc_x, forc_y, "
+                << "accel_x, accel_y, vel_x, vel_y, disp_x, disp_y, contacts\n";
+    contacts_file << "step, particle, other, overlap, norm_f, tang_f\n";
+
+    const size_t kept = recorder->recorded < recorder->capacity ? recorder->recorded : recorder->capacity;
+    for (size_t i = recorder->recorded - kept; i < recorder->recorded; ++i) {
+        const RecordedState *row = &recorder->states[(i % recorder->capacity) * recorder->num_tracked];
+        for (size_t k = 0; k < recorder->num_tracked; ++k) {
+            const RecordedState *state = &row[k];
+            if (state->particle_idx == REMOVED_PARTICLE) {
+                continue;
+            }
+            states_file << state->step
+                        << ", " << state->particle_idx
+                        << ", " << state->particle.x_coordinate
+                        << ", " << state->particle.y_coordinate
+                        << ", " << state->particle.radius
+                        << ", " << state->material.mass
+                        << ", " << state->material.kn
+                        << ", " << state->material.ks
+                        << ", " << state->normal_force
+                        << ", " << state->tangent_force
+                        << ", " << state->force.x_component
+                        << ", " << state->force.y_component
+                        << ", " << state->acceleration.x_component
+                        << ", " << state->acceleration.y_component
+                        << ", " << state->velocity.x_component
+                        << ", " << state->velocity.y_component
+                        << ", " << state->displacement.x_component
+                        << ", " << state->displacement.y_component
+                        << ", " << state->num_contacts
+                        << "\n";
+
+            const size_t recorded_contacts = state->num_contacts < RECORDER_MAX_CONTACTS
+                ? state->num_contacts : RECORDER_MAX_CONTACTS;
+            for (size_t c = 0; c < recorded_contacts; ++c) {
+                contacts_file << state->step
+                              << ", " << state->particle_idx
+                              << ", " << state->contacts[c].other_idx
+                              << ", " << state->contacts[c].overlap
+                              << ", " << state->contacts[c].normal_force
+                              << ", " << state->contacts[c].tangent_force
+                              << "\n";
+            }
+        }
+    }
+
+    states_file.close();
+    contacts_file.close();
+}
+
+/**
+ * Same as write_simulation_step, but with the particles in the order of the grid's squares.
+ * Each row of squares is one parallel chunk; its region of the buffer starts after
+ * the rows reserved for the particles of the previous rows of squares.
+ */
+void write_particles_from_grid(const int x_squares, const int y_squares, const char* folder, Particle** grid, const int step)
+{
+    std::vector<size_t> row_starts(y_squares + 1, 0);
     for (int row = 0; row < y_squares; ++row) {
+        size_t count = 0;
         for (int col = 0; col < x_squares; ++col) {
-            if(!grid[row*x_squares + col]) continue; // If  square is empty
-            Particle* p = grid[row * x_squares + col];
-            do{
-                counter++;
-                output_file << p->x_coordinate
-                            << ", "
-                            << p->y_coordinate
-                            << ", "
-                            << 0
-                            << ", "
-                            << p->radius
-                            << "\n";
-                p = p->next;
-            }while(p);
+            for (const Particle *p = grid[row * x_squares + col]; p; p = p->next) {
+                count++;
+            }
         }
+        row_starts[row + 1] = row_starts[row] + count;
     }
+
+    char *buffer = frame_buffer(row_starts[y_squares]);
+    // Same header as the original output of this function.
+    const char header[] = "x coord, y coord, length\n";
+    memcpy(buffer, header, sizeof(header) - 1);
+    const size_t header_size = sizeof(header) - 1;
+    std::vector<size_t> chunk_sizes(y_squares);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int row = 0; row < y_squares; ++row) {
+        char *const start = buffer + header_size + (row_starts[row] * CSV_ROW_CAPACITY);
+        char *output = start;
+        for (int col = 0; col < x_squares; ++col) {
+            for (const Particle *p = grid[row * x_squares + col]; p; p = p->next) {
+                output += format_particle_row(output, p, NULL);
+            }
+        }
+        chunk_sizes[row] = output - start;
+    }
+
+    size_t size = header_size;
+    for (int row = 0; row < y_squares; ++row) {
+        memmove(buffer + size, buffer + header_size + (row_starts[row] * CSV_ROW_CAPACITY), chunk_sizes[row]);
+        size += chunk_sizes[row];
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/2DPartInt-Out-FROM-GRID.csv.%d", folder, step);
+    write_file(path, buffer, size);
 }
@@ -7,10 +7,11 @@ extern "C" {
 
 // Simulation data structures.
 extern Particle *particles;
-extern ParticleProperties *properties;
+extern Material materials[MAX_MATERIALS];
+extern MaterialId *material_ids;
 extern Contact *contacts_buffer;
-extern double *normal_forces;
-extern double *tangent_forces;
+extern accum *normal_forces;
+extern accum *tangent_forces;
 extern Vector *forces;
 extern Vector *accelerations;
 extern Vector *velocities;
@@ -81,11 +82,11 @@ void write_values(const size_t particle_index, const size_t contacts_size, std::
   column_width = 11;
   // Properties information.
   file << std::setw(column_width) << std::setprecision(precision)
-       << properties[particle_index].mass
+       << materials[material_ids[particle_index]].mass
        << std::setw(column_width) << std::setprecision(precision)
-       << properties[particle_index].kn
+       << materials[material_ids[particle_index]].kn
        << std::setw(column_width) << std::setprecision(precision)
-       << properties[particle_index].ks;
+       << materials[material_ids[particle_index]].ks;
   // Normal and tanget forces.
   column_width = 8;
   file << std::setw(column_width) << std::setprecision(precision)
@@ -0,0 +1,286 @@
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "frame_stream.h"
+extern "C" {
+  #include "tracer.h"
+}
+
+// Sections of a frame buffer are aligned to this many bytes.
+#define STREAM_BUFFER_ALIGNMENT 64
+
+// Ring of frame buffers: 'queued' of them, from 'head', wait for the writer thread.
+// queued and dropped change under stream_mutex, and are atomic so the status getters read them without it.
+static char *stream_buffers = NULL;
+static size_t stream_num_buffers = 0;
+static size_t stream_capacity = 0;
+static size_t head = 0;
+static std::atomic<size_t> queued(0);
+static bool stopping = false;
+static bool failed = false;
+static std::atomic<uint64_t> dropped(0);
+static uint64_t dropped_since_sent = 0;
+static StreamPolicy stream_policy = STREAM_POLICY_BLOCK;
+static int stream_file = -1;
+static std::mutex stream_mutex;
+static std::condition_variable stream_changed;
+static std::thread writer_thread;
+
+/**
+ * Returns the size rounded up to STREAM_BUFFER_ALIGNMENT.
+ */
+static size_t aligned(const size_t size) {
+  return (size + STREAM_BUFFER_ALIGNMENT - 1) & ~((size_t) STREAM_BUFFER_ALIGNMENT - 1);
+}
+
+/**
+ * Returns the bytes of one frame buffer of the given capacity, in particles.
+ */
+size_t stream_buffer_size(const size_t capacity) {
+  return aligned(sizeof(StreamFrameHeader)) + (3 * aligned(capacity * sizeof(real)))
+    + aligned(capacity * sizeof(uint64_t));
+}
+
+/**
+ * Column 'column' (x, y, radius, then ids) of a frame buffer.
+ */
+static char *buffer_column(char *buffer, const int column) {
+  return buffer + aligned(sizeof(StreamFrameHeader)) + (column * aligned(stream_capacity * sizeof(real)));
+}
+
+/**
+ * Opens the stream target: "stdout", "fifo:<path>" (created if missing, waits for a reader),
+ * or "unix:<path>" (connects to a listening Unix domain socket). With stdout, the text the program prints
+ * is sent to stderr from then on. Returns the file descriptor, or -1 on error.
+ */
+int open_stream_target(const char *target) {
+  // A consumer that goes away is reported by write, instead of killing the process.
+  std::signal(SIGPIPE, SIG_IGN);
+
+  const std::string name(target);
+  if (name == "stdout") {
+    const int file = dup(STDOUT_FILENO);
+    fflush(stdout);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    return file;
+  }
+  if (name.compare(0, 5, "fifo:") == 0) {
+    const std::string path = name.substr(5);
+    if (mkfifo(path.c_str(), 0644) != 0 && errno != EEXIST) {
+      return -1;
+    }
+    return open(path.c_str(), O_WRONLY);
+  }
+  if (name.compare(0, 5, "unix:") == 0) {
+    const std::string path = name.substr(5);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+      return -1;
+    }
+    strcpy(address.sun_path, path.c_str());
+    const int file = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (file >= 0 && connect(file, (struct sockaddr*) &address, sizeof(address)) != 0) {
+      close(file);
+      return -1;
+    }
+    return file;
+  }
+  return -1;
+}
+
+/**
+ * Writes all the bytes of the vectors, continuing after partial writes. Returns false on error.
+ */
+static bool write_all(const int file, struct iovec *vectors, int count) {
+  while (count > 0) {
+    const ssize_t written = writev(file, vectors, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    size_t remaining = written;
+    while (count > 0 && remaining >= vectors->iov_len) {
+      remaining -= vectors->iov_len;
+      vectors++;
+      count--;
+    }
+    if (count > 0) {
+      vectors->iov_base = (char*) vectors->iov_base + remaining;
+      vectors->iov_len -= remaining;
+    }
+  }
+  return true;
+}
+
+/**
+ * Writer thread: writes the queued frames in order, the header and each column with a single writev,
+ * until stopped with nothing left in the queue, or until a write fails.
+ */
+static void write_frames() {
+  trace_thread_name("frame stream");
+  std::unique_lock<std::mutex> lock(stream_mutex);
+  while (true) {
+    stream_changed.wait(lock, [] { return queued > 0 || stopping; });
+    if (queued == 0) {
+      break;
+    }
+    char *buffer = stream_buffers + (head * stream_buffer_size(stream_capacity));
+    lock.unlock();
+
+    const StreamFrameHeader *header = (const StreamFrameHeader*) buffer;
+    const size_t column_bytes = header->num_particles * sizeof(real);
+    struct iovec vectors[5] = {
+      { buffer, sizeof(StreamFrameHeader) },
+      { buffer_column(buffer, 0), column_bytes },
+      { buffer_column(buffer, 1), column_bytes },
+      { buffer_column(buffer, 2), column_bytes },
+      { buffer_column(buffer, 3), header->num_particles * sizeof(uint64_t) }
+    };
+    trace_begin("stream frame");
+    const bool written = write_all(stream_file, vectors, (header->flags & STREAM_FRAME_IDS) ? 5 : 4);
+    trace_end("stream frame");
+
+    lock.lock();
+    head = (head + 1) % stream_num_buffers;
+    queued -= 1;
+    if (!written) {
+      std::cerr << "The frame stream was closed: " << strerror(errno) << std::endl;
+      failed = true;
+      queued = 0;
+    }
+    stream_changed.notify_all();
+    if (failed) {
+      break;
+    }
+  }
+}
+
+/**
+ * Starts the writer thread on the file descriptor, with num_buffers frame buffers of stream_buffer_size(capacity)
+ * bytes each, carved from 'buffers'.
+ */
+void start_frame_stream(const int file, const StreamPolicy policy, const size_t num_buffers, const size_t capacity,
+                        char *buffers) {
+  stream_file = file;
+  stream_policy = policy;
+  stream_num_buffers = num_buffers;
+  stream_capacity = capacity;
+  stream_buffers = buffers;
+  writer_thread = std::thread(write_frames);
+}
+
+/**
+ * Copies the particles into a free frame buffer and queues it for the writer thread.
+ * If ids is not NULL, the frame has an id column, and the removed particles (radius 0) are left out.
+ * Returns false if the frame was dropped,
+ * or if the stream was closed after a write error.
+ */
+bool stream_frame(const size_t num_particles, const Particle *particles, const size_t *ids,
+                  const unsigned long step, const double time) {
+  std::unique_lock<std::mutex> lock(stream_mutex);
+  if (stream_policy == STREAM_POLICY_BLOCK) {
+    stream_changed.wait(lock, [] { return queued < stream_num_buffers || failed; });
+  }
+  if (failed) {
+    return false;
+  }
+  if (queued == stream_num_buffers) {
+    dropped += 1;
+    dropped_since_sent += 1;
+    return false;
+  }
+  // Only this thread adds frames, so the buffer after the queued ones stays free while it is filled.
+  char *buffer = stream_buffers + (((head + queued) % stream_num_buffers) * stream_buffer_size(stream_capacity));
+  const uint64_t frame_dropped = dropped_since_sent;
+  dropped_since_sent = 0;
+  lock.unlock();
+
+  real *x = (real*) buffer_column(buffer, 0);
+  real *y = (real*) buffer_column(buffer, 1);
+  real *radius = (real*) buffer_column(buffer, 2);
+  uint64_t *frame_ids = (uint64_t*) buffer_column(buffer, 3);
+  size_t num_rows = num_particles;
+  if (ids) {
+    // The ids say which particle each row is, so the removed ones (radius 0) are left out.
+    num_rows = 0;
+    for (size_t i = 0; i < num_particles; ++i) {
+      if (particles[i].radius > 0) {
+        x[num_rows] = particles[i].x_coordinate;
+        y[num_rows] = particles[i].y_coordinate;
+        radius[num_rows] = particles[i].radius;
+        frame_ids[num_rows] = ids[i];
+        num_rows += 1;
+      }
+    }
+  } else {
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < num_particles; ++i) {
+      x[i] = particles[i].x_coordinate;
+      y[i] = particles[i].y_coordinate;
+      radius[i] = particles[i].radius;
+    }
+  }
+
+  StreamFrameHeader *header = (StreamFrameHeader*) buffer;
+  memset(header, 0, sizeof(StreamFrameHeader));
+  memcpy(header->magic, STREAM_FRAME_MAGIC, sizeof(header->magic));
+  header->version = STREAM_FRAME_VERSION;
+  header->real_size = sizeof(real);
+  header->flags = ids ? STREAM_FRAME_IDS : 0;
+  header->frame_size = sizeof(StreamFrameHeader) + (num_rows * ((3 * sizeof(real)) + (ids ? sizeof(uint64_t) : 0)));
+  header->step = step;
+  header->time = time;
+  header->num_particles = num_rows;
+  header->dropped = frame_dropped;
+
+  lock.lock();
+  queued += 1;
+  stream_changed.notify_all();
+  return true;
+}
+
+/**
+ * Frames waiting to be written.
+ */
+size_t frame_stream_queue_depth() {
+  return queued.load(std::memory_order_relaxed);
+}
+
+/**
+ * Frames dropped since the start.
+ */
+uint64_t frame_stream_dropped() {
+  return dropped.load(std::memory_order_relaxed);
+}
+
+/**
+ * Writes the frames still queued, stops the writer thread and closes the file descriptor.
+ */
+void stop_frame_stream() {
+  {
+    std::lock_guard<std::mutex> lock(stream_mutex);
+    stopping = true;
+  }
+  stream_changed.notify_all();
+  if (writer_thread.joinable()) {
+    writer_thread.join();
+  }
+  close(stream_file);
+  stream_file = -1;
+}
@@ -1,72 +1,330 @@
+#include <algorithm>
 #include <cstddef>
 #include <cmath>
 #include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <omp.h>
 extern "C" {
   #include "functions.h"
   #include "data.h"
+  #include "collisions.h"
+  #include "arena.h"
+  #include "flight_recorder.h"
+  #include "analysis.h"
+  #include "population.h"
+  #include "fields.h"
+  #include "tracer.h"
 }
+#include "csv.h"
 #include "initialization.h"
 #include "config.h"
 
 // Simulation data structures.
 extern Particle *particles;
-extern ParticleProperties *properties;
+extern MaterialId *material_ids;
+extern Material materials[MAX_MATERIALS];
+extern size_t num_materials;
 extern Contact *contacts_buffer;
-extern double *normal_forces;
-extern double *tangent_forces;
+extern accum *normal_forces;
+extern accum *tangent_forces;
 extern Vector *forces;
 extern Vector *accelerations;
 extern Vector *velocities;
 extern Vector *displacements;
 extern Particle **grid;
 extern Particle **grid_lasts;
+extern Wall *walls;
+extern size_t num_walls;
+extern size_t *wall_cells_start;
+extern size_t *wall_cells;
+extern WallContact *wall_contacts_buffer;
+extern accum *wall_normal_forces;
+extern accum *wall_tangent_forces;
+extern Arena arena;
+extern unsigned char *image;
+extern size_t *render_tile_offsets;
+extern size_t *render_tile_order;
+extern char *csv_frame_buffer;
+extern size_t particles_capacity;
+extern size_t *particle_ids;
+extern size_t *particle_remap;
+extern size_t next_particle_id;
+extern MaterialId source_material;
+extern int *recorder_slots;
+extern RecordedState *recorder_states;
+extern SweepList sweep_list;
+extern char *stream_buffers;
+extern size_t *contact_offsets;
+extern size_t *contact_order;
+extern FieldGrid field_grid;
+extern FieldCell *field_cells;
+extern TraceEvent *trace_buffers;
+extern size_t trace_threads;
 
 #ifndef M_PI
   #define M_PI 3.141592653589793
 #endif
 
 /**
- * Computes the mass of a particle, given its radius.
+ * Computes the mass of a particle of the given density, given its radius.
  */
-double compute_mass(const Config *config) {
-  return config->rho * config->thickness * M_PI * config->radius * config->radius;
+double compute_mass(const Config *config, const double rho) {
+  return rho * config->thickness * M_PI * config->radius * config->radius;
 }
 
+/**
+ * Fills the material table: material 0 with the rho, kn and ks of the config,
+ * and one more for each material layer.
+ */
+static void init_materials(const Config *config) {
+  num_materials = config->num_material_layers + 1;
+  for (size_t i = 0; i < num_materials; ++i) {
+    const MaterialLayer base = { config->rho, config->kn, config->ks, 0, 0 };
+    const MaterialLayer &layer = (i == 0) ? base : config->material_layers[i - 1];
+    const double mass = compute_mass(config, layer.rho);
+    materials[i].mass = mass;
+    materials[i].kn = layer.kn;
+    materials[i].ks = layer.ks;
+    materials[i].inverse_mass = 1 / mass;
+  }
+}
+
+/**
+ * Returns the material of the given row of the bed: the last layer that covers it, or 0.
+ */
+static MaterialId bed_material(const Config *config, const int row) {
+  MaterialId material = 0;
+  for (int i = 0; i < config->num_material_layers; ++i) {
+    if (row >= config->material_layers[i].first_row && row <= config->material_layers[i].last_row) {
+      material = (MaterialId) (i + 1);
+    }
+  }
+  return material;
+}
+
+
+/**
+ * One simulation structure carved from the arena: count rows of the given size, in bytes.
+ */
+struct Allocation {
+  const char *name;
+  void **data;
+  size_t count;
+  size_t size;
+};
+
+/**
+ * Lists every simulation data structure, in the order they are carved from the arena.
+ * The per-particle structures, and the contacts history with one row per particle,
+ * have one row per particle, so the rows are first touched by the threads that process those particles.
+ * num_particles is the capacity: the particles inserted during the run use the same arrays.
+ */
+static std::vector<Allocation> list_allocations(const Config *config, const size_t num_particles,
+                                                const size_t wall_registrations,
+                                                const size_t max_walls_in_square) {
+  const size_t num_squares = config->x_squares * config->y_squares;
+  std::vector<Allocation> allocations = {
+    { "particles", (void**) &particles, num_particles, sizeof(Particle) },
+    { "material_ids", (void**) &material_ids, num_particles, sizeof(MaterialId) },
+    { "contacts_buffer", (void**) &contacts_buffer, num_particles, num_particles * sizeof(Contact) },
+    { "normal_forces", (void**) &normal_forces, num_particles, num_particles * sizeof(accum) },
+    { "tangent_forces", (void**) &tangent_forces, num_particles, num_particles * sizeof(accum) },
+    { "forces", (void**) &forces, num_particles, sizeof(Vector) },
+    { "velocities", (void**) &velocities, num_particles, sizeof(Vector) },
+#ifdef DEBUG_STEP
+    // The intermediate integration arrays are only kept to be dumped.
+    { "accelerations", (void**) &accelerations, num_particles, sizeof(Vector) },
+    { "displacements", (void**) &displacements, num_particles, sizeof(Vector) },
+#endif
+    // Array of pointers to the first and the last particle of each grid's squares's singly linked list.
+    { "grid", (void**) &grid, num_squares, sizeof(Particle*) },
+    { "grid_lasts", (void**) &grid_lasts, num_squares, sizeof(Particle*) },
+    { "wall_cells_start", (void**) &wall_cells_start, num_squares + 1, sizeof(size_t) },
+    { "wall_cells", (void**) &wall_cells, wall_registrations, sizeof(size_t) },
+    { "wall_contacts_buffer", (void**) &wall_contacts_buffer, num_particles, max_walls_in_square * sizeof(WallContact) },
+    { "wall_normal_forces", (void**) &wall_normal_forces, num_particles, num_walls * sizeof(accum) },
+    { "wall_tangent_forces", (void**) &wall_tangent_forces, num_particles, num_walls * sizeof(accum) }
+  };
+  if (config->force_accumulation == FORCE_ACCUMULATION_DETERMINISTIC) {
+    // Contacts grouped by receiving particle, with one row per particle like the contacts buffer.
+    allocations.push_back({ "contact_offsets", (void**) &contact_offsets, num_particles + 1, sizeof(size_t) });
+    allocations.push_back({ "contact_order", (void**) &contact_order, num_particles, num_particles * sizeof(size_t) });
+  }
+  if (config->num_sources > 0 || config->has_keep_region) {
+    // Persistent particle ids, and the old to new indices of each compaction.
+    allocations.push_back({ "particle_ids", (void**) &particle_ids, num_particles, sizeof(size_t) });
+    allocations.push_back({ "particle_remap", (void**) &particle_remap, num_particles, sizeof(size_t) });
+  }
+  if (config->broad_phase != BROAD_PHASE_GRID) {
+    // Sort and sweep order, kept between steps.
+    allocations.push_back({ "sweep_entries", (void**) &sweep_list.entries, num_particles, sizeof(SweepEntry) });
+  }
+  // Text of the particles CSV files, plus one row for the header.
+  allocations.push_back({ "csv_frame_buffer", (void**) &csv_frame_buffer, num_particles + 1, CSV_ROW_CAPACITY });
+  if (config->stream) {
+    // Frames waiting for the writer thread of the stream.
+    allocations.push_back({ "stream_buffers", (void**) &stream_buffers, (size_t) config->stream_buffers,
+                            stream_buffer_size(num_particles) });
+  }
+  if (config->num_tracked > 0) {
+    // Ring buffer of the flight recorder, one row per step.
+    allocations.push_back({ "recorder_slots", (void**) &recorder_slots, num_particles, sizeof(int) });
+    allocations.push_back({ "recorder_states", (void**) &recorder_states, (size_t) config->recorder_steps,
+                            config->num_tracked * sizeof(RecordedState) });
+  }
+  if (config->fields_every > 0) {
+    // Cells of the continuum fields, in num_slabs slabs.
+    allocations.push_back({ "field_cells", (void**) &field_cells, (size_t) field_grid.num_slabs,
+                            field_grid_cells(&field_grid) * sizeof(FieldCell) });
+  }
+  if (config->trace_last_step > 0) {
+    // Events of the timeline, one row per thread.
+    allocations.push_back({ "trace_buffers", (void**) &trace_buffers, trace_threads,
+                            (size_t) config->trace_events * sizeof(TraceEvent) });
+  }
+  if (config->render_every > 0) {
+    // RGB frame, one row per image row.
+    allocations.push_back({ "image", (void**) &image, (size_t) config->render_height,
+                            (size_t) config->render_width * 3 });
+    // Particles binned by the tile of their center.
+    allocations.push_back({ "render_tile_offsets", (void**) &render_tile_offsets,
+                            render_num_tiles(config->render_width, config->render_height) + 1, sizeof(size_t) });
+    allocations.push_back({ "render_tile_order", (void**) &render_tile_order, num_particles, sizeof(size_t) });
+  }
+  return allocations;
+}
+
+/**
+ * Returns the bytes the arena needs for the data structures, each aligned like arena_alloc does.
+ */
+static size_t arena_size(const std::vector<Allocation> &allocations) {
+  size_t arena_bytes = 0;
+  for (const Allocation &allocation : allocations) {
+    arena_bytes += arena_aligned_size(allocation.count, allocation.size);
+  }
+  return arena_bytes;
+}
+
+/**
+ * Prints the memory taken by each data structure, backed by the given kind of pages.
+ */
+static void report_footprint(const std::vector<Allocation> &allocations, const ArenaPages pages) {
+  static const char *pages_names[] = { "default", "transparent huge", "explicit huge" };
+  std::cout << "Memory footprint (" << pages_names[pages] << " pages):" << std::endl;
+  for (const Allocation &allocation : allocations) {
+    std::cout << "  " << std::left << std::setw(22) << allocation.name
+              << std::right << std::setw(14) << arena_aligned_size(allocation.count, allocation.size)
+              << " bytes" << std::endl;
+  }
+  std::cout << "  " << std::left << std::setw(22) << "total"
+            << std::right << std::setw(14) << arena_size(allocations) << " bytes" << std::endl;
+}
+
+/**
+ * Returns the number of particles of the bed of the config, plus the falling particle (the first one).
+ */
+static size_t initial_particles(const Config *config) {
+  // The product of the particles that can fill each dimension.
+  return ((size_t) config->x_particles * config->y_particles) + 1;
+}
+
+/**
+ * Sizes every data structure for the config, without allocating them: sets the walls, the particles capacity
+ * and the fields grid, and lists the structures.
+ */
+static std::vector<Allocation> size_structures(const Config *config, const size_t num_particles) {
+  // Register the walls in the squares of the grid. Done only once, since the walls do not move.
+  // First only count the registrations, to know the size of the structures.
+  const size_t num_squares = config->x_squares * config->y_squares;
+  walls = config->walls;
+  num_walls = config->num_walls;
+  std::vector<size_t> walls_start(num_squares + 1);
+  const size_t wall_registrations = bin_walls(num_walls, walls, config->x_squares, config->y_squares,
+                                              config->square_in_grid_length, config->radius,
+                                              walls_start.data(), NULL);
+  // A particle can touch, at most, all the walls registered in its square.
+  size_t max_walls_in_square = 0;
+  for (size_t i = 0; i < num_squares; ++i) {
+    max_walls_in_square = std::max(max_walls_in_square, walls_start[i + 1] - walls_start[i]);
+  }
+
+  if (config->fields_every > 0) {
+    // One slab per thread, or a fixed number of them when the run has to give the same results for any thread count.
+    const int num_slabs = (config->force_accumulation == FORCE_ACCUMULATION_DETERMINISTIC)
+      ? FIELD_DETERMINISTIC_SLABS : omp_get_max_threads();
+    init_field_grid(config->x_squares, config->y_squares, config->square_in_grid_length, config->fields_cell_squares,
+                    config->thickness, config->periodic_x, num_slabs, &field_grid);
+  }
+
+  // The OpenMP threads, and the writer of the frame stream.
+  trace_threads = std::min((size_t) omp_get_max_threads() + 1, (size_t) TRACE_MAX_THREADS);
+
+  // Room for the particles inserted during the run.
+  particles_capacity = std::max((size_t) std::max(config->capacity, 0), num_particles);
+  return list_allocations(config, particles_capacity, wall_registrations, max_walls_in_square);
+}
+
+/**
+ * Prints the memory each data structure of the config would take, without allocating them.
+ * Returns the total, in bytes.
+ */
+size_t plan_memory(const Config *config) {
+  const std::vector<Allocation> allocations = size_structures(config, initial_particles(config));
+  report_footprint(allocations, config->huge_pages);
+  return arena_size(allocations);
+}
 
 /**
  * Initialize all simulation data structures,
  * according to the simulation size.
  * Returns the number of initialized particles.
+ * The arrays are sized for the capacity of the config, if larger.
  *
  * Note: Except for the particles,
  * all structures are effectively initialized with zeros.
+ * All of them are carved from a single arena, released with arena_destroy.
+ * The accelerations and displacements are only allocated in debug builds.
+ * The footprint is printed if report_memory is set.
+ * Without first_touch, the pages are left for the first step that writes them,
+ * so a plan only takes the memory its sampled steps reach.
  */
-size_t initialize(const Config *config) {
+size_t initialize(const Config *config, const bool report_memory, const bool first_touch) {
   const double diameter = 2 * config->radius;
-  const double mass = compute_mass(config);
+  init_materials(config);
 
-  // Maximum of particles on each coordinate
+  // Maximum of particles on each row
   const unsigned int max_in_x = config->x_particles;
-  const unsigned int max_in_y = config->y_particles;
-
-  // The number of particles is equal to the product
-  // of the particles that can fill each dimension,
-  // plus the falling particle (the first one).
-  const size_t num_particles = (max_in_x * max_in_y) +  1;
-
-  // Allocate the memory for all the data structures.
-  particles = (Particle*) calloc(num_particles, sizeof(Particle));
-  properties = (ParticleProperties*) calloc(num_particles, sizeof(ParticleProperties));
-  contacts_buffer = (Contact*) calloc(num_particles * num_particles, sizeof(Contact));
-  normal_forces = (double*) calloc(num_particles * num_particles, sizeof(double));
-  tangent_forces = (double*) calloc(num_particles * num_particles, sizeof(double));
-  forces = (Vector*) calloc(num_particles, sizeof(Vector));
-  accelerations = (Vector*) calloc(num_particles, sizeof(Vector));
-  velocities = (Vector*) calloc(num_particles, sizeof(Vector));
-  displacements = (Vector*) calloc(num_particles, sizeof(Vector));
-  grid = (Particle**) calloc(config->x_squares * config->y_squares, sizeof(Particle*)); // Squares in grid will be of lenght 2 * diameter
-  grid_lasts = (Particle**) calloc(config->x_squares * config->y_squares, sizeof(Particle*)); // Array of pointers to the last position of each grid's squares's singly linked list
+  const size_t num_particles = initial_particles(config);
+
+  for (int i = 0; i < config->num_tracked; ++i) {
+    if (config->tracked[i] >= num_particles) {
+      std::cerr << "The tracked particle " << config->tracked[i] << " does not exist" << std::endl;
+      exit(-1);
+    }
+  }
 
+  // Carve all the data structures from a single region.
+  const std::vector<Allocation> allocations = size_structures(config, num_particles);
+  const size_t arena_bytes = arena_size(allocations);
+  if (arena_create(&arena, arena_bytes, config->huge_pages) != 0) {
+    std::cerr << "Could not allocate " << arena_bytes << " bytes for the simulation" << std::endl;
+    exit(-1);
+  }
+  for (const Allocation &allocation : allocations) {
+    *allocation.data = arena_alloc(&arena, allocation.count, allocation.size);
+    // Place each page on the NUMA node of the thread that will process its particles.
+    if (first_touch) {
+      arena_first_touch(*allocation.data, allocation.count, allocation.size);
+    }
+  }
+  if (report_memory) {
+    report_footprint(allocations, arena.pages);
+  }
+
+  bin_walls(num_walls, walls, config->x_squares, config->y_squares, config->square_in_grid_length,
+            config->radius, wall_cells_start, wall_cells);
 
   double shift = config->x_particles * config->radius; // Shift to the left so there is simmetry around 0 in x coordinates
   // Initialize the particles.
@@ -77,9 +335,7 @@ size_t initialize(const Config *config) {
     particles[i].y_coordinate = y;
     particles[i].radius = config->radius;
     particles[i].idx = i;
-    properties[i].mass = mass;
-    properties[i].kn = config->kn;
-    properties[i].ks = config->ks;
+    material_ids[i] = bed_material(config, (i - 1) / max_in_x);
 
     // Check if this particle is the last one for this row...
     if ((i % max_in_x) == 0) {
@@ -97,11 +353,18 @@ size_t initialize(const Config *config) {
   particles[0].y_coordinate = (config->y_particles * 2 * config->radius) + (4 * config->radius);
   particles[0].radius = config->radius;
   particles[0].idx = 0;
-  properties[0].mass = mass;
-  properties[0].kn = config->kn;
-  properties[0].ks = config->ks;
+  material_ids[0] = 0;
   velocities[0].y_component = config->v0;
 
+  // The inserted particles are of the base material, like the falling particle, and get ids after the initial ones.
+  source_material = 0;
+  next_particle_id = num_particles;
+  if (particle_ids) {
+    for (size_t i = 0; i < num_particles; ++i) {
+      particle_ids[i] = i;
+    }
+  }
+
   // Return the number of initialized particles.
   return num_particles;
 }
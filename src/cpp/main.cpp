@@ -1,15 +1,35 @@
+#include <chrono>
 #include <cstdlib>
 #include <cmath>
+#include <csignal>
+#include <cstdio>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <string>
+#include <sys/statvfs.h>
+#include <sys/sysinfo.h>
 extern "C" {
   #include "functions.h"
   #include "data.h"
   #include "collisions.h"
+  #include "forces_simd.h"
+  #include "arena.h"
+  #include "analysis.h"
+  #include "render.h"
+  #include "png.h"
+  #include "flight_recorder.h"
+  #include "population.h"
+  #include "bed_cache.h"
+  #include "fields.h"
+  #include "tracer.h"
 }
 #include "config.h"
 #include "csv.h"
 #include "initialization.h"
+#include "status_server.h"
+#include "frame_stream.h"
 
 #ifdef DEBUG_STEP
 #include "debug.h"
@@ -23,84 +43,618 @@ size_t particle_to_debug;
 
 // Simulation data structures.
 Particle *particles;
-ParticleProperties *properties;
+MaterialId *material_ids;
 Contact *contacts_buffer;
-double *normal_forces;
-double *tangent_forces;
+accum *normal_forces;
+accum *tangent_forces;
 Vector *forces;
 Vector *accelerations;
 Vector *velocities;
 Vector *displacements;
 Particle **grid;
 Particle **grid_lasts;
+Wall *walls; // Owned by the config.
+size_t num_walls;
+size_t *wall_cells_start;
+size_t *wall_cells;
+WallContact *wall_contacts_buffer;
+accum *wall_normal_forces;
+accum *wall_tangent_forces;
+
+// Properties of each material, indexed by the material ids of the particles.
+Material materials[MAX_MATERIALS];
+size_t num_materials;
+
+// Particles the arrays can hold. The contact history rows have this length.
+size_t particles_capacity;
+
+// Persistent id of each particle, its new index after each compaction,
+// and the material of the inserted particles. Only used with sources or a keep region.
+size_t *particle_ids;
+size_t *particle_remap;
+size_t next_particle_id;
+MaterialId source_material;
+
+// Single region from which all the simulation data structures are carved.
+Arena arena;
+
+// Frame of the built-in renderer, and the region it shows.
+unsigned char *image;
+RenderView render_view;
+// Particles of the frame binned by the tile of the image that holds their center.
+size_t *render_tile_offsets;
+size_t *render_tile_order;
+
+// Text of the particles CSV files.
+char *csv_frame_buffer;
+
+// Frame buffers of the frame stream, and its file descriptor, -1 when the frames go to CSV files.
+char *stream_buffers;
+int stream_file = -1;
+
+// Flight recorder of the tracked particles, and its buffers.
+FlightRecorder recorder;
+int *recorder_slots;
+RecordedState *recorder_states;
+
+// Set by SIGUSR1, to dump the flight recorder after the current step.
+volatile std::sig_atomic_t recorder_dump_requested = 0;
+
+/**
+ * SIGUSR1 handler. Only sets a flag, the dump is done by the main loop.
+ */
+void request_recorder_dump(int) {
+  recorder_dump_requested = 1;
+}
+
+// Instruction set used by the contact force kernel, detected at startup.
+SimdLevel simd_level;
+
+// Contact law and its parameters, from the config.
+ContactLaw contact_law;
+ContactLawParams contact_law_params;
+
+// How the contact forces are summed, and the contacts grouped by receiving particle for the deterministic mode.
+ForceAccumulation force_accumulation;
+size_t *contact_offsets;
+size_t *contact_order;
+
+// Cells of the continuum fields, with one slab per thread.
+FieldGrid field_grid;
+FieldCell *field_cells;
+
+// Buffers of the timeline of the phases, one per thread.
+TraceEvent *trace_buffers;
+size_t trace_threads;
+
+// Numerical damping of the particles, only on while the bed settles.
+DampingMode damping_mode = DAMPING_NONE;
+real damping_strength;
+
+// True while the bed settles: its steps are not steps of the run, so they are not recorded, traced or dumped.
+bool settling = false;
+
+// Algorithm used to find the contacts, and the sort and sweep order.
+BroadPhase broad_phase;
+SweepList sweep_list;
+
+// Progress of the run, served by the status server when it is on.
+StatusMetrics status_metrics;
+bool status_enabled = false;
+
+/**
+ * Adds the time since start to the given phase, and returns the current time, the start of the next phase.
+ * Only the simulation thread writes the metrics, so a relaxed load and store are enough.
+ */
+std::chrono::steady_clock::time_point end_phase(const StatusPhase phase, const std::chrono::steady_clock::time_point start) {
+  const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  std::atomic<double> &seconds = status_metrics.phase_seconds[phase];
+  seconds.store(seconds.load(std::memory_order_relaxed) + std::chrono::duration<double>(now - start).count(),
+                std::memory_order_relaxed);
+  return now;
+}
+
+// Runs of each broad phase timed by the calibration.
+#define CALIBRATION_RUNS 5
 
 /**
  * Free all the structures allocated by initialize.
  */
 void free_all() {
-  free(particles);
-  free(properties);
-  free(contacts_buffer);
-  free(normal_forces);
-  free(tangent_forces);
-  free(forces);
-  free(accelerations);
-  free(velocities);
-  free(displacements);
-  free(grid);
-  free(grid_lasts);
+  arena_destroy(&arena);
+}
+
+/**
+ * Renders the particles, and writes the frame as a PNG file on the specified folder,
+ * suffixed with the zero padded step number, so the frames sort in order.
+ */
+void write_frame(const size_t particles_size, const char *folder, const unsigned long step) {
+  render_particles(&render_view, particles_size, particles, velocities, forces, particle_ids, render_tile_offsets,
+                   render_tile_order, image);
+
+  char filename[32];
+  snprintf(filename, sizeof(filename), "/2DPartInt-Frame-%08lu.png", step);
+  if (write_png((std::string(folder) + filename).c_str(), render_view.width, render_view.height, image) != 0) {
+    std::cerr << "Could not write the frame of step " << step << std::endl;
+  }
+}
+
+/**
+ * Stops the timeline, and writes it to the specified folder as a Chrome trace event file.
+ */
+void write_timeline(const char *folder) {
+  tracer_set_step(0, 0);
+  const std::string path = std::string(folder) + "/2DPartInt-Trace.json";
+  if (write_trace(path.c_str()) != 0) {
+    std::cerr << "Could not write the timeline to " << path << std::endl;
+    return;
+  }
+  std::cout << "Timeline written to " << path << " (" << trace_recorded() << " events, " << trace_dropped()
+            << " dropped)" << std::endl;
+}
+
+/**
+ * Sends the particles of the step to the frame stream, when there is one, or writes them to a CSV file.
+ * Returns true if the frame was written or queued, false if the stream dropped it.
+ */
+bool write_output(const size_t num_particles, const char *folder, const unsigned long step, const double dt) {
+  if (stream_file >= 0) {
+    return stream_frame(num_particles, particles, particle_ids, step, step * dt);
+  }
+  write_simulation_step(num_particles, particles, particle_ids, folder, step);
+  return true;
+}
+
+/**
+ * Computes the contact forces of the particles with the selected force accumulation.
+ */
+void compute_contact_forces(const double dt, const size_t contacts_size) {
+  if (force_accumulation == FORCE_ACCUMULATION_ATOMIC) {
+    compute_forces_atomic(contact_law, &contact_law_params, dt, particles_capacity, contacts_size, particles,
+                          materials, material_ids, contacts_buffer, velocities, normal_forces, tangent_forces, forces);
+  } else if (force_accumulation == FORCE_ACCUMULATION_DETERMINISTIC) {
+    group_contacts(particles_capacity, contacts_size, contacts_buffer, contact_offsets, contact_order);
+    compute_forces_grouped(contact_law, &contact_law_params, dt, particles_capacity, particles, materials,
+                           material_ids, contacts_buffer, contact_offsets, contact_order, velocities,
+                           normal_forces, tangent_forces, forces);
+  } else {
+    compute_forces_simd(simd_level, contact_law, &contact_law_params, dt, particles_capacity, contacts_size, particles,
+                        materials, material_ids, contacts_buffer, velocities, normal_forces, tangent_forces, forces);
+  }
+}
+
+/**
+ * Finds the contacts between the particles in the grid with the selected broad phase.
+ * Returns the number of contacts.
+ */
+size_t find_contacts(const size_t particles_size, const int x_squares, const int y_squares, const double squares_length) {
+  if (broad_phase == BROAD_PHASE_SWEEP) {
+    return compute_contacts_sweep(particles_size, particles, x_squares, y_squares, squares_length, &sweep_list,
+                                  contacts_buffer);
+  }
+  return compute_contacts(grid, x_squares, y_squares, squares_length, contacts_buffer);
+}
+
+/**
+ * Times the contact search of each broad phase on the initial state, CALIBRATION_RUNS times,
+ * after a first untimed run, and returns the fastest.
+ */
+BroadPhase calibrate_broad_phase(const size_t particles_size, const Config *config) {
+  const BroadPhase candidates[] = { BROAD_PHASE_GRID, BROAD_PHASE_SWEEP };
+  const char *names[] = { "grid", "sweep" };
+  double seconds[2];
+
+  memset(grid, 0, sizeof(Particle*) * config->x_squares * config->y_squares);
+  memset(grid_lasts, 0, sizeof(Particle*) * config->x_squares * config->y_squares);
+  fill_grid(particles_size, config->x_squares, config->y_squares, config->square_in_grid_length, particles, grid, grid_lasts);
+  for (int i = 0; i < 2; ++i) {
+    broad_phase = candidates[i];
+    find_contacts(particles_size, config->x_squares, config->y_squares, config->square_in_grid_length);
+    const auto start = std::chrono::steady_clock::now();
+    for (int run = 0; run < CALIBRATION_RUNS; ++run) {
+      find_contacts(particles_size, config->x_squares, config->y_squares, config->square_in_grid_length);
+    }
+    seconds[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / CALIBRATION_RUNS;
+  }
+
+  const int fastest = (seconds[1] < seconds[0]) ? 1 : 0;
+  std::cout << "Broad phase: grid " << seconds[0] * 1e6 << " us, sweep " << seconds[1] * 1e6
+            << " us, using " << names[fastest] << std::endl;
+  return candidates[fastest];
+}
+
+/**
+ * Removes the particles outside the keep region, inserts the particles of the sources due this step,
+ * and every compact_every steps compacts the arrays, remapping the tracked particles.
+ * The insertion uses the grid of this step, so it goes before the compaction moves the particles.
+ * Returns the new number of particles.
+ */
+size_t update_population(const Config *config, const unsigned long step, size_t particles_size) {
+  if (config->has_keep_region) {
+    remove_outside_region(&config->keep_region, particles_size, particles, velocities);
+  }
+
+  for (int i = 0; i < config->num_sources; ++i) {
+    if ((step % config->sources[i].every) == 0) {
+      particles_size = insert_particles(&config->sources[i], config->radius, source_material,
+                                        particles_size, particles_capacity, grid, config->x_squares,
+                                        config->y_squares, config->square_in_grid_length, particles,
+                                        material_ids, velocities, particle_ids, &next_particle_id);
+    }
+  }
+
+  if ((step % config->compact_every) == 0) {
+    const size_t kept = compact_particles(particles_size, particles_capacity, particles, material_ids, velocities,
+                                          particle_ids, normal_forces, tangent_forces, num_walls,
+                                          wall_normal_forces, wall_tangent_forces, particle_remap);
+    if (kept != particles_size && recorder.num_tracked > 0) {
+      recorder_remap(&recorder, particles_size, particle_remap);
+    }
+    particles_size = kept;
+  }
+  return particles_size;
 }
 
 /**
  * Executes one step of the simulation.
+ * If statistics is not NULL, it is filled with the contact network statistics of the step.
+ * If fields is true, the continuum fields of the step are accumulated in field_cells.
+ * If the flight recorder tracks any particle, their state at the end of the step is recorded, unless the bed is settling.
+ * With the status server on, the contacts and the time of each phase are published.
+ * Returns the number of contacts of the step.
  */
-void simulation_step(const size_t particles_size, const double dt, const int x_squares, const int y_squares, const double squares_length) {
+size_t simulation_step(const size_t particles_size, const unsigned long step, const double dt, const int x_squares, const int y_squares, const double squares_length,
+                     StepStatistics *statistics, const bool fields) {
+  std::chrono::steady_clock::time_point phase_start;
+  if (status_enabled) {
+    phase_start = std::chrono::steady_clock::now();
+  }
 
   // Reset forces to zeros.
+  trace_begin("fill grid");
   memset(forces, 0, sizeof(Vector) * particles_size);
   memset(grid, 0, sizeof(Particle*) * x_squares * y_squares);
   memset(grid_lasts, 0, sizeof(Particle*) * x_squares * y_squares);
 
   fill_grid(particles_size, x_squares, y_squares, squares_length, particles, grid, grid_lasts);
-  size_t contacts_size = compute_contacts(grid, x_squares, y_squares, squares_length, contacts_buffer);
-  compute_forces(dt, particles_size, contacts_size, particles, properties,
-                 contacts_buffer, velocities, normal_forces, tangent_forces, forces);
-
-  for (size_t part = 0; part < particles_size; ++part) {
-    compute_acceleration(part, properties, forces, accelerations);
-    compute_velocity(dt, part, accelerations, velocities);
-    compute_displacement(dt, part, velocities, displacements);
-    displace_particle(part, displacements, particles);
-    fix_displacement(part, velocities, particles);
+  trace_end("fill grid");
+  trace_begin("find contacts");
+  size_t contacts_size = find_contacts(particles_size, x_squares, y_squares, squares_length);
+  trace_end("find contacts");
+  if (status_enabled) {
+    status_metrics.contacts.store(contacts_size, std::memory_order_relaxed);
+    phase_start = end_phase(STATUS_PHASE_CONTACTS, phase_start);
+  }
+  trace_begin("contact forces");
+  compute_contact_forces(dt, contacts_size);
+  trace_end("contact forces");
+  if (status_enabled) {
+    phase_start = end_phase(STATUS_PHASE_FORCES, phase_start);
+  }
+  if (statistics) {
+    trace_begin("statistics");
+    compute_statistics(particles_size, particles_capacity, contacts_size, particles, materials, material_ids, contacts_buffer, normal_forces,
+                       velocities, statistics);
+    trace_end("statistics");
+  }
+  if (fields) {
+    trace_begin("fields");
+    accumulate_fields(&field_grid, particles_size, particles, materials, material_ids, velocities, particles_capacity,
+                      contacts_size, contacts_buffer, normal_forces, tangent_forces, field_cells);
+    trace_end("fields");
+  }
+  if (status_enabled) {
+    phase_start = end_phase(STATUS_PHASE_ANALYSIS, phase_start);
+  }
+  if (num_walls > 0) {
+    trace_begin("wall forces");
+    const size_t wall_contacts_size = compute_wall_contacts(grid, x_squares, y_squares, walls, wall_cells_start,
+                                                            wall_cells, wall_contacts_buffer);
+    compute_wall_forces(contact_law, &contact_law_params, dt, num_walls, wall_contacts_size, particles, materials, material_ids, walls, wall_contacts_buffer,
+                        velocities, wall_normal_forces, wall_tangent_forces, forces);
+    trace_end("wall forces");
+  }
+  if (damping_mode != DAMPING_NONE) {
+    trace_begin("damping");
+    damp_forces(damping_mode, damping_strength, particles_size, particles, materials, material_ids, velocities, forces);
+    trace_end("damping");
+  }
+  if (status_enabled) {
+    phase_start = end_phase(STATUS_PHASE_FORCES, phase_start);
+  }
 
+  trace_begin("integration");
 #ifdef DEBUG_STEP
-    if (current_step == step_to_debug && part == particle_to_debug) {
-      const char *debug_folder = "./debug";
-      if (ensure_output_folder(debug_folder) != 0) {
-        std::cerr << "The debug output folder does not exists, "
-                  << "and could not be created: "
-                  << debug_folder
-                  << std::endl;
-        exit(-1);
-      }
+  // Keep the intermediate arrays, so they can be dumped.
+  integrate_particles(dt, particles_size, materials, material_ids, forces, velocities, particles,
+                      accelerations, displacements);
 
-      write_debug_information(step_to_debug, particle_to_debug,
-                              contacts_size, debug_folder);
+  if (!settling && current_step == step_to_debug) {
+    const char *debug_folder = "./debug";
+    if (ensure_output_folder(debug_folder) != 0) {
+      std::cerr << "The debug output folder does not exists, "
+                << "and could not be created: "
+                << debug_folder
+                << std::endl;
+      exit(-1);
     }
+
+    write_debug_information(step_to_debug, particle_to_debug,
+                            contacts_size, debug_folder);
+  }
+#else
+  integrate_particles(dt, particles_size, materials, material_ids, forces, velocities, particles,
+                      NULL, NULL);
 #endif
+  trace_end("integration");
+
+  if (!settling && recorder.num_tracked > 0) {
+    trace_begin("flight recorder");
+    recorder_record(&recorder, step, dt, particles_capacity, particles, materials, material_ids, forces, velocities,
+                    contacts_size, contacts_buffer, normal_forces, tangent_forces);
+    trace_end("flight recorder");
+  }
+  if (status_enabled) {
+    end_phase(STATUS_PHASE_INTEGRATION, phase_start);
   }
+  return contacts_size;
+}
+
+/**
+ * Returns true if every equilibrium criterion of the config holds: the kinetic energy over its peak,
+ * the largest speed and the unbalanced force ratio. The criteria set to 0 are not checked.
+ */
+bool at_equilibrium(const Config *config, const EquilibriumMeasures *measures, const double peak_kinetic_energy) {
+  const double kinetic_ratio = peak_kinetic_energy > 0 ? measures->kinetic_energy / peak_kinetic_energy : 0;
+  return (config->converge_kinetic_ratio <= 0 || kinetic_ratio < config->converge_kinetic_ratio)
+    && (config->converge_max_speed <= 0 || measures->max_speed < config->converge_max_speed)
+    && (config->converge_force_ratio <= 0 || measures->unbalanced_force_ratio < config->converge_force_ratio);
+}
+
+/**
+ * Lets the bed settle under gravity, with the falling particle left out, until all its particles
+ * stay slower than settle_speed for settle_window seconds, or for settle_max_time at most.
+ * The settle_damping is on for the first settle_damping_time seconds (all the settling if 0),
+ * and always off once the falling particle is back.
+ * With settle_cache, the settled state is cached in that folder, named after the hash of the settings that shape the bed,
+ * so the runs that only differ in v0 or in the output load it instead of settling again.
+ */
+void settle_bed(const Config *config, const size_t num_particles) {
+  const uint64_t key = settled_bed_key(config);
+  char filename[48];
+  snprintf(filename, sizeof(filename), "/2DPartInt-Bed-%016llx.bin", (unsigned long long) key);
+  const std::string path = config->settle_cache ? std::string(config->settle_cache) + filename : "";
+
+  // Removed particles (radius 0) have no contacts, so the falling particle waits out of the bed.
+  const Particle falling = particles[0];
+  const Vector falling_velocity = velocities[0];
+  particles[0].radius = 0;
+  velocities[0] = { 0, 0 };
+
+  // The settling steps count from 1 too, so they stay out of the flight recorder, the timeline and the debug dump.
+  settling = true;
+  tracer_set_step(0, 0);
+  uint64_t settle_steps = 0;
+  if (config->settle_cache
+      && bed_cache_load(path.c_str(), key, &settle_steps, num_particles, particles_capacity, particles, velocities,
+                        normal_forces, tangent_forces, num_walls, wall_normal_forces, wall_tangent_forces) == 0) {
+    std::cout << "Settled bed loaded from " << path << " (" << settle_steps << " steps)" << std::endl;
+  } else {
+    const unsigned long window_steps = std::max(1.0, ceil(config->settle_window / config->dt));
+    const unsigned long max_steps = ceil(config->settle_max_time / config->dt);
+    const unsigned long damping_steps = config->settle_damping_time > 0
+      ? (unsigned long) ceil(config->settle_damping_time / config->dt) : max_steps;
+    damping_strength = config->settle_damping_strength;
+    unsigned long resting_steps = 0;
+    while (settle_steps < max_steps && resting_steps < window_steps) {
+      damping_mode = settle_steps < damping_steps ? config->settle_damping : DAMPING_NONE;
+      settle_steps += 1;
+      simulation_step(num_particles, settle_steps, config->dt, config->x_squares, config->y_squares,
+                      config->square_in_grid_length, NULL, false);
+      const bool resting = max_speed(num_particles, particles, velocities) < config->settle_speed;
+      resting_steps = resting ? resting_steps + 1 : 0;
+    }
+    damping_mode = DAMPING_NONE;
+    if (resting_steps < window_steps) {
+      std::cerr << "The bed did not come to rest in settle_max_time, using its last state" << std::endl;
+    } else {
+      std::cout << "Bed settled in " << settle_steps << " steps" << std::endl;
+    }
+    if (config->settle_cache) {
+      if (ensure_output_folder(config->settle_cache) != 0
+          || bed_cache_save(path.c_str(), key, settle_steps, num_particles, particles_capacity, particles, velocities,
+                            normal_forces, tangent_forces, num_walls, wall_normal_forces, wall_tangent_forces) != 0) {
+        std::cerr << "Could not write the settled bed to " << path << std::endl;
+      } else {
+        std::cout << "Settled bed saved to " << path << " (" << settle_steps << " steps)" << std::endl;
+      }
+    }
+  }
+
+  settling = false;
+  particles[0] = falling;
+  velocities[0] = falling_velocity;
+}
+
+/**
+ * Sets the simulation settings of the config that main and plan_run share: the contact force kernel,
+ * the periodic length, the contact law and the force accumulation.
+ */
+void init_settings(const Config *config) {
+  // Pick the widest contact force kernel the CPU supports.
+  simd_level = detect_simd_level();
+
+  // The particles leaving one side of the grid come back through the other.
+  if (config->periodic_x) {
+    periodic_x_length = config->x_squares * config->square_in_grid_length;
+  }
+
+  contact_law = config->contact_law;
+  force_accumulation = config->force_accumulation;
+  init_contact_law_params(config->friction_angle, config->damping_ratio,
+                          config->young_modulus, config->poisson_ratio, &contact_law_params);
+}
+
+/**
+ * Returns the bytes of memory available for a new run: MemAvailable of /proc/meminfo,
+ * or the free memory reported by sysinfo when it cannot be read. Returns 0 if neither is known.
+ */
+static size_t available_memory() {
+  std::ifstream meminfo("/proc/meminfo");
+  std::string key;
+  size_t kilobytes;
+  while (meminfo >> key >> kilobytes) {
+    if (key == "MemAvailable:") {
+      return kilobytes * 1024;
+    }
+    meminfo.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  }
+  struct sysinfo info;
+  if (sysinfo(&info) == 0) {
+    return (size_t) info.freeram * info.mem_unit;
+  }
+  return 0;
+}
+
+/**
+ * Prints a plan of the run of the config, without writing any output: the memory of each data structure,
+ * the contacts per step, the size of the output files and the wall time, the last two extrapolated
+ * from plan_steps timed steps of the initial state. The settling of the bed is not sampled.
+ * The structures are not first touched, so the sample only takes the pages its steps write.
+ * Returns 1 if the memory exceeds max_memory or the available memory, or the output exceeds max_disk
+ * or the free space of the output folder (when not NULL), 0 otherwise.
+ */
+int plan_run(const char *config_file, const char *output_folder) {
+  Config *config = new Config;
+  parse_config(config_file, config);
+  const unsigned long max_steps = ceil(config->simulation_time / config->dt);
+
+  const size_t memory = plan_memory(config);
+  if (config->max_memory > 0 && memory > config->max_memory) {
+    std::cerr << "The data structures need " << memory << " bytes, more than max_memory ("
+              << config->max_memory << " bytes)" << std::endl;
+    free_config(config);
+    delete config;
+    return 1;
+  }
+  // The run first touches every structure, so all of them have to fit in memory.
+  const size_t available = available_memory();
+  if (available > 0 && memory > available) {
+    std::cerr << "The data structures need " << memory << " bytes, more than the " << available
+              << " bytes of available memory" << std::endl;
+    free_config(config);
+    delete config;
+    return 1;
+  }
+
+  init_settings(config);
+  size_t num_particles = initialize(config, false, false);
+  const bool dynamic_particles = config->num_sources > 0 || config->has_keep_region;
+  broad_phase = config->broad_phase;
+  if (broad_phase == BROAD_PHASE_AUTO) {
+    broad_phase = calibrate_broad_phase(num_particles, config);
+  }
+  init_csv_writer(csv_frame_buffer, (particles_capacity + 1) * CSV_ROW_CAPACITY, config->csv_precision);
+
+  // The sampled steps compute the statistics and the fields like the run, but write nothing.
+  const unsigned long sample_steps = std::min((unsigned long) config->plan_steps, max_steps);
+  StepStatistics statistics;
+  size_t total_contacts = 0;
+  size_t max_contacts = 0;
+  const auto sample_start = std::chrono::steady_clock::now();
+  for (unsigned long step = 1; step <= sample_steps; ++step) {
+    const bool stats_step = config->stats_every > 0 && (step % config->stats_every) == 0;
+    const bool fields_step = config->fields_every > 0 && (step % config->fields_every) == 0;
+    const size_t contacts_size = simulation_step(num_particles, step, config->dt, config->x_squares, config->y_squares,
+                                                 config->square_in_grid_length, stats_step ? &statistics : NULL,
+                                                 fields_step);
+    total_contacts += contacts_size;
+    max_contacts = std::max(max_contacts, contacts_size);
+    if (dynamic_particles) {
+      num_particles = update_population(config, step, num_particles);
+    }
+  }
+  const double sample_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - sample_start).count();
+  const double step_seconds = sample_steps > 0 ? sample_seconds / sample_steps : 0;
+
+  const auto format_start = std::chrono::steady_clock::now();
+  size_t frame_bytes = simulation_step_size(num_particles, particles, particle_ids);
+  const double format_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - format_start).count();
+  // With sources, the frames grow up to the capacity.
+  if (config->num_sources > 0 && num_particles > 0) {
+    frame_bytes = (size_t) ((double) frame_bytes * particles_capacity / num_particles);
+  }
+
+  // Size of the output files: the frames are measured, the rest are upper bounds.
+  // With a frame stream, the frames do not go to disk.
+  const unsigned long frames = config->stream ? 0 : (max_steps / config->output_every) + 1;
+  const size_t frames_bytes = frames * frame_bytes;
+  // The grid and walls files, with three and four numbers per row.
+  size_t other_bytes = CSV_HEADER_BOUND
+    + ((size_t) config->x_squares * config->y_squares * 3 * CSV_COLUMN_BOUND);
+  if (config->num_walls > 0) {
+    other_bytes += CSV_HEADER_BOUND + ((size_t) config->num_walls * 4 * CSV_COLUMN_BOUND);
+  }
+  if (config->stats_every > 0) {
+    other_bytes += statistics_size_bound(max_steps / config->stats_every);
+  }
+  if (config->fields_every > 0) {
+    other_bytes += (max_steps / config->fields_every) * fields_size_bound(&field_grid);
+  }
+  if (config->render_every > 0) {
+    other_bytes += ((max_steps / config->render_every) + 1)
+      * png_file_size(config->render_width, config->render_height);
+  }
+  const size_t disk = frames_bytes + other_bytes;
+  const double wall_seconds = (max_steps * step_seconds) + (frames * format_seconds);
+
+  std::cout << "Steps: " << max_steps << ", " << sample_steps << " timed" << std::endl
+            << "Contacts per step: " << (sample_steps > 0 ? total_contacts / sample_steps : 0)
+            << " mean, " << max_contacts << " max" << std::endl
+            << "Output: " << frames << " frames of " << frame_bytes << " bytes, "
+            << other_bytes << " bytes of other files, " << disk << " bytes in total" << std::endl
+            << "Wall time: " << step_seconds * 1e6 << " us per step, " << format_seconds * 1e6
+            << " us per frame, " << wall_seconds << " s estimated, without the disk writes" << std::endl;
+
+  int exit_code = 0;
+  if (config->max_disk > 0 && disk > config->max_disk) {
+    std::cerr << "The output needs " << disk << " bytes, more than max_disk (" << config->max_disk << " bytes)"
+              << std::endl;
+    exit_code = 1;
+  }
+  struct statvfs filesystem;
+  if (output_folder && statvfs(output_folder, &filesystem) == 0) {
+    const size_t available = (size_t) filesystem.f_bavail * filesystem.f_frsize;
+    if (disk > available) {
+      std::cerr << "The output needs " << disk << " bytes, more than the " << available << " bytes free in "
+                << output_folder << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  free_all();
+  free_config(config);
+  delete config;
+  return exit_code;
 }
 
 /**
  * Main method - All code logic runs here.
  */
 int main(int argc, char *argv[]) {
+  // Plan the run without running it.
+  if (argc >= 3 && argc <= 4 && strcmp(argv[1], "--plan") == 0) {
+    return plan_run(argv[2], argc == 4 ? argv[3] : NULL);
+  }
+
   // Ensure the program was called with the correct number of arguments.
   if (argc != 3) {
     std::cerr << "Wrong number of arguments: "
               << argc - 1
               << std::endl
               << "Usage: 2DPartInt [simulation_config_file] [output_folder]"
+              << std::endl
+              << "       2DPartInt --plan [simulation_config_file] [output_folder (optional)]"
               << std::endl;
     return -1;
   }
@@ -119,11 +673,62 @@ int main(int argc, char *argv[]) {
   Config *config = new Config;
   parse_config(argv[1], config);
 
+  // Open the stream first: with stdout, the text printed from here on goes to stderr.
+  if (config->stream) {
+    stream_file = open_stream_target(config->stream);
+    if (stream_file < 0) {
+      std::cerr << "Could not open the frame stream " << config->stream << std::endl;
+      return -1;
+    }
+  }
+
+  init_settings(config);
+
   // Initialize the simulation data structures.
-  const size_t num_particles = initialize(config);
+  size_t num_particles = initialize(config);
+  const bool dynamic_particles = config->num_sources > 0 || config->has_keep_region;
+
+  // Until calibrated, the automatic broad phase uses the grid.
+  broad_phase = config->broad_phase;
+  if (config->settle_cache || config->settle_damping != DAMPING_NONE) {
+    settle_bed(config, num_particles);
+  }
+  if (broad_phase == BROAD_PHASE_AUTO) {
+    broad_phase = calibrate_broad_phase(num_particles, config);
+  }
+
+  init_csv_writer(csv_frame_buffer, (particles_capacity + 1) * CSV_ROW_CAPACITY, config->csv_precision);
+
+  // The rendered region is the grid.
+  render_view.width = config->render_width;
+  render_view.height = config->render_height;
+  render_view.x_min = -(config->x_squares * config->square_in_grid_length / 2);
+  render_view.y_min = 0;
+  render_view.scale = config->render_width / (config->x_squares * config->square_in_grid_length);
+  render_view.color = config->render_color;
+
+  if (config->num_tracked > 0) {
+    recorder_init(&recorder, particles_capacity, config->num_tracked, config->tracked, config->recorder_steps,
+                  recorder_slots, recorder_states);
+    std::signal(SIGUSR1, request_recorder_dump);
+  }
+
+  // The main thread registers first, so it is the first track of the timeline.
+  const bool tracing = config->trace_last_step > 0;
+  if (tracing) {
+    tracer_init(trace_threads, config->trace_events, trace_buffers);
+    trace_thread_name("simulation");
+  }
+
+  if (stream_file >= 0) {
+    start_frame_stream(stream_file, config->stream_policy, config->stream_buffers, particles_capacity, stream_buffers);
+  }
 
   // Write the initial state of the simulation.
-  write_simulation_step(num_particles, particles, output_folder, 0);
+  unsigned long frames_written = write_output(num_particles, output_folder, 0, config->dt) ? 1 : 0;
+  if (config->render_every > 0) {
+    write_frame(num_particles, output_folder, 0);
+  }
 
   // Run the simulation until the max number of steps is reached.
   // The simulation time and the dt determine the maximum number of steps to execute.
@@ -148,18 +753,161 @@ int main(int argc, char *argv[]) {
 #endif
 
   write_grid(config->x_squares, config->y_squares, config->square_in_grid_length, output_folder);
+  if (config->num_walls > 0) {
+    write_walls(config->num_walls, config->walls, output_folder);
+  }
+  if (config->stats_every > 0) {
+    write_statistics_header(output_folder);
+  }
+  StepStatistics statistics;
+
+  if (config->status_socket || config->status_port > 0) {
+    status_metrics.max_steps.store(max_steps);
+    status_metrics.dt.store(config->dt);
+    status_metrics.particles.store(num_particles);
+    status_metrics.arena_bytes.store(arena.used);
+    const std::string socket_path = config->status_socket ? config->status_socket : "";
+    status_enabled = start_status_server(&status_metrics, socket_path, config->status_port) == 0;
+  }
 
+  // The kinetic energy ratio is relative to the largest kinetic energy seen, starting with the initial one.
+  EquilibriumMeasures equilibrium = { 0, 0, 0 };
+  double peak_kinetic_energy = 0;
+  if (config->converge_every > 0) {
+    compute_equilibrium(num_particles, particles, materials, material_ids, velocities, forces, &equilibrium);
+    peak_kinetic_energy = equilibrium.kinetic_energy;
+  }
+  const char *termination = "END";
+
+  int exit_code = 0;
+  unsigned long last_step = 0;
   for (unsigned long step = 1; step <= max_steps; ++step) {
 #ifdef DEBUG_STEP
     current_step = step;
 #endif
 
-    simulation_step(num_particles, config->dt, config->x_squares, config->y_squares, config->square_in_grid_length);
-    write_simulation_step(num_particles, particles, output_folder, step);
+    if (tracing) {
+      tracer_set_step(step, step >= (unsigned long) config->trace_first_step
+                      && step <= (unsigned long) config->trace_last_step);
+    }
+    trace_begin("step");
+    const bool stats_step = config->stats_every > 0 && (step % config->stats_every) == 0;
+    const bool fields_step = config->fields_every > 0 && (step % config->fields_every) == 0;
+    simulation_step(num_particles, step, config->dt, config->x_squares, config->y_squares, config->square_in_grid_length,
+                    stats_step ? &statistics : NULL, fields_step);
+    std::chrono::steady_clock::time_point output_start;
+    if (status_enabled) {
+      output_start = std::chrono::steady_clock::now();
+    }
+    if (stats_step) {
+      trace_begin("write statistics");
+      write_statistics(&statistics, step * config->dt, step, output_folder);
+      trace_end("write statistics");
+    }
+    if (fields_step) {
+      trace_begin("write fields");
+      write_fields(&field_grid, field_cells, output_folder, step);
+      trace_end("write fields");
+    }
+    if (status_enabled) {
+      end_phase(STATUS_PHASE_OUTPUT, output_start);
+    }
+    // Checked before the population update, while the forces still match the particles.
+    bool equilibrium_reached = false;
+    if (config->converge_every > 0 && (step % config->converge_every) == 0) {
+      compute_equilibrium(num_particles, particles, materials, material_ids, velocities, forces, &equilibrium);
+      peak_kinetic_energy = std::max(peak_kinetic_energy, equilibrium.kinetic_energy);
+      equilibrium_reached = at_equilibrium(config, &equilibrium, peak_kinetic_energy);
+    }
+    if (dynamic_particles && !equilibrium_reached) {
+      trace_begin("population");
+      num_particles = update_population(config, step, num_particles);
+      trace_end("population");
+    }
+    if (status_enabled) {
+      output_start = std::chrono::steady_clock::now();
+    }
+    // The last step is always written when the run ends early.
+    if ((step % config->output_every) == 0 || equilibrium_reached) {
+      trace_begin("write output");
+      frames_written += write_output(num_particles, output_folder, step, config->dt) ? 1 : 0;
+      trace_end("write output");
+    }
+    if (config->render_every > 0 && ((step % config->render_every) == 0 || equilibrium_reached)) {
+      trace_begin("render frame");
+      write_frame(num_particles, output_folder, step);
+      trace_end("render frame");
+    }
+    trace_end("step");
+    if (tracing && step == (unsigned long) config->trace_last_step) {
+      write_timeline(output_folder);
+    }
+    if (status_enabled) {
+      end_phase(STATUS_PHASE_OUTPUT, output_start);
+      status_metrics.frames_written.store(frames_written, std::memory_order_relaxed);
+      if (stream_file >= 0) {
+        status_metrics.stream_queue_depth.store(frame_stream_queue_depth(), std::memory_order_relaxed);
+        status_metrics.frames_dropped.store(frame_stream_dropped(), std::memory_order_relaxed);
+      }
+      status_metrics.particles.store(num_particles, std::memory_order_relaxed);
+      status_metrics.step.store(step, std::memory_order_relaxed);
+    }
+
+    if (recorder.num_tracked > 0) {
+      if (recorder_dump_requested) {
+        recorder_dump_requested = 0;
+        write_flight_recorder(&recorder, "REQUEST", output_folder, step);
+      }
+      const long blown_up = find_blow_up(num_particles, particles, velocities, config->recorder_max_speed);
+      if (blown_up >= 0) {
+        std::cerr << "Particle " << blown_up << " blew up at step " << step
+                  << ", dumping the flight recorder" << std::endl;
+        write_flight_recorder(&recorder, "BLOWUP", output_folder, step);
+        termination = "BLOWUP";
+        exit_code = -1;
+        last_step = step;
+        break;
+      }
+    }
+    last_step = step;
+    if (equilibrium_reached) {
+      termination = "EQUILIBRIUM";
+      break;
+    }
+  }
+
+  // The run ended before the end of the timeline.
+  if (tracing && last_step < (unsigned long) config->trace_last_step) {
+    write_timeline(output_folder);
+  }
+
+  if (config->converge_every > 0) {
+    const double skipped_time = (max_steps - last_step) * config->dt;
+    if (last_step < max_steps && exit_code == 0) {
+      std::cout << "Equilibrium reached at step " << last_step << " (" << last_step * config->dt << " s), skipping "
+                << skipped_time << " s of simulated time" << std::endl;
+    }
+    const double kinetic_ratio = peak_kinetic_energy > 0 ? equilibrium.kinetic_energy / peak_kinetic_energy : 0;
+    write_termination(termination, last_step, last_step * config->dt, skipped_time, &equilibrium, kinetic_ratio,
+                      output_folder);
+  }
+
+  if (recorder.num_tracked > 0 && exit_code == 0) {
+    write_flight_recorder(&recorder, "EXIT", output_folder, last_step);
+  }
+
+  if (status_enabled) {
+    stop_status_server();
+  }
+
+  // The writer thread reads the frame buffers, so it stops before they are freed.
+  if (stream_file >= 0) {
+    stop_frame_stream();
   }
 
   // Free all memory resources and exit.
-  delete config;
   free_all();
-  return 0;
+  free_config(config);
+  delete config;
+  return exit_code;
 }
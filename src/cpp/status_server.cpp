@@ -0,0 +1,238 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "status_server.h"
+
+// Milliseconds the server waits for a connection before checking if it has to stop.
+#define STATUS_POLL_MS 200
+
+static std::thread server_thread;
+static std::atomic<bool> server_stopping(false);
+static std::vector<int> listeners;
+static std::string server_socket_path;
+
+/**
+ * Returns the resident memory of the process, in bytes, or 0 if it is not available.
+ */
+static uint64_t resident_bytes() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (!statm) {
+    return 0;
+  }
+  unsigned long pages = 0;
+  unsigned long resident = 0;
+  const int read = fscanf(statm, "%lu %lu", &pages, &resident);
+  fclose(statm);
+  return (read == 2) ? (uint64_t) resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+/**
+ * Formats the metrics as a JSON object, or as Prometheus text.
+ * elapsed is the wall time since the run started, used for the steps per second and the ETA.
+ */
+std::string format_status(const StatusMetrics *metrics, const double elapsed, const bool prometheus) {
+  static const char *phase_names[NUM_STATUS_PHASES] = { "contacts", "forces", "analysis", "integration",
+                                                                  "output" };
+  const uint64_t step = metrics->step.load(std::memory_order_relaxed);
+  const uint64_t max_steps = metrics->max_steps.load(std::memory_order_relaxed);
+  const double steps_per_second = (elapsed > 0) ? step / elapsed : 0;
+  const double eta = (steps_per_second > 0) ? (max_steps - step) / steps_per_second : -1;
+  const double simulated_time = step * metrics->dt.load(std::memory_order_relaxed);
+  const double total_time = max_steps * metrics->dt.load(std::memory_order_relaxed);
+
+  char text[2048];
+  int length;
+  if (prometheus) {
+    length = snprintf(text, sizeof(text),
+                      "# TYPE dpartint_step gauge\ndpartint_step %llu\n"
+                      "# TYPE dpartint_max_steps gauge\ndpartint_max_steps %llu\n"
+                      "# TYPE dpartint_simulated_seconds gauge\ndpartint_simulated_seconds %g\n"
+                      "# TYPE dpartint_steps_per_second gauge\ndpartint_steps_per_second %g\n"
+                      "# TYPE dpartint_eta_seconds gauge\ndpartint_eta_seconds %g\n"
+                      "# TYPE dpartint_particles gauge\ndpartint_particles %llu\n"
+                      "# TYPE dpartint_contacts gauge\ndpartint_contacts %llu\n"
+                      "# TYPE dpartint_arena_bytes gauge\ndpartint_arena_bytes %llu\n"
+                      "# TYPE dpartint_resident_bytes gauge\ndpartint_resident_bytes %llu\n"
+                      "# TYPE dpartint_frames_written_total counter\ndpartint_frames_written_total %llu\n"
+                      "# TYPE dpartint_stream_queue_depth gauge\ndpartint_stream_queue_depth %llu\n"
+                      "# TYPE dpartint_frames_dropped_total counter\ndpartint_frames_dropped_total %llu\n"
+                      "# TYPE dpartint_phase_seconds_total counter\n",
+                      (unsigned long long) step, (unsigned long long) max_steps, simulated_time, steps_per_second,
+                      eta, (unsigned long long) metrics->particles.load(std::memory_order_relaxed),
+                      (unsigned long long) metrics->contacts.load(std::memory_order_relaxed),
+                      (unsigned long long) metrics->arena_bytes.load(std::memory_order_relaxed),
+                      (unsigned long long) resident_bytes(),
+                      (unsigned long long) metrics->frames_written.load(std::memory_order_relaxed),
+                      (unsigned long long) metrics->stream_queue_depth.load(std::memory_order_relaxed),
+                      (unsigned long long) metrics->frames_dropped.load(std::memory_order_relaxed));
+    for (int phase = 0; phase < NUM_STATUS_PHASES; ++phase) {
+      length += snprintf(text + length, sizeof(text) - length, "dpartint_phase_seconds_total{phase=\"%s\"} %g\n",
+                         phase_names[phase], metrics->phase_seconds[phase].load(std::memory_order_relaxed));
+    }
+  } else {
+    length = snprintf(text, sizeof(text),
+                      "{\"step\": %llu, \"max_steps\": %llu, \"simulated_time\": %g, \"total_time\": %g, "
+                      "\"steps_per_second\": %g, \"eta_seconds\": %g, \"particles\": %llu, \"contacts\": %llu, "
+                      "\"memory\": {\"arena_bytes\": %llu, \"resident_bytes\": %llu}, \"frames_written\": %llu, "
+                      "\"stream_queue_depth\": %llu, \"frames_dropped\": %llu, \"phase_seconds\": {",
+                      (unsigned long long) step, (unsigned long long) max_steps, simulated_time, total_time,
+                      steps_per_second, eta, (unsigned long long) metrics->particles.load(std::memory_order_relaxed),
+                      (unsigned long long) metrics->contacts.load(std::memory_order_relaxed),
+                      (unsigned long long) metrics->arena_bytes.load(std::memory_order_relaxed),
+                      (unsigned long long) resident_bytes(),
+                      (unsigned long long) metrics->frames_written.load(std::memory_order_relaxed),
+                      (unsigned long long) metrics->stream_queue_depth.load(std::memory_order_relaxed),
+                      (unsigned long long) metrics->frames_dropped.load(std::memory_order_relaxed));
+    for (int phase = 0; phase < NUM_STATUS_PHASES; ++phase) {
+      length += snprintf(text + length, sizeof(text) - length, "%s\"%s\": %g", (phase > 0) ? ", " : "",
+                         phase_names[phase], metrics->phase_seconds[phase].load(std::memory_order_relaxed));
+    }
+    length += snprintf(text + length, sizeof(text) - length, "}}\n");
+  }
+  return std::string(text, length);
+}
+
+/**
+ * Reads the request line of one connection, and answers it.
+ */
+static void answer(const int connection, const StatusMetrics *metrics, const double elapsed) {
+  char request[1024];
+  struct pollfd ready = { connection, POLLIN, 0 };
+  ssize_t size = 0;
+  if (poll(&ready, 1, STATUS_POLL_MS) > 0) {
+    size = read(connection, request, sizeof(request) - 1);
+  }
+  request[size > 0 ? size : 0] = '\0';
+  const bool prometheus = strncmp(request, "GET /metrics", 12) == 0;
+
+  const std::string body = format_status(metrics, elapsed, prometheus);
+  char header[256];
+  const int header_size = snprintf(header, sizeof(header),
+                                   "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                                   prometheus ? "text/plain; version=0.0.4" : "application/json", body.size());
+  const std::string response = std::string(header, header_size) + body;
+  // MSG_NOSIGNAL: a client that hung up fails the send with EPIPE instead of killing the simulation with SIGPIPE.
+  size_t sent = 0;
+  while (sent < response.size()) {
+    const ssize_t written = send(connection, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      // EPIPE, ECONNRESET or any other error: drop this client.
+      break;
+    }
+    sent += written;
+  }
+  close(connection);
+}
+
+/**
+ * Server loop: waits for connections on every listener, one at a time, until stopped.
+ */
+static void serve(const StatusMetrics *metrics) {
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<struct pollfd> polled;
+  for (const int listener : listeners) {
+    polled.push_back({ listener, POLLIN, 0 });
+  }
+  while (!server_stopping.load(std::memory_order_relaxed)) {
+    if (poll(polled.data(), polled.size(), STATUS_POLL_MS) <= 0) {
+      continue;
+    }
+    for (const struct pollfd &listener : polled) {
+      if (!(listener.revents & POLLIN)) {
+        continue;
+      }
+      const int connection = accept(listener.fd, NULL, NULL);
+      if (connection >= 0) {
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        answer(connection, metrics, elapsed);
+      }
+    }
+  }
+}
+
+/**
+ * Starts the server thread, answering HTTP requests on a Unix domain socket (if socket_path is not empty)
+ * and on a localhost TCP port (if port is positive). /metrics returns Prometheus text, any other path JSON.
+ * Returns 0 on success.
+ */
+int start_status_server(StatusMetrics *metrics, const std::string &socket_path, const int port) {
+  if (!socket_path.empty()) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+      std::cerr << "The status socket path is too long: " << socket_path << std::endl;
+      return -1;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+    unlink(socket_path.c_str());
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listener, 8) != 0) {
+      std::cerr << "Could not listen on " << socket_path << std::endl;
+      if (listener >= 0) {
+        close(listener);
+      }
+      return -1;
+    }
+    listeners.push_back(listener);
+    server_socket_path = socket_path;
+  }
+
+  if (port > 0) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int listener = socket(AF_INET, SOCK_STREAM, 0);
+    const int reuse = 1;
+    if (listener >= 0) {
+      setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+    if (listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listener, 8) != 0) {
+      std::cerr << "Could not listen on 127.0.0.1:" << port << std::endl;
+      if (listener >= 0) {
+        close(listener);
+      }
+      stop_status_server();
+      return -1;
+    }
+    listeners.push_back(listener);
+  }
+
+  server_stopping.store(false);
+  server_thread = std::thread(serve, metrics);
+  return 0;
+}
+
+/**
+ * Stops the server thread, and removes the Unix domain socket.
+ */
+void stop_status_server() {
+  server_stopping.store(true);
+  if (server_thread.joinable()) {
+    server_thread.join();
+  }
+  for (const int listener : listeners) {
+    close(listener);
+  }
+  listeners.clear();
+  if (!server_socket_path.empty()) {
+    unlink(server_socket_path.c_str());
+    server_socket_path.clear();
+  }
+}
@@ -0,0 +1,518 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+extern "C" {
+  #include "frame_store.h"
+}
+
+/**
+ * One particles CSV file of a run, and where its rows go in the store.
+ */
+struct FrameFile {
+  std::string path;
+  FrameKind kind;
+  uint64_t step;
+  size_t num_rows;
+  size_t first_row;
+};
+
+/**
+ * Reads a whole file. Returns false if it could not be read.
+ */
+static bool read_file(const std::string &path, std::string &contents) {
+  const int file = open(path.c_str(), O_RDONLY);
+  if (file < 0) {
+    return false;
+  }
+  contents.clear();
+  char chunk[1 << 16];
+  ssize_t read_bytes;
+  while ((read_bytes = read(file, chunk, sizeof(chunk))) > 0) {
+    contents.append(chunk, read_bytes);
+  }
+  close(file);
+  return read_bytes == 0;
+}
+
+/**
+ * Returns true if the line at position has only blanks before its end.
+ */
+static bool blank_line(const char *position, const char *end) {
+  while (position < end && *position != '\n') {
+    if (*position != ' ' && *position != '\r' && *position != '\t') {
+      return false;
+    }
+    position++;
+  }
+  return true;
+}
+
+/**
+ * Returns the position after the end of the line at position.
+ */
+static const char *next_line(const char *position, const char *end) {
+  const char *line_end = (const char*) memchr(position, '\n', end - position);
+  return line_end ? line_end + 1 : end;
+}
+
+/**
+ * Returns the number of data rows of a CSV file: its lines without the header, skipping the blank ones
+ * like ingest_frame does.
+ */
+static size_t count_rows(const std::string &contents) {
+  const char *end = contents.data() + contents.size();
+  const char *position = next_line(contents.data(), end);
+  size_t rows = 0;
+  while (position < end) {
+    if (!blank_line(position, end)) {
+      rows += 1;
+    }
+    position = next_line(position, end);
+  }
+  return rows;
+}
+
+/**
+ * If name is prefix followed by only digits, stores them in step and returns true.
+ */
+static bool parse_step(const char *name, const char *prefix, uint64_t *step) {
+  const size_t prefix_length = strlen(prefix);
+  if (strncmp(name, prefix, prefix_length) != 0 || name[prefix_length] == '\0') {
+    return false;
+  }
+  char *end;
+  *step = strtoull(name + prefix_length, &end, 10);
+  return *end == '\0';
+}
+
+/**
+ * Lists the particles CSV files of the folder, of both kinds, sorted by kind and step.
+ */
+static std::vector<FrameFile> list_frame_files(const std::string &folder) {
+  std::vector<FrameFile> files;
+  DIR *directory = opendir(folder.c_str());
+  if (!directory) {
+    return files;
+  }
+  for (struct dirent *entry = readdir(directory); entry; entry = readdir(directory)) {
+    uint64_t step;
+    if (parse_step(entry->d_name, "2DPartInt-Out.csv.", &step)) {
+      files.push_back({ folder + "/" + entry->d_name, FRAME_KIND_OUT, step, 0, 0 });
+    } else if (parse_step(entry->d_name, "2DPartInt-Out-FROM-GRID.csv.", &step)) {
+      files.push_back({ folder + "/" + entry->d_name, FRAME_KIND_FROM_GRID, step, 0, 0 });
+    }
+  }
+  closedir(directory);
+  std::sort(files.begin(), files.end(), [](const FrameFile &a, const FrameFile &b) {
+    return (a.kind != b.kind) ? a.kind < b.kind : a.step < b.step;
+  });
+  return files;
+}
+
+/**
+ * Parses the comma separated numbers of one row into values, up to max_values.
+ * Returns the number of values parsed, and moves position to the next row.
+ */
+static int parse_row(const char **position, const char *end, double *values, const int max_values) {
+  int count = 0;
+  const char *cursor = *position;
+  while (cursor < end && *cursor != '\n') {
+    char *number_end;
+    const double value = strtod(cursor, &number_end);
+    if (number_end == cursor) {
+      break;
+    }
+    if (count < max_values) {
+      values[count] = value;
+    }
+    count++;
+    cursor = number_end;
+    while (cursor < end && (*cursor == ',' || *cursor == ' ' || *cursor == '\r')) {
+      cursor++;
+    }
+  }
+  while (cursor < end && *cursor != '\n') {
+    cursor++;
+  }
+  *position = (cursor < end) ? cursor + 1 : end;
+  return count;
+}
+
+/**
+ * Parses the rows of one frame into the columns of the store, and fills its index entry.
+ * The blank lines are skipped, like count_rows does. Without an id column the id of each row is its index,
+ * the particle index, except for the frames written from the grid, whose rows follow the grid order.
+ * The bounding box leaves out the removed particles (radius 0), which the window query skips.
+ */
+static void ingest_frame(const FrameFile &file, const std::string &contents, char *data,
+                         const FrameStoreHeader *header, FrameEntry *frame) {
+  double *x = (double*) (data + header->x_offset) + file.first_row;
+  double *y = (double*) (data + header->y_offset) + file.first_row;
+  double *radius = (double*) (data + header->radius_offset) + file.first_row;
+  uint64_t *ids = (uint64_t*) (data + header->id_offset) + file.first_row;
+
+  const char *position = contents.data();
+  const char *end = position + contents.size();
+  const char *header_end = (const char*) memchr(position, '\n', contents.size());
+  const bool with_ids = header_end && std::string(position, header_end).find(", id") != std::string::npos;
+  position = header_end ? header_end + 1 : end;
+
+  frame->step = file.step;
+  frame->first_row = file.first_row;
+  frame->num_rows = file.num_rows;
+  frame->kind = file.kind;
+  frame->flags = with_ids ? FRAME_IDS_FROM_FILE : 0;
+  frame->min_x = INFINITY;
+  frame->min_y = INFINITY;
+  frame->max_x = -INFINITY;
+  frame->max_y = -INFINITY;
+  bool sorted = file.kind == FRAME_KIND_OUT;
+  size_t line = 1;
+  for (size_t row = 0; row < file.num_rows; ++row) {
+    line += 1;
+    while (position < end && blank_line(position, end)) {
+      position = next_line(position, end);
+      line += 1;
+    }
+    // x, y, z, radius and id.
+    double values[5] = { NAN, NAN, 0, NAN, NAN };
+    const int count = parse_row(&position, end, values, 5);
+    if (count < 4) {
+      std::cerr << "Malformed row " << line << " of " << file.path << std::endl;
+    }
+    x[row] = values[0];
+    y[row] = values[1];
+    radius[row] = values[3];
+    if (with_ids) {
+      ids[row] = (count >= 5) ? (uint64_t) values[4] : FRAME_NO_ID;
+    } else {
+      ids[row] = (file.kind == FRAME_KIND_OUT) ? row : FRAME_NO_ID;
+    }
+    sorted = sorted && (row == 0 || ids[row - 1] < ids[row]);
+    if (radius[row] > 0) {
+      frame->min_x = std::min(frame->min_x, x[row]);
+      frame->min_y = std::min(frame->min_y, y[row]);
+      frame->max_x = std::max(frame->max_x, x[row]);
+      frame->max_y = std::max(frame->max_y, y[row]);
+    }
+  }
+  if (sorted) {
+    frame->flags |= FRAME_IDS_SORTED;
+  }
+}
+
+/**
+ * Reads the squares of the 2DPartInt-Out-GRID.csv file of the folder, if there is one.
+ */
+static std::vector<StoredSquare> read_grid(const std::string &folder) {
+  std::vector<StoredSquare> squares;
+  std::string contents;
+  if (!read_file(folder + "/2DPartInt-Out-GRID.csv", contents)) {
+    return squares;
+  }
+  const char *position = contents.data();
+  const char *end = position + contents.size();
+  double values[3];
+  parse_row(&position, end, values, 0); // Header.
+  while (position < end) {
+    if (parse_row(&position, end, values, 3) == 3) {
+      squares.push_back({ values[0], values[1], values[2] });
+    }
+  }
+  return squares;
+}
+
+/**
+ * Converts the particles CSV files of a run folder into a store file.
+ * The rows of each file are counted first, in parallel, so every file is then parsed, also in parallel,
+ * straight into its place in the mapped output file, and only the files being read are held in memory.
+ */
+static int ingest(const std::string &folder, const char *store_path) {
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<FrameFile> files = list_frame_files(folder);
+  if (files.empty()) {
+    std::cerr << "No particles CSV files in " << folder << std::endl;
+    return -1;
+  }
+
+  bool failed = false;
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < files.size(); ++i) {
+    std::string contents;
+    if (!read_file(files[i].path, contents)) {
+      #pragma omp critical
+      {
+        std::cerr << "Could not read " << files[i].path << std::endl;
+        failed = true;
+      }
+    }
+    files[i].num_rows = count_rows(contents);
+  }
+  if (failed) {
+    return -1;
+  }
+  size_t num_rows = 0;
+  for (FrameFile &file : files) {
+    file.first_row = num_rows;
+    num_rows += file.num_rows;
+  }
+  const std::vector<StoredSquare> squares = read_grid(folder);
+
+  FrameStoreHeader header;
+  const size_t size = frame_store_layout(files.size(), num_rows, squares.size(), &header);
+  const int output = open(store_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (output < 0 || ftruncate(output, size) != 0) {
+    std::cerr << "Could not create " << store_path << std::endl;
+    if (output >= 0) {
+      close(output);
+    }
+    return -1;
+  }
+  char *data = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, output, 0);
+  close(output);
+  if (data == MAP_FAILED) {
+    std::cerr << "Could not map " << store_path << std::endl;
+    return -1;
+  }
+
+  FrameEntry *frames = (FrameEntry*) (data + header.frames_offset);
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < files.size(); ++i) {
+    std::string contents;
+    read_file(files[i].path, contents);
+    ingest_frame(files[i], contents, data, &header, &frames[i]);
+  }
+  if (!squares.empty()) {
+    memcpy(data + header.squares_offset, squares.data(), squares.size() * sizeof(StoredSquare));
+  }
+  // The header goes last, so an interrupted ingest leaves an invalid file.
+  memcpy(data, &header, sizeof(header));
+  munmap(data, size);
+
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "Ingested " << files.size() << " frames, " << num_rows << " rows and "
+            << squares.size() << " grid squares in " << seconds << " s" << std::endl;
+  return 0;
+}
+
+/**
+ * Prints a number with the fewest significant digits that read back the same value.
+ */
+static void print_number(const double value) {
+  char text[32];
+  for (int digits = 6; digits <= 17; ++digits) {
+    snprintf(text, sizeof(text), "%.*g", digits, value);
+    if (strtod(text, NULL) == value) {
+      break;
+    }
+  }
+  fputs(text, stdout);
+}
+
+/**
+ * Prints one row of a frame: "step, id, x, y, radius".
+ */
+static void print_row(const FrameStore *store, const FrameEntry *frame, const size_t row) {
+  printf("%llu, ", (unsigned long long) frame->step);
+  if (store->ids[row] == FRAME_NO_ID) {
+    fputs("-1", stdout);
+  } else {
+    printf("%llu", (unsigned long long) store->ids[row]);
+  }
+  fputs(", ", stdout);
+  print_number(store->x[row]);
+  fputs(", ", stdout);
+  print_number(store->y[row]);
+  fputs(", ", stdout);
+  print_number(store->radius[row]);
+  fputc('\n', stdout);
+}
+
+/**
+ * Parses the whole text as an unsigned integer into value. Returns false if it is not one.
+ */
+static bool parse_unsigned(const std::string &text, uint64_t *value) {
+  if (text.empty() || !isdigit((unsigned char) text[0])) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  *value = strtoull(text.c_str(), &end, 10);
+  return *end == '\0' && errno == 0;
+}
+
+/**
+ * Parses the whole text as a number into value. Returns false if it is not one.
+ */
+static bool parse_number(const std::string &text, double *value) {
+  char *end;
+  *value = strtod(text.c_str(), &end);
+  return !text.empty() && *end == '\0';
+}
+
+/**
+ * Prints the usage of the tool.
+ */
+static void print_usage() {
+  std::cerr << "Usage:" << std::endl
+            << "  2DpartIntStore ingest [output_folder] [store_file]" << std::endl
+            << "  2DpartIntStore frames [store_file] [first_step] [last_step]" << std::endl
+            << "  2DpartIntStore particle [store_file] [id] [first_step] [last_step]" << std::endl
+            << "  2DpartIntStore window [store_file] [x_min] [y_min] [x_max] [y_max] [first_step] [last_step]" << std::endl
+            << "  2DpartIntStore grid [store_file]" << std::endl
+            << "The steps are optional. Add --from-grid after the command to query the FROM-GRID frames." << std::endl;
+}
+
+/**
+ * Tool entry point. Ingests a run folder, or answers one query on a store file, as CSV on the standard output.
+ */
+int main(int argc, char *argv[]) {
+  std::vector<std::string> args(argv + 1, argv + argc);
+  FrameKind kind = FRAME_KIND_OUT;
+  if (args.size() > 1 && args[1] == "--from-grid") {
+    kind = FRAME_KIND_FROM_GRID;
+    args.erase(args.begin() + 1);
+  }
+  if (args.size() < 2) {
+    print_usage();
+    return -1;
+  }
+  const std::string &command = args[0];
+  if (command == "ingest") {
+    if (args.size() != 3) {
+      print_usage();
+      return -1;
+    }
+    return ingest(args[1], args[2].c_str());
+  }
+
+  FrameStore store;
+  if (frame_store_open(args[1].c_str(), &store) != 0) {
+    std::cerr << "Could not open the store " << args[1] << std::endl;
+    return -1;
+  }
+
+  // Commands, with their arguments before the optional step range.
+  size_t num_arguments;
+  if (command == "frames" || command == "grid") {
+    num_arguments = 2;
+  } else if (command == "particle") {
+    num_arguments = 3;
+  } else if (command == "window") {
+    num_arguments = 6;
+  } else {
+    print_usage();
+    frame_store_close(&store);
+    return -1;
+  }
+  // The particle id or the window corners, then the step range.
+  uint64_t id = 0;
+  double window[4] = { 0, 0, 0, 0 };
+  uint64_t first_step = 0;
+  uint64_t last_step = UINT64_MAX;
+  bool valid = args.size() >= num_arguments && args.size() <= num_arguments + 2;
+  if (valid && command == "particle") {
+    valid = parse_unsigned(args[2], &id);
+  } else if (valid && command == "window") {
+    for (int i = 0; i < 4 && valid; ++i) {
+      valid = parse_number(args[2 + i], &window[i]);
+    }
+  }
+  if (valid && args.size() > num_arguments) {
+    valid = parse_unsigned(args[num_arguments], &first_step);
+  }
+  if (valid && args.size() > num_arguments + 1) {
+    valid = parse_unsigned(args[num_arguments + 1], &last_step);
+  }
+  if (!valid) {
+    print_usage();
+    frame_store_close(&store);
+    return -1;
+  }
+  const size_t first_frame = frame_store_find_step(&store, kind, first_step);
+  const size_t num_frames = store.header->num_frames;
+
+  if (command == "frames") {
+    printf("step, kind, rows, min x, min y, max x, max y\n");
+    for (size_t i = first_frame; i < num_frames && store.frames[i].kind == (uint32_t) kind
+         && store.frames[i].step <= last_step; ++i) {
+      const FrameEntry *frame = &store.frames[i];
+      printf("%llu, %s, %llu, ", (unsigned long long) frame->step, (kind == FRAME_KIND_OUT) ? "out" : "from-grid",
+             (unsigned long long) frame->num_rows);
+      print_number(frame->min_x);
+      fputs(", ", stdout);
+      print_number(frame->min_y);
+      fputs(", ", stdout);
+      print_number(frame->max_x);
+      fputs(", ", stdout);
+      print_number(frame->max_y);
+      fputc('\n', stdout);
+    }
+  } else if (command == "grid") {
+    printf("x coord, y coord, length\n");
+    for (size_t i = 0; i < store.header->num_squares; ++i) {
+      print_number(store.squares[i].x);
+      fputs(", ", stdout);
+      print_number(store.squares[i].y);
+      fputs(", ", stdout);
+      print_number(store.squares[i].length);
+      fputc('\n', stdout);
+    }
+  } else if (command == "particle") {
+    // The FROM-GRID frames without an id column are in grid order, so their rows have no id to look up.
+    for (size_t i = first_frame; i < num_frames && store.frames[i].kind == (uint32_t) kind
+         && store.frames[i].step <= last_step; ++i) {
+      if (!(store.frames[i].flags & FRAME_IDS_FROM_FILE) && kind == FRAME_KIND_FROM_GRID) {
+        std::cerr << "The FROM-GRID frame of step " << store.frames[i].step
+                  << " has no id column, so its particles cannot be found by id" << std::endl;
+        frame_store_close(&store);
+        return -1;
+      }
+    }
+    printf("step, id, x coord, y coord, radius\n");
+    for (size_t i = first_frame; i < num_frames && store.frames[i].kind == (uint32_t) kind
+         && store.frames[i].step <= last_step; ++i) {
+      const size_t row = frame_store_find_particle(&store, &store.frames[i], id);
+      if (row != SIZE_MAX) {
+        print_row(&store, &store.frames[i], row);
+      }
+    }
+  } else {
+    const double x_min = window[0];
+    const double y_min = window[1];
+    const double x_max = window[2];
+    const double y_max = window[3];
+    printf("step, id, x coord, y coord, radius\n");
+    for (size_t i = first_frame; i < num_frames && store.frames[i].kind == (uint32_t) kind
+         && store.frames[i].step <= last_step; ++i) {
+      const FrameEntry *frame = &store.frames[i];
+      // Skip the frames whose particles are all outside the window.
+      if (frame->max_x < x_min || frame->min_x > x_max || frame->max_y < y_min || frame->min_y > y_max) {
+        continue;
+      }
+      for (size_t row = frame->first_row; row < frame->first_row + frame->num_rows; ++row) {
+        // The removed particles (radius 0) are not in the window.
+        if (store.radius[row] > 0 && store.x[row] >= x_min && store.x[row] <= x_max
+            && store.y[row] >= y_min && store.y[row] <= y_max) {
+          print_row(&store, frame, row);
+        }
+      }
+    }
+  }
+
+  frame_store_close(&store);
+  return 0;
+}
@@ -1,11 +1,30 @@
 #include <math.h>
+#include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "data.h"
 #include "functions.h"
+#include "forces_simd.h"
+#include "analysis.h"
+#include "flight_recorder.h"
+#include "population.h"
+#include "collisions.h"
+#include "frame_store.h"
+#include "bed_cache.h"
+#include "spatial_query.h"
+#include "fields.h"
+#include "png.h"
+#include "render.h"
+#include "tracer.h"
 
 // Maximum acceptable error when comparing double values.
+#ifdef USE_FLOAT
+// Single precision builds only carry about seven significant digits.
+#define TOLERANCE 0.0005d
+#else
 #define TOLERANCE 0.00005d
+#endif
 
 // Terminal color constants.
 #define RED   "\033[1;31m"
@@ -48,10 +67,8 @@ void test_compute_forces_one_contact() {
   #define size 2
   #define contacts_size 1
 
-  ParticleProperties properties[size] = {
-    { 0.049, 247435.829652697, 19033.5253578998 },
-    { 0.049, 247435.829652697, 19033.5253578998 }
-  };
+  const Material materials[1] = { { 0.049, 247435.829652697, 19033.5253578998, 1 / 0.049 } };
+  const MaterialId material_ids[size] = { 0, 0 };
   Particle particles[size] = {
     { 24.9999428493601, 25, 50 , NULL, 0},
     { 24.7762980060664, 74.6253249615872, 50, NULL, 1 }
@@ -72,7 +89,10 @@ void test_compute_forces_one_contact() {
   Contact contacts[contacts_size] = { { 0, 1, 42.9554 } };
   Vector resultant_forces[size] = { { 0 } };
 
-  compute_forces(dt, size, contacts_size, particles, properties, contacts,
+  ContactLawParams params;
+  init_contact_law_params(30, 0, 0, 0, &params);
+
+  compute_forces(CONTACT_LAW_LINEAR, &params, dt, size, contacts_size, particles, materials, material_ids, contacts,
                  velocities, normal_forces, tangent_forces, resultant_forces);
 
   // P1.
@@ -98,13 +118,8 @@ void test_compute_forces_multiple_contacts() {
   #define size 9
   #define contacts_size 3
 
-  ParticleProperties properties[size] = {
-    { 0.049, 247435.829652697, 19033.5253578998 }, { 0.049, 247435.829652697, 19033.5253578998 },
-    { 0.049, 247435.829652697, 19033.5253578998 }, { 0.049, 247435.829652697, 19033.5253578998 },
-    { 0.049, 247435.829652697, 19033.5253578998 }, { 0.049, 247435.829652697, 19033.5253578998 },
-    { 0.049, 247435.829652697, 19033.5253578998 }, { 0.049, 247435.829652697, 19033.5253578998 },
-    { 0.049, 247435.829652697, 19033.5253578998 }
-  };
+  const Material materials[1] = { { 0.049, 247435.829652697, 19033.5253578998, 1 / 0.049 } };
+  const MaterialId material_ids[size] = { 0 };
   Particle particles[size] = {
     { 24.9996682317, 25, 50, NULL, 0}, { 24.3329247490, 74.1788246441, 50, NULL, 1 },
     { 20.8181703235, 122.9449251651, 50, NULL, 2 }, { 16.8606509998, 172.4918861911, 50, NULL, 3 },
@@ -148,7 +163,10 @@ void test_compute_forces_multiple_contacts() {
   };
   Vector resultant_forces[size] = { { 0 } };
 
-  compute_forces(dt, size, contacts_size, particles, properties, contacts,
+  ContactLawParams params;
+  init_contact_law_params(30, 0, 0, 0, &params);
+
+  compute_forces(CONTACT_LAW_LINEAR, &params, dt, size, contacts_size, particles, materials, material_ids, contacts,
                  velocities, normal_forces, tangent_forces, resultant_forces);
 
   // P2.
@@ -184,15 +202,897 @@ void test_compute_forces_multiple_contacts() {
 }
 
 /**
- * Checks that the compute_acceleration function works for arrays of one element.
+ * Checks that the vectorized contact force kernels give the same results as compute_forces,
+ * for every instruction set the CPU supports.
+ * Uses enough contacts to fill several vectors plus a remainder, some of them in tension.
+ */
+void test_compute_forces_simd_matches_scalar() {
+  #define size 16
+  #define contacts_size (size * (size - 1))
+
+  const Material materials[1] = { { 0.049, 247435.829652697, 19033.5253578998, 1 / 0.049 } };
+  const MaterialId material_ids[size] = { 0 };
+  Particle particles[size];
+  Vector velocities[size];
+  Contact contacts[contacts_size];
+  double initial_normal[size * size] = { 0 };
+  double initial_tangent[size * size] = { 0 };
+  double expected_normal[size * size] = { 0 };
+  double expected_tangent[size * size] = { 0 };
+  Vector expected_forces[size] = { { 0 } };
+
+  size_t k = 0;
+  for (size_t i = 0; i < size; ++i) {
+    particles[i] = (Particle) { (i % 4) * 95.0 + (i % 3), (i / 4) * 97.0 - (i % 5), 50, NULL, i };
+    velocities[i] = (Vector) { (double) (i % 7) - 3.0, (double) (i % 5) - 2.0 };
+    for (size_t j = 0; j < size; ++j) {
+      if (i == j) continue;
+      contacts[k++] = (Contact) { i, j, 0 };
+      initial_normal[(i * size) + j] = (double) ((i + 2 * j) % 11) - 3.0;
+      initial_tangent[(i * size) + j] = (double) ((3 * i + j) % 13) - 6.0;
+    }
+  }
+
+  const double dt = 0.000025;
+  ContactLawParams params;
+  init_contact_law_params(30, 0, 0, 0, &params);
+  const SimdLevel detected = detect_simd_level();
+  for (int level = SIMD_NONE; level <= (int) detected; ++level) {
+    double normal_forces[size * size];
+    double tangent_forces[size * size];
+    Vector forces[size] = { { 0 } };
+    for (size_t i = 0; i < size * size; ++i) {
+      normal_forces[i] = initial_normal[i];
+      tangent_forces[i] = initial_tangent[i];
+    }
+
+    compute_forces_simd((SimdLevel) level, CONTACT_LAW_LINEAR, &params, dt, size, contacts_size, particles, materials, material_ids, contacts,
+                        velocities, normal_forces, tangent_forces, forces);
+
+    if (level == SIMD_NONE) {
+      // The scalar kernel is the reference for the vectorized ones.
+      for (size_t i = 0; i < size * size; ++i) {
+        expected_normal[i] = normal_forces[i];
+        expected_tangent[i] = tangent_forces[i];
+      }
+      for (size_t i = 0; i < size; ++i) {
+        expected_forces[i] = forces[i];
+      }
+      continue;
+    }
+
+    for (size_t i = 0; i < size; ++i) {
+      for_assert(forces[i].x_component, expected_forces[i].x_component, "test_compute_forces_simd_matches_scalar - forces.x_component", level * 100 + i);
+      for_assert(forces[i].y_component, expected_forces[i].y_component, "test_compute_forces_simd_matches_scalar - forces.y_component", level * 100 + i);
+    }
+    for (size_t i = 0; i < size * size; ++i) {
+      for_assert(normal_forces[i], expected_normal[i], "test_compute_forces_simd_matches_scalar - normal_forces", level * 1000 + i);
+      for_assert(tangent_forces[i], expected_tangent[i], "test_compute_forces_simd_matches_scalar - tangent_forces", level * 1000 + i);
+    }
+  }
+
+  #undef size
+  #undef contacts_size
+}
+
+/**
+ * Checks that compute_forces_grouped gives exactly the same forces as compute_forces,
+ * with the contacts in an order not grouped by particle, so the sums have to keep the order of the contact list.
+ */
+void test_compute_forces_grouped_matches_serial() {
+  #define size 16
+  #define contacts_size (size * (size - 1))
+
+  const Material materials[1] = { { 0.049, 247435.829652697, 19033.5253578998, 1 / 0.049 } };
+  const MaterialId material_ids[size] = { 0 };
+  Particle particles[size];
+  Vector velocities[size];
+  Contact contacts[contacts_size];
+  double normal_forces[size * size] = { 0 };
+  double tangent_forces[size * size] = { 0 };
+  double grouped_normal[size * size] = { 0 };
+  double grouped_tangent[size * size] = { 0 };
+  Vector forces[size] = { { 0 } };
+  Vector grouped_forces[size] = { { 0 } };
+  size_t contact_offsets[size + 1];
+  size_t contact_order[contacts_size];
+
+  for (size_t i = 0; i < size; ++i) {
+    particles[i] = (Particle) { (i % 4) * 95.0 + (i % 3), (i / 4) * 97.0 - (i % 5), 50, NULL, i };
+    velocities[i] = (Vector) { (double) (i % 7) - 3.0, (double) (i % 5) - 2.0 };
+  }
+  // Contact k is the pair 7k + 3 (modulo the number of pairs), so consecutive contacts hit different particles.
+  size_t k = 0;
+  for (size_t pair = 0; pair < contacts_size; ++pair) {
+    const size_t shuffled = (pair * 7 + 3) % contacts_size;
+    const size_t i = shuffled / (size - 1);
+    const size_t j = shuffled % (size - 1);
+    contacts[k++] = (Contact) { i, (j < i) ? j : j + 1, 0 };
+  }
+  for (size_t i = 0; i < size * size; ++i) {
+    normal_forces[i] = grouped_normal[i] = (double) (i % 11) - 3.0;
+    tangent_forces[i] = grouped_tangent[i] = (double) (i % 13) - 6.0;
+  }
+
+  const double dt = 0.000025;
+  ContactLawParams params;
+  init_contact_law_params(30, 0, 0, 0, &params);
+  compute_forces(CONTACT_LAW_LINEAR, &params, dt, size, contacts_size, particles, materials, material_ids, contacts,
+                 velocities, normal_forces, tangent_forces, forces);
+  group_contacts(size, contacts_size, contacts, contact_offsets, contact_order);
+  compute_forces_grouped(CONTACT_LAW_LINEAR, &params, dt, size, particles, materials, material_ids, contacts,
+                         contact_offsets, contact_order, velocities, grouped_normal, grouped_tangent, grouped_forces);
+
+  assert(contact_offsets[size], contacts_size, "test_compute_forces_grouped_matches_serial - contact_offsets[size]");
+  for (size_t i = 0; i < size; ++i) {
+    // Compared exactly, not within the tolerance.
+    for_assert(grouped_forces[i].x_component == forces[i].x_component, 1, "test_compute_forces_grouped_matches_serial - forces.x_component", i);
+    for_assert(grouped_forces[i].y_component == forces[i].y_component, 1, "test_compute_forces_grouped_matches_serial - forces.y_component", i);
+  }
+  for (size_t i = 0; i < size * size; ++i) {
+    for_assert(grouped_normal[i] == normal_forces[i], 1, "test_compute_forces_grouped_matches_serial - normal_forces", i);
+    for_assert(grouped_tangent[i] == tangent_forces[i], 1, "test_compute_forces_grouped_matches_serial - tangent_forces", i);
+  }
+
+  #undef size
+  #undef contacts_size
+}
+
+/**
+ * Checks that two particles of different materials push each other with equal and opposite forces,
+ * with the scalar kernel and every vectorized one the CPU supports, since both use the rigidity of the pair.
+ */
+void test_compute_forces_different_materials_opposite() {
+  #define size 2
+  #define contacts_size 2
+
+  const Material materials[2] = {
+    { 0.049, 247435.829652697, 19033.5253578998, 1 / 0.049 },
+    { 0.12, 61858.957413174, 4758.38133947495, 1 / 0.12 }
+  };
+  const MaterialId material_ids[size] = { 0, 1 };
+  const Particle particles[size] = { { 0, 0, 50, NULL, 0 }, { 80, 30, 40, NULL, 1 } };
+  const Vector velocities[size] = { { 3, -1 }, { -2, 4 } };
+  const Contact contacts[contacts_size] = { { 0, 1, 0 }, { 1, 0, 0 } };
+
+  const double dt = 0.000025;
+  ContactLawParams params;
+  init_contact_law_params(30, 0, 0, 0, &params);
+  const SimdLevel detected = detect_simd_level();
+  for (int level = SIMD_NONE; level <= (int) detected; ++level) {
+    double normal_forces[size * size] = { 0 };
+    double tangent_forces[size * size] = { 0 };
+    Vector forces[size] = { { 0 } };
+    compute_forces_simd((SimdLevel) level, CONTACT_LAW_LINEAR, &params, dt, size, contacts_size, particles, materials,
+                        material_ids, contacts, velocities, normal_forces, tangent_forces, forces);
+
+    for_assert(forces[0].x_component != 0, 1, "test_compute_forces_different_materials_opposite - forces.x_component", level);
+    for_assert(forces[0].x_component == -forces[1].x_component, 1, "test_compute_forces_different_materials_opposite - x equal and opposite", level);
+    for_assert(forces[0].y_component == -forces[1].y_component, 1, "test_compute_forces_different_materials_opposite - y equal and opposite", level);
+    for_assert(normal_forces[1] == normal_forces[size], 1, "test_compute_forces_different_materials_opposite - normal history", level);
+  }
+
+  #undef size
+  #undef contacts_size
+}
+
+/**
+ * Checks the local damping against the net force, gravity included, the viscous damping against the velocity,
+ * and that the removed particles are left alone.
+ */
+void test_damp_forces() {
+  #define size 2
+  Particle particles[size] = { { 0, 50, 50, NULL, 0 }, { 200, 50, 0, NULL, 1 } };
+  const Material materials[1] = { { 1, 0, 0, 1 } };
+  const MaterialId material_ids[size] = { 0 };
+  const Vector velocities[size] = { { 1, -1 }, { 1, -1 } };
+  Vector local_forces[size] = { { 2, 0 }, { 2, 0 } };
+  Vector viscous_forces[size] = { { 0, 0 }, { 0, 0 } };
+
+  damp_forces(DAMPING_LOCAL, 0.5, size, particles, materials, material_ids, velocities, local_forces);
+  damp_forces(DAMPING_VISCOUS, 2, size, particles, materials, material_ids, velocities, viscous_forces);
+
+  assert(local_forces[0].x_component, 1.0d, "test_damp_forces - local x_component");
+  assert(local_forces[0].y_component, 0.5 * GRAVITY, "test_damp_forces - local y_component");
+  assert(local_forces[1].x_component, 2.0d, "test_damp_forces - removed x_component");
+  assert(viscous_forces[0].x_component, -2.0d, "test_damp_forces - viscous x_component");
+  assert(viscous_forces[0].y_component, 2.0d, "test_damp_forces - viscous y_component");
+  assert(viscous_forces[1].y_component, 0.0d, "test_damp_forces - removed y_component");
+  #undef size
+}
+
+/**
+ * Checks that compute_wall_forces pushes a particle out of a wall,
+ * with the friction opposing its tangential velocity.
+ */
+void test_compute_wall_forces_one_contact() {
+  const Material materials[1] = { { 1, 1000, 100, 1 } };
+  const MaterialId material_ids[1] = { 0 };
+  Particle particles[1] = { { 20, 40, 50, NULL, 0 } };
+  Vector velocities[1] = { { 2, -1 } };
+  Wall walls[1] = { { -100, 0, 100, 0 } };
+  WallContact wall_contacts[1] = { { 0, 0, 0 } };
+  double wall_normal_forces[1] = { 0 };
+  double wall_tangent_forces[1] = { 0 };
+  Vector forces[1] = { { 0 } };
+
+  ContactLawParams params;
+  init_contact_law_params(30, 0, 0, 0, &params);
+
+  wall_contacts[0].overlap = compute_wall_overlap(&particles[0], &walls[0]);
+  compute_wall_forces(CONTACT_LAW_LINEAR, &params, 0.01, 1, 1, particles, materials, material_ids, walls, wall_contacts,
+                      velocities, wall_normal_forces, wall_tangent_forces, forces);
+
+  assert(wall_contacts[0].overlap, 10.0d, "test_compute_wall_forces_one_contact - overlap");
+  assert(wall_normal_forces[0], 10.0d, "test_compute_wall_forces_one_contact - wall_normal_forces");
+  assert(wall_tangent_forces[0], -2.0d, "test_compute_wall_forces_one_contact - wall_tangent_forces");
+  assert(forces[0].x_component, -2.0d, "test_compute_wall_forces_one_contact - forces.x_component");
+  assert(forces[0].y_component, 10.0d, "test_compute_wall_forces_one_contact - forces.y_component");
+}
+
+/**
+ * Checks the forces of the damped and Hertz-Mindlin contact laws for a single contact.
+ */
+void test_contact_laws_one_contact() {
+  ContactLawParams params;
+  init_contact_law_params(30, 0.5, 10000000, 0, &params);
+  const ContactInput input = {
+    .dt = 0.01, .normal_velocity = 1, .tangent_velocity = 0, .overlap = 1,
+    .effective_radius = 25, .effective_mass = 1, .kn = 100, .ks = 0
+  };
+  double previous_normal = 0;
+  double previous_tangent = 0;
+  double normal_force;
+  double tangent_force;
+
+  // Elastic part 1, plus the dashpot: 2 * 0.5 * sqrt(1 * 100) * 1.
+  linear_damped_contact_law(&params, &input, &previous_normal, &previous_tangent, &normal_force, &tangent_force);
+  assert(normal_force, 11.0d, "test_contact_laws_one_contact - linear_damped normal_force");
+  assert(previous_normal, 1.0d, "test_contact_laws_one_contact - linear_damped previous_normal");
+
+  // 4/3 * (1e7 / 2) * sqrt(0.025 * 0.001) * 0.001.
+  previous_normal = 0;
+  hertz_mindlin_contact_law(&params, &input, &previous_normal, &previous_tangent, &normal_force, &tangent_force);
+  assert(normal_force, 33.3333333d, "test_contact_laws_one_contact - hertz_mindlin normal_force");
+  assert(tangent_force, 0.0d, "test_contact_laws_one_contact - hertz_mindlin tangent_force");
+}
+
+/**
+ * Checks the statistics of a chain of three particles, with one horizontal and one vertical contact.
+ * Each contact is listed in both directions, like compute_contacts does.
+ */
+void test_compute_statistics_chain() {
+  #define size 3
+  Particle particles[size] = { { 0, 0, 50, NULL, 0 }, { 100, 0, 50, NULL, 1 }, { 100, 100, 50, NULL, 2 } };
+  const Material materials[1] = { { 2, 0, 0, 0.5 } };
+  const MaterialId material_ids[size] = { 0 };
+  Vector velocities[size] = { { 1, 0 }, { 0, 0 }, { 0, 3 } };
+  Contact contacts[4] = { { 0, 1, 0 }, { 1, 0, 0 }, { 1, 2, 0 }, { 2, 1, 0 } };
+  double normal_forces[size * size] = { 0 };
+  normal_forces[1] = normal_forces[3] = 1;
+  normal_forces[5] = normal_forces[7] = 3;
+  StepStatistics statistics;
+
+  compute_statistics(size, size, 4, particles, materials, material_ids, contacts, normal_forces, velocities, &statistics);
+
+  assert(statistics.contacts, 2, "test_compute_statistics_chain - contacts");
+  assert(statistics.coordination_number, 1.3333333d, "test_compute_statistics_chain - coordination_number");
+  assert(statistics.mean_normal_force, 2.0d, "test_compute_statistics_chain - mean_normal_force");
+  assert(statistics.max_normal_force, 3.0d, "test_compute_statistics_chain - max_normal_force");
+  assert(statistics.strong_fraction, 0.5d, "test_compute_statistics_chain - strong_fraction");
+  assert(statistics.force_histogram[2], 1, "test_compute_statistics_chain - force_histogram[0.5]");
+  assert(statistics.force_histogram[6], 1, "test_compute_statistics_chain - force_histogram[1.5]");
+  assert(statistics.fabric_xx, 0.5d, "test_compute_statistics_chain - fabric_xx");
+  assert(statistics.fabric_xy, 0.0d, "test_compute_statistics_chain - fabric_xy");
+  assert(statistics.fabric_yy, 0.5d, "test_compute_statistics_chain - fabric_yy");
+  assert(statistics.kinetic_energy, 10.0d, "test_compute_statistics_chain - kinetic_energy");
+  assert(statistics.front_y, -50.0d, "test_compute_statistics_chain - front_y");
+  #undef size
+}
+
+/**
+ * Checks the equilibrium measures of a particle held by its contacts, a free falling one,
+ * and a removed one, which is not counted.
+ */
+void test_compute_equilibrium() {
+  #define size 3
+  Particle particles[size] = { { 0, 50, 50, NULL, 0 }, { 200, 300, 50, NULL, 1 }, { 400, 300, 0, NULL, 2 } };
+  const Material materials[1] = { { 2, 0, 0, 0.5 } };
+  const MaterialId material_ids[size] = { 0 };
+  Vector velocities[size] = { { 1, 0 }, { 0, 0 }, { 0, 30 } };
+  Vector forces[size] = { { 0, 2 * GRAVITY }, { 0, 0 }, { 500, 500 } };
+  EquilibriumMeasures measures;
+
+  compute_equilibrium(size, particles, materials, material_ids, velocities, forces, &measures);
+
+  assert(measures.kinetic_energy, 1.0d, "test_compute_equilibrium - kinetic_energy");
+  assert(measures.max_speed, 1.0d, "test_compute_equilibrium - max_speed");
+  assert(measures.unbalanced_force_ratio, 0.5d, "test_compute_equilibrium - unbalanced_force_ratio");
+  #undef size
+}
+
+/**
+ * Checks the fields of a single cell holding two particles pushed against each other along X:
+ * density, porosity, mass weighted velocity, and the compressive stress of the contact, counted once per pair.
+ * Uses two slabs, so their sum is checked too.
+ */
+void test_accumulate_fields_one_cell() {
+  #define size 2
+  Particle particles[size] = { { -50, 100, 50, NULL, 0 }, { 50, 100, 50, NULL, 1 } };
+  const Material materials[1] = { { 2, 0, 0, 0.5 } };
+  const MaterialId material_ids[size] = { 0 };
+  const Vector velocities[size] = { { 1, 0 }, { 3, 0 } };
+  const Contact contacts[2] = { { 0, 1, 0 }, { 1, 0, 0 } };
+  double normal_forces[size * size] = { 0 };
+  double tangent_forces[size * size] = { 0 };
+  normal_forces[1] = normal_forces[2] = 10;
+  FieldGrid field_grid;
+  FieldCell cells[2];
+  FieldValues values;
+
+  init_field_grid(2, 2, 100, 2, 10, 0, 2, &field_grid);
+  accumulate_fields(&field_grid, size, particles, materials, material_ids, velocities, size, 2, contacts,
+                    normal_forces, tangent_forces, cells);
+  field_values(&field_grid, cells, 0, 0, &values);
+
+  assert(field_grid_cells(&field_grid), 1, "test_accumulate_fields_one_cell - cells");
+  assert(values.x, 0.0d, "test_accumulate_fields_one_cell - x");
+  assert(values.y, 100.0d, "test_accumulate_fields_one_cell - y");
+  // 4 kg in 200 x 200 x 10 mm.
+  assert(values.density, 10000.0d, "test_accumulate_fields_one_cell - density");
+  assert(values.porosity, 0.6073009d, "test_accumulate_fields_one_cell - porosity");
+  assert(values.velocity_x, 2.0d, "test_accumulate_fields_one_cell - velocity_x");
+  // 10 N times 0.1 m over 0.0004 m3.
+  assert(values.stress_xx, 2500.0d, "test_accumulate_fields_one_cell - stress_xx");
+  assert(values.stress_xy, 0.0d, "test_accumulate_fields_one_cell - stress_xy");
+  assert(values.stress_yy, 0.0d, "test_accumulate_fields_one_cell - stress_yy");
+  assert(values.strain_rate_xx, 0.0d, "test_accumulate_fields_one_cell - strain_rate_xx");
+  #undef size
+}
+
+/**
+ * Checks that the fields are the same, to the last bit, whatever the number of threads,
+ * for a given number of slabs.
+ */
+void test_accumulate_fields_same_for_any_threads() {
+  #define size 97
+  #define num_slabs 5
+  Particle particles[size];
+  Vector velocities[size];
+  Contact contacts[size - 1];
+  double normal_forces[size * size] = { 0 };
+  double tangent_forces[size * size] = { 0 };
+  const Material materials[1] = { { 2, 0, 0, 0.5 } };
+  const MaterialId material_ids[size] = { 0 };
+  for (int i = 0; i < size; ++i) {
+    particles[i] = (Particle) { ((i * 37) % 800) - 400, (i * 53) % 600, 10 + (i % 7), NULL, i };
+    velocities[i] = (Vector) { (i % 11) * 0.37, (i % 5) * -0.91 };
+  }
+  for (int i = 0; i < size - 1; ++i) {
+    contacts[i] = (Contact) { i, i + 1, 0 };
+    normal_forces[(i * size) + i + 1] = 1.0 + (i * 0.013);
+    tangent_forces[(i * size) + i + 1] = -0.5 + (i * 0.007);
+  }
+  FieldGrid field_grid;
+  init_field_grid(8, 6, 100, 2, 10, 0, num_slabs, &field_grid);
+  FieldCell one_thread[12 * num_slabs];
+  FieldCell threads[12 * num_slabs];
+
+  const int max_threads = omp_get_max_threads();
+  omp_set_num_threads(1);
+  accumulate_fields(&field_grid, size, particles, materials, material_ids, velocities, size, size - 1, contacts,
+                    normal_forces, tangent_forces, one_thread);
+  omp_set_num_threads(3);
+  accumulate_fields(&field_grid, size, particles, materials, material_ids, velocities, size, size - 1, contacts,
+                    normal_forces, tangent_forces, threads);
+  omp_set_num_threads(max_threads);
+
+  assert(field_grid_cells(&field_grid), 12, "test_accumulate_fields_same_for_any_threads - cells");
+  assert(memcmp(one_thread, threads, 12 * sizeof(FieldCell)), 0, "test_accumulate_fields_same_for_any_threads - cells equal");
+  #undef num_slabs
+  #undef size
+}
+
+/**
+ * Checks that the flight recorder keeps only the last steps, with the contacts of the tracked particle,
+ * and that find_blow_up reports the first non finite particle.
+ */
+void test_flight_recorder_ring_buffer() {
+  #define size 2
+  Particle particles[size] = { { 0, 100, 50, NULL, 0 }, { 90, 100, 50, NULL, 1 } };
+  const Material materials[1] = { { 2, 0, 0, 0.5 } };
+  const MaterialId material_ids[size] = { 0 };
+  Vector forces[size] = { { 4, 0 }, { -4, 0 } };
+  Vector velocities[size] = { { 1, 0 }, { -1, 0 } };
+  Contact contacts[2] = { { 0, 1, 10 }, { 1, 0, 10 } };
+  double normal_forces[size * size] = { 0, 5, 5, 0 };
+  double tangent_forces[size * size] = { 0, 1, 1, 0 };
+  size_t tracked[1] = { 1 };
+  int slots[size];
+  RecordedState states[2];
+  FlightRecorder recorder;
+
+  recorder_init(&recorder, size, 1, tracked, 2, slots, states);
+  for (unsigned long step = 1; step <= 3; ++step) {
+    recorder_record(&recorder, step, 0.5, size, particles, materials, material_ids, forces, velocities,
+                    2, contacts, normal_forces, tangent_forces);
+  }
+
+  // Step 3 overwrote step 1, in the first row.
+  assert(states[0].step, 3, "test_flight_recorder_ring_buffer - newest step");
+  assert(states[1].step, 2, "test_flight_recorder_ring_buffer - oldest step");
+  assert(states[0].num_contacts, 1, "test_flight_recorder_ring_buffer - num_contacts");
+  assert(states[0].contacts[0].other_idx, 0, "test_flight_recorder_ring_buffer - contact other_idx");
+  assert(states[0].contacts[0].normal_force, 5.0d, "test_flight_recorder_ring_buffer - contact normal_force");
+  assert(states[0].acceleration.x_component, -2.0d, "test_flight_recorder_ring_buffer - acceleration.x_component");
+  assert(states[0].displacement.x_component, -0.5d, "test_flight_recorder_ring_buffer - displacement.x_component");
+
+  assert(find_blow_up(size, particles, velocities, 0), -1, "test_flight_recorder_ring_buffer - no blow up");
+  assert(find_blow_up(size, particles, velocities, 0.5), 0, "test_flight_recorder_ring_buffer - max speed");
+  velocities[1].y_component = NAN;
+  assert(find_blow_up(size, particles, velocities, 0), 1, "test_flight_recorder_ring_buffer - NaN");
+  #undef size
+}
+
+/**
+ * Checks that removing a particle outside the region and compacting keeps the others in order,
+ * with their contact history and ids, and clears the freed slots.
+ */
+void test_compact_particles_moves_history() {
+  #define size 3
+  #define capacity 4
+  Particle particles[size] = { { 0, 50, 50, NULL, 0 }, { 5000, 50, 50, NULL, 1 }, { 90, 50, 50, NULL, 2 } };
+  MaterialId material_ids[size] = { 1, 2, 3 };
+  Vector velocities[size] = { { 1, 0 }, { 2, 0 }, { 3, 0 } };
+  size_t ids[size] = { 10, 11, 12 };
+  size_t remap[size];
+  double normal_forces[capacity * capacity] = { 0 };
+  double tangent_forces[capacity * capacity] = { 0 };
+  normal_forces[(0 * capacity) + 2] = 7; // P2 <- P0.
+  normal_forces[(2 * capacity) + 0] = 8; // P0 <- P2.
+  normal_forces[(1 * capacity) + 2] = 9; // P2 <- P1, removed.
+  const Region region = { -1000, 0, 1000, 1000 };
+
+  assert(remove_outside_region(&region, size, particles, velocities), 1, "test_compact_particles_moves_history - removed");
+  const size_t kept = compact_particles(size, capacity, particles, material_ids, velocities, ids, normal_forces,
+                                        tangent_forces, 0, NULL, NULL, remap);
+
+  assert(kept, 2, "test_compact_particles_moves_history - kept");
+  assert(remap[1], (double) REMOVED_PARTICLE, "test_compact_particles_moves_history - remap[removed]");
+  assert(remap[2], 1, "test_compact_particles_moves_history - remap[2]");
+  assert(particles[1].x_coordinate, 90, "test_compact_particles_moves_history - particles[1].x_coordinate");
+  assert(particles[1].idx, 1, "test_compact_particles_moves_history - particles[1].idx");
+  assert(material_ids[1], 3, "test_compact_particles_moves_history - material_ids[1]");
+  assert(ids[1], 12, "test_compact_particles_moves_history - ids[1]");
+  assert(normal_forces[(0 * capacity) + 1], 7, "test_compact_particles_moves_history - history P1 <- P0");
+  assert(normal_forces[(1 * capacity) + 0], 8, "test_compact_particles_moves_history - history P0 <- P1");
+  assert(normal_forces[(0 * capacity) + 2], 0, "test_compact_particles_moves_history - freed column");
+  assert(normal_forces[(1 * capacity) + 2], 0, "test_compact_particles_moves_history - freed history");
+  assert(normal_forces[(2 * capacity) + 0], 0, "test_compact_particles_moves_history - freed row");
+  #undef capacity
+  #undef size
+}
+
+/**
+ * Checks that, with periodic boundaries along X, the particles at opposite sides of the grid touch,
+ * and a particle leaving the grid by the right comes back by the left.
+ */
+void test_periodic_x_contacts_across_boundary() {
+  #define size 2
+  #define x_squares 4
+  #define y_squares 1
+  Particle particles[size] = { { -190, 50, 15, NULL, 0 }, { 190, 50, 15, NULL, 1 } };
+  Particle *grid[x_squares * y_squares] = { NULL };
+  Particle *grid_lasts[x_squares * y_squares] = { NULL };
+  Contact contacts[2 * size];
+  Vector displacements[size] = { { 0, 0 }, { 0.02, 0 } };
+
+  periodic_x_length = x_squares * 100;
+  fill_grid(size, x_squares, y_squares, 100, particles, grid, grid_lasts);
+  const size_t contacts_size = compute_contacts((Particle const *const *) grid, x_squares, y_squares, 100, contacts);
+  displace_particle(1, displacements, particles);
+  periodic_x_length = 0;
+
+  assert(contacts_size, 2, "test_periodic_x_contacts_across_boundary - contacts_size");
+  assert(contacts[0].overlap, 10, "test_periodic_x_contacts_across_boundary - overlap");
+  assert(particles[1].x_coordinate, -190, "test_periodic_x_contacts_across_boundary - wrapped x_coordinate");
+  #undef y_squares
+  #undef x_squares
+  #undef size
+}
+
+/**
+ * Checks that the sort and sweep broad phase finds the same contacts as the grid,
+ * also on the next call, which re-sorts the previous order, after the particles moved.
+ */
+void test_compute_contacts_sweep_matches_grid() {
+  #define size 6
+  #define x_squares 4
+  #define y_squares 2
+  Particle particles[size] = {
+    { -150, 50, 50, NULL, 0 }, { -60, 60, 50, NULL, 1 }, { 30, 50, 50, NULL, 2 },
+    { 120, 150, 50, NULL, 3 }, { -100, 130, 50, NULL, 4 }, { 500, 50, 50, NULL, 5 } // The last one is outside.
+  };
+  Particle *grid[x_squares * y_squares];
+  Particle *grid_lasts[x_squares * y_squares];
+  Contact grid_contacts[size * size];
+  Contact sweep_contacts[size * size];
+  SweepEntry entries[size];
+  SweepList list = { 0, entries };
+
+  for (int call = 0; call < 2; ++call) {
+    memset(grid, 0, sizeof(grid));
+    memset(grid_lasts, 0, sizeof(grid_lasts));
+    fill_grid(size, x_squares, y_squares, 100, particles, grid, grid_lasts);
+    const size_t grid_size = compute_contacts((Particle const *const *) grid, x_squares, y_squares, 100, grid_contacts);
+    const size_t sweep_size = compute_contacts_sweep(size, particles, x_squares, y_squares, 100, &list, sweep_contacts);
+    assert(sweep_size, grid_size, "test_compute_contacts_sweep_matches_grid - contacts_size");
+
+    // Every contact of the grid is found by the sweep, with the same overlap.
+    size_t matched = 0;
+    for (size_t i = 0; i < grid_size; ++i) {
+      for (size_t j = 0; j < sweep_size; ++j) {
+        if (sweep_contacts[j].p1_idx == grid_contacts[i].p1_idx && sweep_contacts[j].p2_idx == grid_contacts[i].p2_idx
+            && sweep_contacts[j].overlap == grid_contacts[i].overlap) {
+          matched++;
+          break;
+        }
+      }
+    }
+    assert(matched, grid_size, "test_compute_contacts_sweep_matches_grid - matched contacts");
+
+    // Swap the order along X of two particles for the second call.
+    particles[0].x_coordinate = 60;
+    particles[2].x_coordinate = -150;
+  }
+  #undef y_squares
+  #undef x_squares
+  #undef size
+}
+
+/**
+ * Checks the frame index of a store laid out in memory: the frames are found by step,
+ * and the particles by id, both in a frame with sorted ids and in one without.
+ */
+void test_frame_store_find() {
+  FrameStoreHeader header;
+  const size_t size = frame_store_layout(3, 6, 0, &header);
+  uint64_t *data = (uint64_t*) calloc(size / sizeof(uint64_t), sizeof(uint64_t));
+  memcpy(data, &header, sizeof(header));
+  FrameStore store;
+  frame_store_attach(data, size, &store);
+
+  FrameEntry *frames = (FrameEntry*) store.frames;
+  uint64_t *ids = (uint64_t*) store.ids;
+  const FrameEntry entries[3] = {
+    { 10, 0, 2, FRAME_KIND_OUT, FRAME_IDS_SORTED, 0, 0, 0, 0 },
+    { 20, 2, 2, FRAME_KIND_OUT, FRAME_IDS_SORTED, 0, 0, 0, 0 },
+    { 20, 4, 2, FRAME_KIND_FROM_GRID, 0, 0, 0, 0, 0 }
+  };
+  const uint64_t row_ids[6] = { 3, 7, 4, 7, 9, 2 };
+  memcpy(frames, entries, sizeof(entries));
+  memcpy(ids, row_ids, sizeof(row_ids));
+
+  assert(frame_store_find_step(&store, FRAME_KIND_OUT, 0), 0, "test_frame_store_find - first frame");
+  assert(frame_store_find_step(&store, FRAME_KIND_OUT, 11), 1, "test_frame_store_find - next frame");
+  assert(frame_store_find_step(&store, FRAME_KIND_OUT, 21), 2, "test_frame_store_find - after the last");
+  assert(frame_store_find_step(&store, FRAME_KIND_FROM_GRID, 0), 2, "test_frame_store_find - other kind");
+  assert(frame_store_find_particle(&store, &frames[1], 7), 3, "test_frame_store_find - sorted ids");
+  assert(frame_store_find_particle(&store, &frames[0], 4) == SIZE_MAX, 1, "test_frame_store_find - missing id");
+  assert(frame_store_find_particle(&store, &frames[2], 2), 5, "test_frame_store_find - unsorted ids");
+  free(data);
+}
+
+/**
+ * Writes size bytes of data to path, for the frame store tests.
+ */
+static void write_store_file(const char *path, const void *data, const size_t size) {
+  FILE *file = fopen(path, "wb");
+  fwrite(data, 1, size, file);
+  fclose(file);
+}
+
+/**
+ * Checks that frame_store_open maps a valid store, and rejects one whose sections or frames
+ * point past the end of the file, including offsets and counts that would overflow.
+ */
+void test_frame_store_open_checks_sections() {
+  const char *path = "/tmp/2DPartInt-test-store.bin";
+  FrameStoreHeader header;
+  const size_t size = frame_store_layout(1, 4, 1, &header);
+  uint64_t *data = (uint64_t*) calloc(size / sizeof(uint64_t), sizeof(uint64_t));
+  memcpy(data, &header, sizeof(header));
+  FrameEntry *frame = (FrameEntry*) ((char*) data + header.frames_offset);
+  *frame = (FrameEntry) { 10, 0, 4, FRAME_KIND_OUT, 0, 0, 0, 0, 0 };
+  FrameStoreHeader *file_header = (FrameStoreHeader*) data;
+  FrameStore store;
+
+  write_store_file(path, data, size);
+  assert(frame_store_open(path, &store), 0, "test_frame_store_open_checks_sections - valid");
+  frame_store_close(&store);
+
+  file_header->squares_offset = size - FRAME_STORE_ALIGNMENT;
+  file_header->num_squares = 3;
+  write_store_file(path, data, size);
+  assert(frame_store_open(path, &store) != 0, 1, "test_frame_store_open_checks_sections - section past the end");
+
+  file_header->squares_offset = header.squares_offset;
+  file_header->num_squares = header.num_squares;
+  file_header->num_rows = UINT64_MAX / 4;
+  write_store_file(path, data, size);
+  assert(frame_store_open(path, &store) != 0, 1, "test_frame_store_open_checks_sections - overflowing rows");
+
+  file_header->num_rows = header.num_rows;
+  frame->first_row = 2;
+  frame->num_rows = UINT64_MAX;
+  write_store_file(path, data, size);
+  assert(frame_store_open(path, &store) != 0, 1, "test_frame_store_open_checks_sections - frame past the rows");
+
+  remove(path);
+  free(data);
+}
+
+/**
+ * Checks that a settled bed is loaded as it was saved, and that a file with another key,
+ * a corrupted byte or a missing end is rejected without touching the arrays.
+ */
+void test_bed_cache_round_trip() {
+  const char *path = "/tmp/2DPartInt-test-bed.bin";
+  Particle particles[3] = { { 0, 5, 1, NULL, 0 }, { -1, 1, 1, NULL, 1 }, { 1, 1, 1, NULL, 2 } };
+  Vector velocities[3] = { { 0, 0 }, { 0.5, -0.25 }, { 0, 0.125 } };
+  accum normal_forces[9] = { 0 };
+  accum tangent_forces[9] = { 0 };
+  accum wall_normal_forces[3] = { 0, 0, 4 };
+  accum wall_tangent_forces[3] = { 0 };
+  normal_forces[(1 * 3) + 2] = 2;
+  tangent_forces[(2 * 3) + 1] = -3;
+
+  assert(fnv1a(FNV1A_OFFSET_BASIS, "a", 1) == UINT64_C(0xaf63dc4c8601ec8c), 1, "test_bed_cache_round_trip - fnv1a");
+  assert(bed_cache_save(path, 42, 7, 3, 3, particles, velocities, normal_forces, tangent_forces,
+                        1, wall_normal_forces, wall_tangent_forces), 0, "test_bed_cache_round_trip - save");
+
+  Particle loaded[3] = { { 0, 0, 1, NULL, 0 }, { 0, 0, 1, NULL, 1 }, { 0, 0, 1, NULL, 2 } };
+  Vector loaded_velocities[3] = { { 0, 0 } };
+  accum loaded_normal[9] = { 0 };
+  accum loaded_tangent[9] = { 0 };
+  accum loaded_wall_normal[3] = { 0 };
+  accum loaded_wall_tangent[3] = { 0 };
+  uint64_t settle_steps = 0;
+  assert(bed_cache_load(path, 43, &settle_steps, 3, 3, loaded, loaded_velocities, loaded_normal, loaded_tangent,
+                        1, loaded_wall_normal, loaded_wall_tangent) != 0, 1, "test_bed_cache_round_trip - other key");
+  assert(bed_cache_load(path, 42, &settle_steps, 3, 3, loaded, loaded_velocities, loaded_normal, loaded_tangent,
+                        1, loaded_wall_normal, loaded_wall_tangent), 0, "test_bed_cache_round_trip - load");
+  assert(settle_steps, 7, "test_bed_cache_round_trip - steps");
+  assert(loaded[1].x_coordinate, -1, "test_bed_cache_round_trip - x");
+  assert(loaded[0].y_coordinate, 5, "test_bed_cache_round_trip - y");
+  assert(loaded_velocities[1].y_component, -0.25, "test_bed_cache_round_trip - velocity");
+  assert(loaded_normal[(1 * 3) + 2], 2, "test_bed_cache_round_trip - normal history");
+  assert(loaded_tangent[(2 * 3) + 1], -3, "test_bed_cache_round_trip - tangent history");
+  assert(loaded_wall_normal[2], 4, "test_bed_cache_round_trip - wall history");
+
+  // Flip a bit of the first velocity, then drop the last byte: both fail the check before any copy.
+  Particle untouched[3] = { { 0, 0, 1, NULL, 0 }, { 0, 0, 1, NULL, 1 }, { 0, 0, 1, NULL, 2 } };
+  Vector untouched_velocities[3] = { { 0, 0 } };
+  FILE *file = fopen(path, "r+b");
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fseek(file, sizeof(BedCacheHeader) + (3 * 2 * sizeof(real)), SEEK_SET);
+  const int byte = fgetc(file);
+  fseek(file, -1, SEEK_CUR);
+  fputc(byte ^ 1, file);
+  fclose(file);
+  assert(bed_cache_load(path, 42, &settle_steps, 3, 3, untouched, untouched_velocities, loaded_normal, loaded_tangent,
+                        1, loaded_wall_normal, loaded_wall_tangent) != 0, 1, "test_bed_cache_round_trip - corrupted");
+  assert(untouched[1].x_coordinate, 0, "test_bed_cache_round_trip - corrupted untouched");
+  assert(bed_cache_save(path, 42, 7, 3, 3, particles, velocities, normal_forces, tangent_forces,
+                        1, wall_normal_forces, wall_tangent_forces), 0, "test_bed_cache_round_trip - save again");
+  unsigned char bytes[1024];
+  file = fopen(path, "rb");
+  const size_t read = fread(bytes, 1, sizeof(bytes), file);
+  fclose(file);
+  file = fopen(path, "wb");
+  fwrite(bytes, 1, read - 1, file);
+  fclose(file);
+  assert(read, size, "test_bed_cache_round_trip - size");
+  assert(bed_cache_load(path, 42, &settle_steps, 3, 3, untouched, untouched_velocities, loaded_normal, loaded_tangent,
+                        1, loaded_wall_normal, loaded_wall_tangent) != 0, 1, "test_bed_cache_round_trip - truncated");
+  assert(untouched_velocities[1].y_component, 0, "test_bed_cache_round_trip - truncated untouched");
+  remove(path);
+}
+
+/**
+ * Checks that png_file_size matches the size of the files written by write_png,
+ * for an image smaller and one larger than a stored deflate block.
  */
+void test_png_file_size_matches_written() {
+  const char *path = "/tmp/2DPartInt-test-frame.png";
+  const int sizes[2][2] = { { 3, 2 }, { 200, 150 } };
+  for (int i = 0; i < 2; ++i) {
+    const int width = sizes[i][0];
+    const int height = sizes[i][1];
+    unsigned char *image = calloc((size_t) width * height * 3, 1);
+    assert(write_png(path, width, height, image), 0, "test_png_file_size_matches_written - write");
+    FILE *file = fopen(path, "rb");
+    fseek(file, 0, SEEK_END);
+    const long written = ftell(file);
+    fclose(file);
+    assert(png_file_size(width, height), written, "test_png_file_size_matches_written - size");
+    free(image);
+  }
+  remove(path);
+}
+
+/**
+ * Checks that the binned renderer draws a disc in the tiles next to the one of its center,
+ * including a disc whose center is outside the image, and leaves out the removed particles.
+ */
+void test_render_particles_across_tiles() {
+  const RenderView view = { 2 * RENDER_TILE_SIZE, RENDER_TILE_SIZE, 0, 0, 1, RENDER_COLOR_VELOCITY };
+  Particle particles[3] = {
+    { .x_coordinate = 60, .y_coordinate = 32, .radius = 10, .idx = 0 },
+    { .x_coordinate = 100, .y_coordinate = 32, .radius = 0, .idx = 1 },
+    { .x_coordinate = 200, .y_coordinate = 32, .radius = 80, .idx = 2 }
+  };
+  Vector velocities[3] = { { 0 } };
+  Vector forces[3] = { { 0 } };
+  size_t tile_offsets[3];
+  size_t tile_order[3];
+  unsigned char image[2 * RENDER_TILE_SIZE * RENDER_TILE_SIZE * 3];
+  render_particles(&view, 3, particles, velocities, forces, NULL, tile_offsets, tile_order, image);
+  assert(render_num_tiles(view.width, view.height), 2, "test_render_particles_across_tiles - tiles");
+  assert(tile_offsets[2], 2, "test_render_particles_across_tiles - binned");
+  // Lowest color of the map, and the background.
+  assert(image[((32 * view.width) + 66) * 3], 48, "test_render_particles_across_tiles - next tile");
+  assert(image[((32 * view.width) + 100) * 3], 255, "test_render_particles_across_tiles - removed");
+  assert(image[((32 * view.width) + 125) * 3], 48, "test_render_particles_across_tiles - outside center");
+}
+
+/**
+ * Checks that with ids the particles are colored by their id, not by their index.
+ */
+void test_render_particles_colors_by_id() {
+  const RenderView view = { RENDER_TILE_SIZE, RENDER_TILE_SIZE, 0, 0, 1, RENDER_COLOR_ID };
+  Particle particles[2] = {
+    { .x_coordinate = 16, .y_coordinate = 32, .radius = 8, .idx = 0 },
+    { .x_coordinate = 48, .y_coordinate = 32, .radius = 8, .idx = 1 }
+  };
+  Vector velocities[2] = { { 0 } };
+  Vector forces[2] = { { 0 } };
+  const size_t ids[2] = { 7, 3 };
+  size_t tile_offsets[2];
+  size_t tile_order[2];
+  unsigned char image[RENDER_TILE_SIZE * RENDER_TILE_SIZE * 3];
+  render_particles(&view, 2, particles, velocities, forces, ids, tile_offsets, tile_order, image);
+  // The lowest id gets the first color of the map, the highest the last one.
+  assert(image[((32 * view.width) + 48) * 3], 48, "test_render_particles_colors_by_id - lowest id");
+  assert(image[((32 * view.width) + 16) * 3], 210, "test_render_particles_colors_by_id - highest id");
+}
+
+/**
+ * Checks that the tracer only records while active, and that with a full buffer it drops whole phases,
+ * so every recorded begin has its end.
+ */
+void test_tracer_drops_whole_phases() {
+  TraceEvent events[5];
+  tracer_init(1, 5, events);
+  trace_begin("inactive");
+  trace_end("inactive");
+  assert(trace_recorded(), 0, "test_tracer_drops_whole_phases - inactive");
+
+  tracer_set_step(3, 1);
+  trace_begin("step");
+  trace_begin("forces");
+  trace_end("forces");
+  // Only room for the end of "step" left.
+  trace_begin("output");
+  trace_begin("format");
+  trace_end("format");
+  trace_end("output");
+  trace_end("step");
+  tracer_set_step(4, 0);
+  assert(trace_recorded(), 4, "test_tracer_drops_whole_phases - recorded");
+  assert(trace_dropped(), 4, "test_tracer_drops_whole_phases - dropped");
+  assert(events[0].type == 'B' && strcmp(events[0].name, "step") == 0, 1, "test_tracer_drops_whole_phases - begin");
+  assert(events[3].type == 'E' && strcmp(events[3].name, "step") == 0, 1, "test_tracer_drops_whole_phases - end");
+  assert(events[1].step, 3, "test_tracer_drops_whole_phases - step");
+  assert(events[3].time >= events[0].time, 1, "test_tracer_drops_whole_phases - time");
+}
+
+/**
+ * Checks the radius, box and nearest queries on a filled grid against a linear scan,
+ * and that the batch gives the same results. The particles moved a little after filling the grid, within the margin.
+ */
+void test_spatial_queries_match_scan() {
+  #define size 200
+  #define x_squares 8
+  #define y_squares 6
+  #define num_queries 30
+  Particle particles[size];
+  Particle *grid[x_squares * y_squares] = { NULL };
+  Particle *grid_lasts[x_squares * y_squares] = { NULL };
+  srand(7);
+  for (int i = 0; i < size; ++i) {
+    particles[i] = (Particle) { (rand() % 800) - 400, rand() % 600, 10, NULL, i };
+  }
+  particles[5].radius = 0; // Removed.
+  fill_grid(size, x_squares, y_squares, 100, particles, grid, grid_lasts);
+  for (int i = 0; i < size; i += 3) {
+    particles[i].x_coordinate += 4;
+  }
+  const GridView view = { (Particle const *const *) grid, x_squares, y_squares, 100, 5 };
+
+  SpatialQuery queries[num_queries];
+  size_t radius_mismatches = 0;
+  size_t box_mismatches = 0;
+  size_t nearest_mismatches = 0;
+  for (int q = 0; q < num_queries; ++q) {
+    const real x = (rand() % 1000) - 500;
+    const real y = (rand() % 800) - 100;
+    const real radius = 20 + (rand() % 150);
+    size_t results[size];
+    size_t expected_radius = 0;
+    size_t expected_box = 0;
+    for (int i = 0; i < size; ++i) {
+      const real x_diff = particles[i].x_coordinate - x;
+      const real y_diff = particles[i].y_coordinate - y;
+      const int in_grid = particles[i].radius > 0 && particles[i].y_coordinate < 600;
+      expected_radius += in_grid && (x_diff * x_diff) + (y_diff * y_diff) <= radius * radius;
+      expected_box += in_grid && fabs(x_diff) <= radius && y_diff >= 0 && y_diff <= radius;
+    }
+    radius_mismatches += query_radius(&view, x, y, radius, results, size) != expected_radius;
+    box_mismatches += query_box(&view, x - radius, y, x + radius, y + radius, results, size) != expected_box;
+
+    // The k nearest have the k smallest distances: none of the rest is closer than the last one.
+    // Squared distances in real, as the query compares them, so the test holds in both precisions.
+    real distances[4];
+    const size_t found = query_nearest(&view, x, y, 4, results, distances);
+    const real last_x_diff = particles[results[3]].x_coordinate - x;
+    const real last_y_diff = particles[results[3]].y_coordinate - y;
+    const real last_squared = (last_x_diff * last_x_diff) + (last_y_diff * last_y_diff);
+    size_t closer = 0;
+    for (int i = 0; i < size; ++i) {
+      const real x_diff = particles[i].x_coordinate - x;
+      const real y_diff = particles[i].y_coordinate - y;
+      closer += particles[i].radius > 0 && (x_diff * x_diff) + (y_diff * y_diff) < last_squared;
+    }
+    nearest_mismatches += found != 4 || closer != 3 || distances[0] > distances[3];
+
+    queries[q] = (SpatialQuery) { (SpatialQueryKind) (q % 3), x, y, x + radius, y + radius, radius, 4 };
+  }
+  assert(radius_mismatches, 0, "test_spatial_queries_match_scan - radius");
+  assert(box_mismatches, 0, "test_spatial_queries_match_scan - box");
+  assert(nearest_mismatches, 0, "test_spatial_queries_match_scan - nearest");
+
+  size_t batch_results[num_queries * size];
+  size_t counts[num_queries];
+  run_spatial_queries(&view, num_queries, queries, size, batch_results, counts);
+  size_t batch_mismatches = 0;
+  for (int q = 0; q < num_queries; ++q) {
+    size_t results[size];
+    const SpatialQuery *query = &queries[q];
+    const size_t expected = (query->kind == SPATIAL_QUERY_RADIUS)
+      ? query_radius(&view, query->x, query->y, query->radius, results, size)
+      : (query->kind == SPATIAL_QUERY_BOX)
+      ? query_box(&view, query->x, query->y, query->x_max, query->y_max, results, size)
+      : query_nearest(&view, query->x, query->y, query->k, results, NULL);
+    batch_mismatches += counts[q] != expected
+      || (expected > 0 && batch_results[(q * size) + expected - 1] != results[expected - 1]);
+  }
+  assert(batch_mismatches, 0, "test_spatial_queries_match_scan - batch");
+  #undef num_queries
+  #undef y_squares
+  #undef x_squares
+  #undef size
+}
+
 void test_compute_acceleration_one_element() {
   #define size 1
   Vector forces[size] = { { 30, 30 } };
-  ParticleProperties particle_properties[size] = { { 3, 0, 0 } };
+  const Material materials[size] = { { 3, 0, 0, 1.0 / 3 } };
+  const MaterialId material_ids[size] = { 0 };
   Vector accelerations[size] = { { 0 } };
 
-  compute_acceleration(0, particle_properties, forces, accelerations);
+  compute_acceleration(0, materials, material_ids, forces, accelerations);
 
   assert(accelerations[0].x_component, 10.0d, "test_compute_acceleration_one_element - x_component");
   assert(accelerations[0].y_component, 10.0d, "test_compute_acceleration_one_element - y_component");
@@ -205,12 +1105,13 @@ void test_compute_acceleration_one_element() {
 void test_compute_acceleration_multiple_elements() {
   #define size 3
   Vector forces[size] = { { -12.58, -15.896 }, { 13.945, -200.826 }, { -543.62, -0.62 } };
-  ParticleProperties particle_properties[size] = { { 0.367, 0, 0 }, { 3.967, 0, 0 }, { 0.52, 0, 0 } };
+  const Material materials[size] = { { 0.367, 0, 0, 1 / 0.367 }, { 3.967, 0, 0, 1 / 3.967 }, { 0.52, 0, 0, 1 / 0.52 } };
+  const MaterialId material_ids[size] = { 0, 1, 2 };
   Vector accelerations[size] = { { 0 } };
 
-  compute_acceleration(0, particle_properties, forces, accelerations);
-  compute_acceleration(1, particle_properties, forces, accelerations);
-  compute_acceleration(2, particle_properties, forces, accelerations);
+  compute_acceleration(0, materials, material_ids, forces, accelerations);
+  compute_acceleration(1, materials, material_ids, forces, accelerations);
+  compute_acceleration(2, materials, material_ids, forces, accelerations);
 
   Vector expected[size] = { { -34.2779d, -43.31335149863761d }, { 3.5152508192588856d, -50.6241d }, { -1045.4231d, -1.1923d } };
   for (size_t i = 0; i < size; ++i) {
@@ -292,6 +1193,77 @@ void test_displace_particles_multiple_elements() {
   #undef size
 }
 
+/**
+ * Checks that integrate_particles gives the same results as the separate integration functions,
+ * including gravity and the floor limit, and that it fills the intermediate arrays when asked.
+ */
+void test_integrate_particles_matches_separate_steps() {
+  #define size 3
+  const Material materials[size] = { { 0.367, 0, 0, 1 / 0.367 }, { 3.967, 0, 0, 1 / 3.967 }, { 0.52, 0, 0, 1 / 0.52 } };
+  const MaterialId material_ids[size] = { 0, 1, 2 };
+  Vector forces[size] = { { -12.58, -15.896 }, { 13.945, -200.826 }, { -543.62, 0.62 } };
+  Particle expected[size] = { { 0, 100, 50, NULL, 0 }, { 111, 51, 50, NULL, 1 }, { 10, 300, 50, NULL, 2 } };
+  Vector expected_velocities[size] = { { 5.332, 2.123 }, { 7.12, -8.96 }, { 61.52, 1293.123 } };
+  Vector expected_accelerations[size] = { { 0 } };
+  Vector expected_displacements[size] = { { 0 } };
+  Particle particles[size];
+  Vector velocities[size];
+  Vector accelerations[size];
+  Vector displacements[size];
+  const double dt = 0.00025;
+
+  for (size_t i = 0; i < size; ++i) {
+    particles[i] = expected[i];
+    velocities[i] = expected_velocities[i];
+  }
+
+  Vector forces_with_gravity[size];
+  for (size_t i = 0; i < size; ++i) {
+    forces_with_gravity[i] = forces[i];
+  }
+  apply_gravity(size, materials, material_ids, forces_with_gravity);
+  for (size_t i = 0; i < size; ++i) {
+    compute_acceleration(i, materials, material_ids, forces_with_gravity, expected_accelerations);
+    compute_velocity(dt, i, expected_accelerations, expected_velocities);
+    compute_displacement(dt, i, expected_velocities, expected_displacements);
+    displace_particle(i, expected_displacements, expected);
+    fix_displacement(i, expected_velocities, expected);
+  }
+
+  integrate_particles(dt, size, materials, material_ids, forces, velocities, particles, accelerations, displacements);
+
+  for (size_t i = 0; i < size; ++i) {
+    for_assert(particles[i].x_coordinate, expected[i].x_coordinate, "test_integrate_particles_matches_separate_steps - x_coordinate", i);
+    for_assert(particles[i].y_coordinate, expected[i].y_coordinate, "test_integrate_particles_matches_separate_steps - y_coordinate", i);
+    for_assert(velocities[i].x_component, expected_velocities[i].x_component, "test_integrate_particles_matches_separate_steps - velocity.x_component", i);
+    for_assert(velocities[i].y_component, expected_velocities[i].y_component, "test_integrate_particles_matches_separate_steps - velocity.y_component", i);
+    for_assert(accelerations[i].y_component, expected_accelerations[i].y_component, "test_integrate_particles_matches_separate_steps - acceleration.y_component", i);
+    for_assert(displacements[i].y_component, expected_displacements[i].y_component, "test_integrate_particles_matches_separate_steps - displacement.y_component", i);
+  }
+  #undef size
+}
+
+/**
+ * Checks that integrate_particles leaves the removed particles (radius 0) where they are, at rest,
+ * and still moves the others.
+ */
+void test_integrate_particles_leaves_removed() {
+  #define size 2
+  const Material materials[1] = { { 2, 0, 0, 0.5 } };
+  const MaterialId material_ids[size] = { 0 };
+  const Vector forces[size] = { { 4, 0 }, { 4, 0 } };
+  Particle particles[size] = { { 10, 300, 0, NULL, 0 }, { 10, 300, 50, NULL, 1 } };
+  Vector velocities[size] = { { 1, 1 }, { 1, 1 } };
+
+  integrate_particles(0.001, size, materials, material_ids, forces, velocities, particles, NULL, NULL);
+
+  assert(particles[0].x_coordinate, 10, "test_integrate_particles_leaves_removed - removed x");
+  assert(particles[0].y_coordinate, 300, "test_integrate_particles_leaves_removed - removed y");
+  assert(velocities[0].y_component, 0, "test_integrate_particles_leaves_removed - removed velocity");
+  assert(particles[1].x_coordinate > 10, 1, "test_integrate_particles_leaves_removed - kept x");
+  #undef size
+}
+
 /**
  * Tests entry point.
  * All tests run here.
@@ -303,12 +1275,36 @@ int main(void) {
   // Execute all tests.
   //test_compute_forces_one_contact(); COMMENTED BECAUSE OF THE NEW COLLISION DETECTION MODULE. We no longer collide p1 with p2 and p2 with p1, but rather we found both collisions separetaly, and generate twice the number of contacts, so comptue_forces only computes  p1 with p2, and on another function call p2 with p1
   //test_compute_forces_multiple_contacts();
+  test_compute_forces_simd_matches_scalar();
+  test_compute_forces_grouped_matches_serial();
+  test_compute_forces_different_materials_opposite();
+  test_compute_wall_forces_one_contact();
+  test_damp_forces();
+  test_contact_laws_one_contact();
+  test_compute_statistics_chain();
+  test_compute_equilibrium();
+  test_accumulate_fields_one_cell();
+  test_accumulate_fields_same_for_any_threads();
+  test_flight_recorder_ring_buffer();
+  test_compact_particles_moves_history();
+  test_periodic_x_contacts_across_boundary();
+  test_compute_contacts_sweep_matches_grid();
+  test_frame_store_find();
+  test_frame_store_open_checks_sections();
+  test_bed_cache_round_trip();
+  test_png_file_size_matches_written();
+  test_render_particles_across_tiles();
+  test_render_particles_colors_by_id();
+  test_tracer_drops_whole_phases();
+  test_spatial_queries_match_scan();
   test_compute_acceleration_one_element();
   test_compute_acceleration_multiple_elements();
   test_compute_velocity_one_element();
   test_compute_velocity_multiple_elements();
   test_displace_particles_one_element();
   test_displace_particles_multiple_elements();
+  test_integrate_particles_matches_separate_steps();
+  test_integrate_particles_leaves_removed();
 
   // If, at least one test failed, exit with an error code.
   return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;